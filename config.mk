@@ -4,6 +4,10 @@ NAME		= rickmod
 # Change this to build a standalone modplayer binary
 STANDALONE	?= 0
 TRACKER		?= 0
+# Set to 0 for targets without POSIX (render cache and other host features)
+HOSTED		?= 1
+# Set to 0 to compile out the rm_get_stats() counters
+STATS		?= 1
 
 # Filenames
 AFILE		= $(NAME).a
@@ -35,5 +39,14 @@ ifeq ($(TRACKER),1)
 CFLAGS		+= -DTRACKER
 endif
 
+ifeq ($(STATS),1)
+CFLAGS		+= -DSTATS
+endif
+
+ifeq ($(HOSTED),1)
+CFLAGS		+= -DHOSTED
+LDFLAGS		+= -pthread -lm
+endif
+
 # Makefile configurations
 MAKEFLAGS	+=	--no-print-directory
@@ -0,0 +1,13 @@
+#ifndef RICKMOD_COMMAND_H__
+#define	RICKMOD_COMMAND_H__
+
+
+#include <stdint.h>
+#include "rickmod.h"
+
+void rickmod_command_init(struct RickmodState *rm);
+struct RickmodCommand *rickmod_command_peek(struct RickmodState *rm);
+void rickmod_command_done(struct RickmodState *rm);
+
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef RICKMOD_COMPILED_H__
+#define	RICKMOD_COMPILED_H__
+
+
+#include <stdint.h>
+#include "rickmod.h"
+
+int rickmod_compiled_check(const uint8_t *mod, int mod_len);
+int rickmod_compiled_load(struct RickmodState *rm, uint8_t *mod, int mod_len);
+int rickmod_compiled_probe(const uint8_t *mod, int mod_len, struct RickmodInfo *info);
+int rickmod_compiled_own_patterns(struct RickmodState *rm);
+
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef RICKMOD_EVENTS_H__
+#define	RICKMOD_EVENTS_H__
+
+
+#include <stdint.h>
+#include "rickmod.h"
+
+void rickmod_events_free(struct RickmodState *rm);
+void rickmod_event_emit(struct RickmodState *rm, int type, int channel);
+void rickmod_event_row(struct RickmodState *rm);
+
+
+#endif
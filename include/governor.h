@@ -0,0 +1,23 @@
+#ifndef RICKMOD_GOVERNOR_H__
+#define	RICKMOD_GOVERNOR_H__
+
+
+#include <stdint.h>
+#include "rickmod.h"
+
+#ifdef HOSTED
+#define	GOVERNOR_KERNEL(rm, channel) ((rm)->governor && rickmod_governor_nearest((rm), (channel)) ? ma_add_nearest : ma_add)
+#define	GOVERNOR_DEGRADED(rm) ((rm)->governor && rickmod_governor_degraded(rm))
+#else
+#define	GOVERNOR_KERNEL(rm, channel) ma_add
+#define	GOVERNOR_DEGRADED(rm) 0
+#endif
+
+void rickmod_governor_free(struct RickmodState *rm);
+void rickmod_governor_begin(struct RickmodState *rm);
+void rickmod_governor_end(struct RickmodState *rm, int samples);
+int rickmod_governor_nearest(struct RickmodState *rm, int channel);
+int rickmod_governor_degraded(struct RickmodState *rm);
+
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef RICKMOD_LOADER_H__
+#define	RICKMOD_LOADER_H__
+
+
+#include "rickmod.h"
+
+void rickmod_loader_free(struct RickmodState *rm);
+
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef RICKMOD_MEMO_H__
+#define	RICKMOD_MEMO_H__
+
+
+#include <stdint.h>
+#include "rickmod.h"
+
+void rickmod_memo_free(struct RickmodState *rm);
+void rickmod_memo_abort(struct RickmodState *rm);
+void rickmod_memo_flush(struct RickmodState *rm);
+int rickmod_memo_replaying(struct RickmodState *rm);
+int rickmod_memo_replay(struct RickmodState *rm, int32_t *left, int32_t *right, int samples);
+void rickmod_memo_record(struct RickmodState *rm, int32_t *left, int32_t *right, int samples);
+void rickmod_memo_tick(struct RickmodState *rm, int fast);
+void rickmod_memo_jump(struct RickmodState *rm);
+
+
+#endif
@@ -44,6 +44,9 @@ struct MAMix {
 
 void ma_add(struct MAState *rs, int32_t *sample, int samples);
 void ma_add_fast(struct MAState *rs, int32_t *sample, int samples);
+void ma_add_nearest(struct MAState *rs, int32_t *sample, int samples);
+void ma_skip(struct MAState *rs, int samples); // Same position as ma_add() would leave, nothing mixed
+void ma_skip_fast(struct MAState *rs, int samples);
 struct MAMix ma_mix_create(int sample_rate);
 void ma_mix8(struct MAMix *mix, uint8_t *buff, int samples);
 void ma_set_callback(struct MAState *rs, void (*next_sample)(void *ptr, int8_t *buff), void *ptr);
@@ -0,0 +1,10 @@
+#ifndef RICKMOD_POOL_H__
+#define	RICKMOD_POOL_H__
+
+
+#include "rickmod.h"
+
+void rickmod_pool_free(struct RickmodState *rm);
+
+
+#endif
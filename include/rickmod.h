@@ -4,7 +4,44 @@
 #include "mixastley.h"
 #include <stdint.h>
 
+#define	RM_MAX_CHANNELS 32
+#define	RM_MAX_SAMPLES 99
+
+#define	RM_FORMAT_MOD 0
+#define	RM_FORMAT_S3M 1
+
+#define	RM_RENDER_S16 0
+#define	RM_RENDER_S16_FAST 1
+#define	RM_RENDER_U8 2
+#define	RM_RENDER_S16_MONO 3
+
+#define	RM_COMMAND_QUEUE_LEN 64 // Must be a power of two
+#define	RM_COMMAND_CELL 0
+#define	RM_COMMAND_MUTE 1
+#define	RM_COMMAND_SOLO 2
+#define	RM_COMMAND_BPM 3
+#define	RM_COMMAND_JUMP 4
+#define	RM_COMMAND_SAMPLE 5
+#define	RM_COMMAND_REPEAT_PATTERN 6
+
+#define	RM_SFX_MAX_VOICES 32
+#define	RM_SFX_QUEUE_LEN 32 // Must be a power of two
+
+#define	RM_EVENT_NOTE 0
+#define	RM_EVENT_ROW 1
+#define	RM_EVENT_ORDER 2
+#define	RM_EVENT_LOOP 3
+#define	RM_EVENT_END 4
+
 struct RickmodState;
+struct RickmodMemo;
+struct RickmodEvents;
+struct RickmodTaps;
+struct RickmodSpectrum;
+struct RickmodTrace;
+struct RickmodGovernor;
+struct RickmodPool;
+struct RickmodSfx;
 
 struct RickmodChannelEffect {
 	uint16_t		note;
@@ -42,6 +79,7 @@ struct RickmodChannel {
 	uint16_t		note;
 	uint16_t		effect;
 	uint8_t			sample;
+	uint8_t			volume; // 0 = none, otherwise volume + 1
 };
 
 
@@ -62,10 +100,120 @@ struct RickmodSample {
 	uint8_t			volume;
 	uint32_t		repeat;
 	uint32_t		repeat_length;
+	uint32_t		c2spd; // S3M only, sample rate of C-4
 	int8_t			*sample_data;
 };
 
 
+/* Edits for a playing module, applied by the player at the next tick boundary */
+struct RickmodCommand {
+	uint8_t			type; // RM_COMMAND_*
+	uint8_t			channel;
+	uint8_t			pattern; // CELL: pattern number, JUMP: order
+	uint8_t			row;
+	uint8_t			value; // MUTE/SOLO/REPEAT_PATTERN: on/off, BPM: bpm, SAMPLE: sample number
+	struct RickmodChannel	cell;
+	struct RickmodSample	sample; // Everything but name and c2spd is replaced
+};
+
+
+struct RickmodEvent {
+	uint64_t		frame; // First output frame the event is heard in, counted from rm_init()
+	uint8_t			type; // RM_EVENT_*
+	uint8_t			order;
+	uint8_t			row;
+	uint8_t			channel; // Only for NOTE
+	uint8_t			sample; // Only for NOTE
+	uint16_t		note; // Only for NOTE, as a period
+};
+
+
+/* A one-shot or looping sound mixed over the music, either a sample of the module or raw signed 8-bit data */
+struct RickmodSfxParams {
+	uint8_t			sample; // 1 and up, 0 = play data
+	const int8_t		*data; // Has to stay valid until the voice has ended or been stopped
+	uint32_t		length;
+	uint32_t		repeat;
+	uint32_t		repeat_length; // 0 = one-shot
+	uint32_t		rate; // Hz, 0 = the sample's c2spd, or 8363
+	uint8_t			volume; // 0-64, silent voices keep their place without being mixed
+	uint8_t			pan; // 0 = left, 128 = centre, 255 = right
+	uint8_t			priority; // A full pool steals the lowest priority voice, unless it is above this one
+};
+
+
+struct RickmodSfxStats {
+	uint32_t		played;
+	uint32_t		stolen;
+	uint32_t		dropped; // Every voice had a higher priority
+	uint32_t		active;
+};
+
+
+struct RickmodMemoStats {
+	uint32_t		entries; // Patterns held
+	uint32_t		bytes;
+	uint64_t		replays; // Pattern entries played from the memo instead of mixed
+	uint64_t		frames_replayed;
+};
+
+
+/* Cumulative since rm_init(), all zero when built without -DSTATS */
+struct RickmodStats {
+	uint64_t		frames;
+	uint64_t		ticks;
+	uint64_t		rows;
+	uint64_t		refills; // Sample buffer refills through _pull_samples
+	uint64_t		loop_wraps;
+	uint64_t		voice_samples; // Output samples mixed by voices that were playing
+	uint64_t		clipped;
+	uint64_t		unhandled_effects;
+
+	uint64_t		mix_calls;
+	uint64_t		mix_ns_max; // Wall time, only measured with -DHOSTED
+	uint64_t		mix_ns_total;
+};
+
+
+/* Everything rm_probe() can tell from the header alone, strings are zero terminated */
+struct RickmodInfo {
+	char			name[29];
+	char			tag[5]; // M.K., M!K!, 4CHN or SCRM
+	uint8_t			format; // RM_FORMAT_*
+	uint8_t			channels;
+	uint8_t			samples;
+	uint8_t			initial_speed;
+	uint8_t			initial_bpm;
+	uint16_t		orders;
+	uint16_t		patterns;
+	uint32_t		data_len; // Bytes the header accounts for, past the file length if it was truncated
+	uint32_t		duration_ms; // Only known for compiled modules, 0 otherwise
+	char			sample_name[RM_MAX_SAMPLES][29];
+};
+
+
+/* What rm_optimize() did, the output it renders is the same before and after */
+struct RickmodOptimizeStats {
+	uint16_t		patterns_before;
+	uint16_t		patterns_after;
+	uint8_t			samples_merged; // Identical to an earlier sample
+	uint8_t			samples_dropped; // Never played
+	uint32_t		bytes_trimmed; // Silence at the end of samples
+	uint32_t		bytes_before; // As rm_save_mem() writes the module
+	uint32_t		bytes_after;
+	uint64_t		render_hash; // FNV-1a of the s16 render at 44100 Hz, at most ten minutes
+};
+
+
+/* Process wide, bytes_saved is what players would hold on their own for the entries they share */
+struct RickmodPoolStats {
+	uint32_t		samples; // Distinct sample buffers
+	uint32_t		references; // Samples of live players that point into the pool
+	uint64_t		bytes; // Held by the pool, silence padding included
+	uint64_t		bytes_saved;
+};
+
+
 struct RickmodChannelState {
 	struct RickmodState	*rm;
 	int			channel;
@@ -82,28 +230,50 @@ struct RickmodState {
 	char			name[21];
 	uint8_t			*data;
 
+	uint8_t			format;
+	uint8_t			channels;
+	uint8_t			mix_shift; // output attenuation for > 4 channels
+	uint8_t			panning[RM_MAX_CHANNELS]; // 0 = left, 1 = right
+	uint8_t			initial_speed;
+	uint8_t			initial_bpm;
+
 	uint8_t			samples;
 	uint8_t			*pattern_lookup;
+	uint8_t			order[128]; // MOD order list, pattern_lookup points here
 	uint8_t			patterns;
 	uint8_t			song_length;
-	struct RickmodSample	sample[31];
-	struct RickmodPattern	pattern[128];
+	struct RickmodSample	sample[RM_MAX_SAMPLES];
+	struct RickmodPattern	*pattern; // One per rm->patterns, room for 128 in tracker builds
+	uint8_t			pattern_borrowed; // pattern points into a compiled image
 
-	struct MAState		mix[4];
-	struct RickmodChannelState channel[4];
+	struct MAState		mix[RM_MAX_CHANNELS];
+	struct RickmodChannelState channel[RM_MAX_CHANNELS];
 	uint16_t		samplerate;
 	uint8_t			repeat;
 	uint8_t			end;
+	uint64_t		frame;
 
 	void			(*row_callback)(void *data);
 	void			*user_data;
+	struct RickmodMemo	*memo;
+	struct RickmodEvents	*events;
+	struct RickmodTaps	*taps;
+	struct RickmodSpectrum	*spectrum;
+	struct RickmodTrace	*trace;
+	struct RickmodGovernor	*governor;
+	struct RickmodPool	*pool; // Set by rm_pool_share()
+	struct RickmodSfx	*sfx;
+	void			*map; // Set when the module was mapped by rm_open_file()
+	uint32_t		map_len;
+	struct RickmodStats	stats;
 	#ifdef TRACKER
 	void			(*repeat_callback)(void *data);
 	void			*repeat_user_data;
 	int			repeat_pattern;
+	int8_t			*sample_buffer[RM_MAX_SAMPLES]; // Sample data the player owns, sized to each sample
 	#endif
 
-	struct {
+	struct RickmodPosition {
 		uint8_t		pattern;
 		uint8_t		translated_pattern;
 		uint8_t		row;
@@ -120,26 +290,165 @@ struct RickmodState {
 		uint8_t		next_row;
 	} cur;
 
+	/* Packed S3M patterns are decoded one row at a time from the file */
+	struct {
+		uint8_t		*file;
+		uint32_t	file_len;
+		uint16_t	patterns;
+		uint8_t		*pattern_para;
+		uint8_t		chanmap[32];
+		uint8_t		order[256];
+		uint8_t		order_remap[256];
+
+		int		row_pattern;
+		int		row_index;
+		uint32_t	row_pos;
+		uint32_t	row_end;
+		struct RickmodChannel row[RM_MAX_CHANNELS];
+	} s3m;
+
+	/* Single producer, single consumer, positions only ever grow and are masked on use */
+	struct {
+		struct RickmodCommand queue[RM_COMMAND_QUEUE_LEN];
+		uint32_t	head;
+		uint32_t	tail;
+	} commands;
+
+};
+
+struct RickmodRenderParams {
+	int			sample_rate;
+	int			format; // RM_RENDER_*
+	uint8_t			repeat;
+	uint32_t		max_frames; // 0 = until the end, required when repeating
+};
+
+
+struct RickmodRender {
+	void			*data; // Interleaved stereo in the requested format, or mono for RM_RENDER_S16_MONO
+	uint32_t		frames;
+	uint32_t		size;
+
+	void			*map;
+	uint32_t		map_len;
+};
+
+struct RickmodOverviewParams {
+	int			sample_rate; // Internal rate, lower is faster, 0 = 8000
+	uint32_t		bucket_frames; // Frames at sample_rate per bucket
+	uint32_t		max_frames; // 0 = until the end
+};
+
+
+struct RickmodOverviewBucket {
+	int16_t			min;
+	int16_t			max;
+	uint16_t		rms;
+};
+
+
+struct RickmodOverview {
+	struct RickmodOverviewBucket *bucket;
+	uint32_t		buckets;
+	uint32_t		frames; // At the internal rate
+};
+
+struct RickmodPlaybackConfig {
+	int			format; // RM_RENDER_*, stereo only
+	uint32_t		ring_frames; // Rounded up to a power of two
+	uint32_t		chunk_frames; // Frames rendered per refill
+	int			priority; // SCHED_FIFO priority of the render thread, 0 = normal scheduling
+	int			cpu; // CPU the render thread is pinned to, -1 = any
 };
 
-struct RickmodState *rm_init(int sample_rate, uint8_t *mod, int mod_len);
+struct RickmodPlayback;
+
+struct RickmodPlaylistConfig {
+	int			sample_rate;
+	uint32_t		crossfade_frames; // 0 = each module starts on the frame after the last one ended
+	uint64_t		max_frames; // Per module, 0 = an hour
+	uint8_t			share_samples; // Load through rm_pool_share()
+};
+
+
+struct RickmodPlaylistStatus {
+	uint32_t		pending; // Added, not started yet
+	uint32_t		started;
+	uint32_t		failed; // Couldn't be opened, skipped
+	uint32_t		underruns; // Mix calls that ran out while a module was still loading
+};
+
+struct RickmodPlaylist;
+
+struct RickmodState *rm_init(int sample_rate, uint8_t *mod, int mod_len); // mod is only read, and has to outlive the player
 void rm_reset(struct RickmodState *rm);
 void rm_clear(struct RickmodState *rm);
 void rm_mix_s16(struct RickmodState *rm, int16_t *buff, int samples);
 void rm_mix_s16_fast(struct RickmodState *rm, int16_t *buff, int samples);
 void rm_mix_u8(struct RickmodState *rm, uint8_t *buff, int samples);
+void rm_mix_s16_mono(struct RickmodState *rm, int16_t *buff, int samples);
 void rm_repeat_set(struct RickmodState *rm, uint8_t repeat);
 uint8_t rm_end_reached(struct RickmodState *rm);
 void rm_free(struct RickmodState *rm);
 void rm_row_callback_set(struct RickmodState *rm, void (*row_callback)(void *data), void *user_data);
+int rm_memo_set(struct RickmodState *rm, uint32_t max_bytes); // 0 disables, returns 0 on failure
+void rm_memo_stats(struct RickmodState *rm, struct RickmodMemoStats *stats); // Counts since rm_memo_set(), call when not mixing
+uint32_t rm_command_send(struct RickmodState *rm, const struct RickmodCommand *cmd); // Returns a sequence number, 0 if the queue is full
+uint32_t rm_command_applied(struct RickmodState *rm); // Sequence number of the last command the player has applied
+int rm_events_set(struct RickmodState *rm, uint32_t len); // 0 disables, returns 0 on failure
+int rm_event_read(struct RickmodState *rm, struct RickmodEvent *event); // Returns 0 if there was no event
+uint32_t rm_events_dropped(struct RickmodState *rm);
+void rm_get_stats(struct RickmodState *rm, struct RickmodStats *stats);
+int rm_taps_set(struct RickmodState *rm, uint32_t len, uint32_t decimate, uint32_t meter_frames); // 0 disables, returns 0 on failure
+uint32_t rm_tap_read(struct RickmodState *rm, int channel, int16_t *buff, uint32_t frames); // Latest scope samples, up to len / 2
+void rm_tap_meter(struct RickmodState *rm, int channel, uint16_t *peak, uint16_t *rms);
+int rm_probe(const uint8_t *mod, int mod_len, struct RickmodInfo *info); // Returns 0 if rm_init() wouldn't accept it
+uint64_t rm_measure(struct RickmodState *rm, uint64_t max_frames); // Plays to the end without mixing, returns the frames that took
+int rm_compile(uint8_t *mod, int mod_len, uint8_t **out, uint32_t *out_len); // Image that rm_init() plays without parsing, free() it
+int rm_save_mem(struct RickmodState *rm, uint8_t **buf, uint32_t *len); // MOD only, free() the buffer, not while mixing
+int rm_optimize(struct RickmodState *rm, struct RickmodOptimizeStats *stats); // MOD only, rewinds, 0 = left as it was
+int rm_sfx_set(struct RickmodState *rm, int voices); // 0 disables, at most RM_SFX_MAX_VOICES, not while mixing
+uint32_t rm_sfx_play(struct RickmodState *rm, const struct RickmodSfxParams *params); // Voice id, 0 if the queue is full
+int rm_sfx_volume(struct RickmodState *rm, uint32_t id, uint8_t volume, uint8_t pan); // Ignored once the voice is gone
+int rm_sfx_stop(struct RickmodState *rm, uint32_t id);
+void rm_sfx_stats(struct RickmodState *rm, struct RickmodSfxStats *stats);
 
 // Only available if rickmod was built with -DTRACKER
 struct RickmodState *rm_new(int sample_rate);
-int rm_save(struct RickmodState *rm, const char *path);
+int rm_save(struct RickmodState *rm, const char *path); // Replaces path atomically through path.tmp
 int rm_lookup_note(int note); // 0 = C-3, 35 = B-5, -1 = invalid
 void rm_samplerate_set(struct MAState *rs, int note, int finetune);
 int rm_translate_note(int note); // returns the period number for a note, 0 = C-3
 void rm_bpm_set(struct RickmodState *rm, int bpm);
 void rm_repeat_callback_set(struct RickmodState *rm, void (*repeat_callback)(void *data), void *user_data);
+int rm_sample_resize(struct RickmodState *rm, int sample, uint32_t length); // New data is silent, not while mixing
+
+// Only available if rickmod was built with -DHOSTED
+struct RickmodState *rm_open_file(int sample_rate, const char *path); // Plays straight from a read only mapping
+int rm_render(uint8_t *mod, int mod_len, const struct RickmodRenderParams *params, struct RickmodRender *out);
+int rm_render_cached(const char *cache_dir, uint64_t max_cache_bytes, uint8_t *mod, int mod_len, const struct RickmodRenderParams *params, struct RickmodRender *out);
+void rm_render_free(struct RickmodRender *render);
+int rm_preview(uint8_t *mod, int mod_len, int sample_rate, uint32_t max_frames, struct RickmodRender *out); // Mono nearest neighbour, 0 = 11025 Hz
+int rm_overview(uint8_t *mod, int mod_len, const struct RickmodOverviewParams *params, struct RickmodOverview *out);
+void rm_overview_free(struct RickmodOverview *overview);
+struct RickmodPlayback *rm_playback_start(struct RickmodState *rm, const struct RickmodPlaybackConfig *config);
+uint32_t rm_playback_read(struct RickmodPlayback *pb, void *buff, uint32_t frames); // Safe to call from the audio callback
+uint32_t rm_playback_fill(struct RickmodPlayback *pb);
+uint32_t rm_playback_underruns(struct RickmodPlayback *pb);
+int rm_playback_ended(struct RickmodPlayback *pb);
+void rm_playback_stop(struct RickmodPlayback *pb);
+int rm_spectrum_set(struct RickmodState *rm, uint32_t size, uint32_t hop, uint32_t bins); // size is a power of two, 0 disables
+uint32_t rm_spectrum_read(struct RickmodState *rm, float *bins, uint64_t *frame); // Newest spectrum in dBFS, 0 = none yet
+int rm_trace_set(struct RickmodState *rm, uint32_t max_spans); // 0 disables, returns 0 on failure
+int rm_trace_dump(struct RickmodState *rm, const char *path); // Chrome trace-event JSON, call when not mixing
+int rm_budget_set(struct RickmodState *rm, uint32_t ns_per_frame); // 1e9 / (rate * realtime factor), rm_mix_s16 only, 0 disables
+uint32_t rm_budget_degraded(struct RickmodState *rm); // Voices currently mixed without interpolation
+int rm_pool_share(struct RickmodState *rm); // Not while mixing, afterwards a protracker module no longer needs its buffer, 0 in tracker builds
+void rm_pool_stats(struct RickmodPoolStats *stats);
+struct RickmodPlaylist *rm_playlist_new(const struct RickmodPlaylistConfig *config); // Modules are loaded on a thread of its own
+int rm_playlist_add(struct RickmodPlaylist *pl, const char *path);
+uint32_t rm_playlist_mix_s16(struct RickmodPlaylist *pl, int16_t *buff, uint32_t frames); // Never blocks, returns the frames of music, the rest is silence
+void rm_playlist_status(struct RickmodPlaylist *pl, struct RickmodPlaylistStatus *status);
+void rm_playlist_free(struct RickmodPlaylist *pl);
 
 #endif
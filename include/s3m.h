@@ -0,0 +1,13 @@
+#ifndef RICKMOD_S3M_H__
+#define	RICKMOD_S3M_H__
+
+
+#include <stdint.h>
+#include "rickmod.h"
+
+int rickmod_s3m_load(struct RickmodState *rm, uint8_t *mod, int mod_len);
+struct RickmodChannel *rickmod_s3m_row(struct RickmodState *rm, int pattern, int row);
+int rickmod_s3m_probe(const uint8_t *mod, int mod_len, struct RickmodInfo *info);
+
+
+#endif
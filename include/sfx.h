@@ -0,0 +1,12 @@
+#ifndef RICKMOD_SFX_H__
+#define	RICKMOD_SFX_H__
+
+
+#include <stdint.h>
+#include "rickmod.h"
+
+void rickmod_sfx_free(struct RickmodState *rm);
+void rickmod_sfx_mix(struct RickmodState *rm, int32_t *buffer, int samples, int fast);
+
+
+#endif
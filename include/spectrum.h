@@ -0,0 +1,12 @@
+#ifndef RICKMOD_SPECTRUM_H__
+#define	RICKMOD_SPECTRUM_H__
+
+
+#include <stdint.h>
+#include "rickmod.h"
+
+void rickmod_spectrum_free(struct RickmodState *rm);
+void rickmod_spectrum_feed(struct RickmodState *rm, int32_t *mix, int samples, int shift, uint64_t frame);
+
+
+#endif
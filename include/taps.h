@@ -0,0 +1,13 @@
+#ifndef RICKMOD_TAPS_H__
+#define	RICKMOD_TAPS_H__
+
+
+#include <stdint.h>
+#include "rickmod.h"
+
+void rickmod_taps_free(struct RickmodState *rm);
+int32_t *rickmod_taps_scratch(struct RickmodState *rm);
+void rickmod_taps_write(struct RickmodState *rm, int channel, int32_t *data, int samples, int fast);
+
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef RICKMOD_TRACE_H__
+#define	RICKMOD_TRACE_H__
+
+
+#include <stdint.h>
+#include "rickmod.h"
+#include "util.h"
+
+#define	RICKMOD_TRACE_TICK 0
+#define	RICKMOD_TRACE_ROW 1
+#define	RICKMOD_TRACE_TICK_EFFECTS 2
+#define	RICKMOD_TRACE_MA_ADD 3
+#define	RICKMOD_TRACE_PULL_SAMPLES 4
+
+#ifdef HOSTED
+#define	TRACE_BEGIN(rm) ((rm)->trace ? rickmod_now_ns() : 0)
+#define	TRACE_END(rm, type, channel, begin) do { if ((rm)->trace) rickmod_trace_end((rm), (type), (channel), (begin)); } while (0)
+#else
+#define	TRACE_BEGIN(rm) 0
+#define	TRACE_END(rm, type, channel, begin) do { (void) (begin); } while (0)
+#endif
+
+void rickmod_trace_free(struct RickmodState *rm);
+void rickmod_trace_end(struct RickmodState *rm, int type, int channel, uint64_t begin);
+
+
+#endif
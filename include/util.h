@@ -0,0 +1,15 @@
+#ifndef RICKMOD_UTIL_H__
+#define	RICKMOD_UTIL_H__
+
+
+#include <stdint.h>
+
+#define	RICKMOD_FNV64_INIT 0xCBF29CE484222325ULL
+
+uint64_t rickmod_fnv64(uint64_t h, const void *data, uint32_t len);
+#ifdef HOSTED
+uint64_t rickmod_now_ns(void);
+#endif
+
+
+#endif
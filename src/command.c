@@ -0,0 +1,43 @@
+#include "rickmod.h"
+#include "command.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+void rickmod_command_init(struct RickmodState *rm) {
+	rm->commands.head = rm->commands.tail = 0;
+}
+
+
+/* The player side, the slot stays valid until rickmod_command_done() hands it back to the sender */
+struct RickmodCommand *rickmod_command_peek(struct RickmodState *rm) {
+	uint32_t tail = __atomic_load_n(&rm->commands.tail, __ATOMIC_RELAXED);
+
+	if (tail == __atomic_load_n(&rm->commands.head, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &rm->commands.queue[tail & (RM_COMMAND_QUEUE_LEN - 1)];
+}
+
+
+void rickmod_command_done(struct RickmodState *rm) {
+	__atomic_store_n(&rm->commands.tail, rm->commands.tail + 1, __ATOMIC_RELEASE);
+}
+
+
+/* Only one thread may send at a time, but it never waits for the player */
+uint32_t rm_command_send(struct RickmodState *rm, const struct RickmodCommand *cmd) {
+	uint32_t head = __atomic_load_n(&rm->commands.head, __ATOMIC_RELAXED);
+
+	if (head - __atomic_load_n(&rm->commands.tail, __ATOMIC_ACQUIRE) >= RM_COMMAND_QUEUE_LEN)
+		return 0;
+	rm->commands.queue[head & (RM_COMMAND_QUEUE_LEN - 1)] = *cmd;
+	__atomic_store_n(&rm->commands.head, head + 1, __ATOMIC_RELEASE);
+	return head + 1;
+}
+
+
+/* Once this has passed a SAMPLE command's sequence number, the old sample data is no longer read */
+uint32_t rm_command_applied(struct RickmodState *rm) {
+	return __atomic_load_n(&rm->commands.tail, __ATOMIC_ACQUIRE);
+}
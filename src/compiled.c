@@ -0,0 +1,366 @@
+#include "rickmod.h"
+#include "compiled.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef STANDALONE
+#include <stdio.h>
+#else
+#define fprintf(...)
+#endif
+
+#define	COMPILED_MAGIC "RMCM"
+#define	COMPILED_VERSION 1 // Bump on any change to the layout below, or to struct RickmodPattern
+#define	COMPILED_ENDIAN 0x01020304
+#define	COMPILED_ALIGN 8
+#define	COMPILED_RATE 44100 // The duration is measured at this rate, like rm-index does
+#define	COMPILED_MAX_FRAMES (COMPILED_RATE * 3600ULL)
+#define	COMPILED_PAD ((1 << MA_SAMPLE_BUFFER_LEN) + 2) // Silence after the sample data, same as the S3M loader leaves
+#define	COMPILED_MAX_PACKED (0xFFFF * 16)
+
+
+struct CompiledSample {
+	uint32_t		offset; // From sample_offset
+	uint32_t		length;
+	uint32_t		repeat;
+	uint32_t		repeat_length;
+	uint32_t		c2spd;
+	char			name[23];
+	uint8_t			finetune;
+	uint8_t			volume;
+};
+
+
+/* Host byte order and natural alignment throughout, offsets are from the start of the image */
+struct CompiledHeader {
+	char			magic[4];
+	uint16_t		version;
+	uint16_t		header_size;
+	uint32_t		endian;
+	uint32_t		size; // Of the whole image
+	uint32_t		duration_ms; // 0 if it didn't end within an hour
+	char			name[21];
+	char			tag[5];
+	uint8_t			format;
+	uint8_t			channels;
+	uint8_t			initial_speed;
+	uint8_t			initial_bpm;
+	uint8_t			samples;
+	uint8_t			patterns;
+	uint8_t			song_length;
+	uint8_t			panning[RM_MAX_CHANNELS];
+	uint8_t			order[256];
+	struct CompiledSample	sample[RM_MAX_SAMPLES];
+
+	uint32_t		pattern_offset; // MOD: struct RickmodPattern[patterns], S3M: packed patterns
+	uint32_t		pattern_len;
+	uint32_t		sample_offset;
+	uint32_t		sample_len;
+
+	/* S3M only, the parapointers are rebased onto the packed patterns */
+	uint16_t		s3m_patterns;
+	uint8_t			chanmap[32];
+	uint8_t			order_remap[256];
+	uint32_t		para_offset;
+};
+
+
+static uint32_t _le16(const uint8_t *p) {
+	return p[0] | (p[1] << 8);
+}
+
+
+static uint32_t _align(uint32_t n, uint32_t align) {
+	return (n + align - 1) & ~(align - 1);
+}
+
+
+static int _in_image(uint32_t offset, uint32_t len, uint32_t size) {
+	return offset <= size && len <= size - offset;
+}
+
+
+/* Where pattern i starts in the original file and how much of it is there, 0 if it's missing */
+static uint32_t _s3m_pattern(struct RickmodState *rm, int i, uint32_t *len) {
+	uint32_t offset = _le16(rm->s3m.pattern_para + i * 2) * 16;
+
+	if (!offset || offset + 2 > rm->s3m.file_len)
+		return 0;
+	*len = _le16(rm->s3m.file + offset);
+	if (*len > rm->s3m.file_len - offset)
+		*len = rm->s3m.file_len - offset;
+	return offset;
+}
+
+
+/* Only what the decoder can reach is kept, each pattern on a paragraph with its length cut to what the file had */
+static uint32_t _pack_s3m(struct RickmodState *rm, uint8_t *packed, uint8_t *para) {
+	uint32_t i, offset, len, pos = 16;
+
+	for (i = 0; i < rm->s3m.patterns; i++) {
+		if (para)
+			para[i * 2] = para[i * 2 + 1] = 0;
+		if (!(offset = _s3m_pattern(rm, i, &len)))
+			continue;
+		if (packed) {
+			memcpy(packed + pos, rm->s3m.file + offset, len < 2 ? 2 : len);
+			packed[pos] = len, packed[pos + 1] = len >> 8;
+			para[i * 2] = pos >> 4, para[i * 2 + 1] = pos >> 12;
+		}
+		pos += _align(len < 2 ? 2 : len, 16);
+	}
+
+	return pos;
+}
+
+
+static void _write_samples(struct RickmodState *rm, struct CompiledHeader *h, uint8_t *data) {
+	uint32_t pos = 0;
+	int i;
+
+	for (i = 0; i < rm->samples; i++) {
+		h->sample[i].offset = pos;
+		h->sample[i].length = rm->sample[i].length;
+		h->sample[i].repeat = rm->sample[i].repeat;
+		h->sample[i].repeat_length = rm->sample[i].repeat_length;
+		h->sample[i].c2spd = rm->sample[i].c2spd;
+		h->sample[i].finetune = rm->sample[i].finetune;
+		h->sample[i].volume = rm->sample[i].volume;
+		memcpy(h->sample[i].name, rm->sample[i].name, sizeof(h->sample[i].name));
+		memcpy(data + pos, rm->sample[i].sample_data, rm->sample[i].length);
+		pos += rm->sample[i].length;
+	}
+	memset(data + pos, 0, COMPILED_PAD);
+}
+
+
+int rm_compile(uint8_t *mod, int mod_len, uint8_t **out, uint32_t *out_len) {
+	struct CompiledHeader *h;
+	struct RickmodState *rm;
+	struct RickmodInfo info;
+	uint32_t size, pattern_len, para_len = 0, sample_len = COMPILED_PAD;
+	uint64_t frames;
+	uint8_t *image;
+	int i;
+
+	if (rickmod_compiled_check(mod, mod_len) || !rm_probe(mod, mod_len, &info) || !(rm = rm_init(COMPILED_RATE, mod, mod_len)))
+		return 0;
+
+	if (rm->format == RM_FORMAT_S3M) {
+		pattern_len = _pack_s3m(rm, NULL, NULL);
+		para_len = rm->s3m.patterns * 2;
+	} else
+		pattern_len = rm->patterns * sizeof(*rm->pattern);
+	for (i = 0; i < rm->samples; i++)
+		sample_len += rm->sample[i].length;
+
+	size = _align(sizeof(*h), COMPILED_ALIGN) + _align(pattern_len, COMPILED_ALIGN) + _align(para_len, COMPILED_ALIGN) + sample_len;
+	if (pattern_len > COMPILED_MAX_PACKED && rm->format == RM_FORMAT_S3M) {
+		fprintf(stderr, "Packed S3M patterns don't fit in 16 bit parapointers\n");
+		rm_free(rm);
+		return 0;
+	}
+	if (!(image = calloc(size, 1))) {
+		rm_free(rm);
+		return 0;
+	}
+
+	h = (struct CompiledHeader *) image;
+	memcpy(h->magic, COMPILED_MAGIC, 4);
+	h->version = COMPILED_VERSION;
+	h->header_size = sizeof(*h);
+	h->endian = COMPILED_ENDIAN;
+	h->size = size;
+	memcpy(h->name, rm->name, sizeof(h->name));
+	memcpy(h->tag, info.tag, sizeof(h->tag));
+	h->format = rm->format;
+	h->channels = rm->channels;
+	h->initial_speed = rm->initial_speed;
+	h->initial_bpm = rm->initial_bpm;
+	h->samples = rm->samples;
+	h->patterns = rm->patterns;
+	h->song_length = rm->song_length;
+	/* MOD leaves the unused channels unset, the image has to be the same for the same module */
+	memcpy(h->panning, rm->panning, rm->channels);
+
+	h->pattern_offset = _align(sizeof(*h), COMPILED_ALIGN);
+	h->pattern_len = pattern_len;
+	h->para_offset = h->pattern_offset + _align(pattern_len, COMPILED_ALIGN);
+	h->sample_offset = h->para_offset + _align(para_len, COMPILED_ALIGN);
+	h->sample_len = sample_len;
+	if (rm->format == RM_FORMAT_S3M) {
+		memcpy(h->order, rm->s3m.order, sizeof(h->order));
+		h->s3m_patterns = rm->s3m.patterns;
+		memcpy(h->chanmap, rm->s3m.chanmap, sizeof(h->chanmap));
+		memcpy(h->order_remap, rm->s3m.order_remap, sizeof(h->order_remap));
+		_pack_s3m(rm, image + h->pattern_offset, image + h->para_offset);
+	} else {
+		memcpy(h->order, rm->order, sizeof(rm->order));
+		memcpy(image + h->pattern_offset, rm->pattern, pattern_len);
+	}
+	_write_samples(rm, h, image + h->sample_offset);
+
+	frames = rm_measure(rm, COMPILED_MAX_FRAMES);
+	h->duration_ms = rm_end_reached(rm) ? frames * 1000 / COMPILED_RATE : 0;
+	rm_free(rm);
+
+	*out = image;
+	*out_len = size;
+	return 1;
+}
+
+
+int rickmod_compiled_check(const uint8_t *mod, int mod_len) {
+	return mod_len >= (int) sizeof(struct CompiledHeader) && !memcmp(mod, COMPILED_MAGIC, 4);
+}
+
+
+/* Images are trusted no more than modules, but checking doesn't write or decode anything */
+static int _valid(const uint8_t *mod, int mod_len) {
+	const struct CompiledHeader *h = (const void *) mod;
+	const struct RickmodChannel *cell;
+	const struct CompiledSample *s;
+	uint32_t i, data_len;
+
+	if ((uintptr_t) mod & (COMPILED_ALIGN - 1))
+		return 0;
+	if (h->version != COMPILED_VERSION || h->header_size != sizeof(*h) || h->endian != COMPILED_ENDIAN || h->size > (uint32_t) mod_len)
+		return 0;
+	if (!h->channels || h->channels > RM_MAX_CHANNELS || h->samples > RM_MAX_SAMPLES || !h->song_length)
+		return 0;
+	if (!_in_image(h->pattern_offset, h->pattern_len, h->size) || !_in_image(h->sample_offset, h->sample_len, h->size))
+		return 0;
+	if (h->sample_len < COMPILED_PAD || (h->pattern_offset | h->para_offset) & (COMPILED_ALIGN - 1))
+		return 0;
+
+	data_len = h->sample_len - COMPILED_PAD;
+	for (i = 0; i < h->samples; i++) {
+		s = &h->sample[i];
+		if (!_in_image(s->offset, s->length, data_len) || s->repeat_length > s->length || s->repeat > s->length - s->repeat_length || s->finetune > 15)
+			return 0;
+	}
+
+	if (h->format == RM_FORMAT_S3M) {
+		for (i = 0; i < 32; i++)
+			if (h->chanmap[i] >= h->channels && h->chanmap[i] != 0xFF)
+				return 0;
+		return _in_image(h->para_offset, h->s3m_patterns * 2, h->size);
+	}
+	if (h->format != RM_FORMAT_MOD || h->channels != 4 || !h->patterns || h->patterns > 128 || h->song_length > 128)
+		return 0;
+	if (h->pattern_len != h->patterns * sizeof(struct RickmodPattern))
+		return 0;
+	for (i = 0; i < 128; i++)
+		if (h->order[i] >= h->patterns)
+			return 0;
+	cell = (const void *) (mod + h->pattern_offset);
+	for (i = 0; i < h->patterns * 64 * 4; i++, cell++)
+		if (cell->sample > h->samples || cell->note > 0xFFF) // Playback clamps notes, 0xFFF is no note at all
+			return 0;
+
+	return 1;
+}
+
+
+/* Nothing is parsed, the player reads patterns and sample data straight from the image */
+int rickmod_compiled_load(struct RickmodState *rm, uint8_t *mod, int mod_len) {
+	const struct CompiledHeader *h = (const void *) mod;
+	int i;
+
+	#ifdef TRACKER
+	fprintf(stderr, "Compiled modules are read only, the tracker needs the original module\n");
+	return 0;
+	#endif
+	if (!_valid(mod, mod_len)) {
+		fprintf(stderr, "Compiled module is damaged or from a different build\n");
+		return 0;
+	}
+
+	memcpy(rm->name, h->name, sizeof(rm->name));
+	rm->name[20] = 0;
+	rm->format = h->format;
+	rm->channels = h->channels;
+	memcpy(rm->panning, h->panning, sizeof(rm->panning));
+	rm->initial_speed = h->initial_speed;
+	rm->initial_bpm = h->initial_bpm;
+	rm->samples = h->samples;
+	rm->patterns = h->patterns;
+	rm->song_length = h->song_length;
+
+	for (i = 0; i < rm->samples; i++) {
+		memcpy(rm->sample[i].name, h->sample[i].name, sizeof(rm->sample[i].name));
+		rm->sample[i].name[22] = 0;
+		rm->sample[i].length = h->sample[i].length;
+		rm->sample[i].finetune = h->sample[i].finetune;
+		rm->sample[i].volume = h->sample[i].volume;
+		rm->sample[i].repeat = h->sample[i].repeat;
+		rm->sample[i].repeat_length = h->sample[i].repeat_length;
+		rm->sample[i].c2spd = h->sample[i].c2spd;
+		rm->sample[i].sample_data = (int8_t *) mod + h->sample_offset + h->sample[i].offset;
+	}
+
+	if (rm->format == RM_FORMAT_S3M) {
+		rm->s3m.file = mod + h->pattern_offset;
+		rm->s3m.file_len = h->pattern_len;
+		rm->s3m.patterns = h->s3m_patterns;
+		rm->s3m.pattern_para = mod + h->para_offset;
+		rm->s3m.row_pattern = -1;
+		rm->s3m.row_index = -1;
+		memcpy(rm->s3m.chanmap, h->chanmap, sizeof(rm->s3m.chanmap));
+		memcpy(rm->s3m.order, h->order, sizeof(rm->s3m.order));
+		memcpy(rm->s3m.order_remap, h->order_remap, sizeof(rm->s3m.order_remap));
+		rm->pattern_lookup = rm->s3m.order;
+		rm->data = NULL; // The samples are in the image, rm_free() has nothing to free
+	} else {
+		memcpy(rm->order, h->order, sizeof(rm->order));
+		rm->pattern_lookup = rm->order;
+		rm->pattern = (struct RickmodPattern *) (mod + h->pattern_offset);
+		rm->pattern_borrowed = 1;
+	}
+
+	return 1;
+}
+
+
+/* Compiled images are read only, the first edit gets the player its own copy */
+int rickmod_compiled_own_patterns(struct RickmodState *rm) {
+	struct RickmodPattern *pattern;
+
+	if (!rm->pattern_borrowed)
+		return 1;
+	if (!(pattern = malloc(sizeof(*pattern) * rm->patterns)))
+		return 0;
+	memcpy(pattern, rm->pattern, sizeof(*pattern) * rm->patterns);
+	rm->pattern = pattern;
+	rm->pattern_borrowed = 0;
+	return 1;
+}
+
+
+int rickmod_compiled_probe(const uint8_t *mod, int mod_len, struct RickmodInfo *info) {
+	const struct CompiledHeader *h = (const void *) mod;
+	int i;
+
+	#ifdef TRACKER
+	return 0;
+	#endif
+	if (!_valid(mod, mod_len))
+		return 0;
+	memcpy(info->name, h->name, sizeof(h->name));
+	memcpy(info->tag, h->tag, sizeof(h->tag));
+	info->format = h->format;
+	info->channels = h->channels;
+	info->samples = h->samples;
+	info->initial_speed = h->initial_speed;
+	info->initial_bpm = h->initial_bpm;
+	info->orders = h->song_length;
+	info->patterns = h->format == RM_FORMAT_S3M ? h->s3m_patterns : h->patterns;
+	info->data_len = h->size;
+	info->duration_ms = h->duration_ms;
+	for (i = 0; i < h->samples; i++)
+		memcpy(info->sample_name[i], h->sample[i].name, 22);
+
+	return 1;
+}
@@ -0,0 +1,89 @@
+#include "rickmod.h"
+#include "events.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+
+/* Single producer, single consumer, positions only ever grow and are masked on use */
+struct RickmodEvents {
+	uint32_t		len;
+	uint32_t		head;
+	uint32_t		tail;
+	uint32_t		dropped;
+	int			order; // Last order an event was sent for, -1 = none
+	struct RickmodEvent	ring[];
+};
+
+
+/* The player never waits, events that don't fit are counted and dropped */
+void rickmod_event_emit(struct RickmodState *rm, int type, int channel) {
+	struct RickmodEvents *events = rm->events;
+	struct RickmodEvent *event;
+	uint32_t head = events->head;
+
+	if (head - __atomic_load_n(&events->tail, __ATOMIC_ACQUIRE) >= events->len) {
+		__atomic_store_n(&events->dropped, events->dropped + 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	event = &events->ring[head & (events->len - 1)];
+	event->frame = rm->frame;
+	event->type = type;
+	event->order = rm->cur.pattern;
+	event->row = rm->cur.row;
+	event->channel = channel;
+	event->sample = type == RM_EVENT_NOTE ? rm->channel[channel].sample : 0;
+	event->note = type == RM_EVENT_NOTE ? rm->channel[channel].rce.note : 0;
+	__atomic_store_n(&events->head, head + 1, __ATOMIC_RELEASE);
+}
+
+
+void rickmod_event_row(struct RickmodState *rm) {
+	if (rm->events->order != rm->cur.pattern) {
+		rm->events->order = rm->cur.pattern;
+		rickmod_event_emit(rm, RM_EVENT_ORDER, 0);
+	}
+	rickmod_event_emit(rm, RM_EVENT_ROW, 0);
+}
+
+
+void rickmod_events_free(struct RickmodState *rm) {
+	free(rm->events);
+	rm->events = NULL;
+}
+
+
+int rm_events_set(struct RickmodState *rm, uint32_t len) {
+	uint32_t size;
+
+	rickmod_events_free(rm);
+	if (!len)
+		return 1;
+	for (size = 1; size < len; size <<= 1);
+	if (!(rm->events = calloc(1, sizeof(*rm->events) + size * sizeof(struct RickmodEvent))))
+		return 0;
+	rm->events->len = size;
+	rm->events->order = -1;
+	return 1;
+}
+
+
+int rm_event_read(struct RickmodState *rm, struct RickmodEvent *event) {
+	struct RickmodEvents *events = rm->events;
+	uint32_t tail;
+
+	if (!events)
+		return 0;
+	tail = events->tail;
+	if (tail == __atomic_load_n(&events->head, __ATOMIC_ACQUIRE))
+		return 0;
+	*event = events->ring[tail & (events->len - 1)];
+	__atomic_store_n(&events->tail, tail + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+
+uint32_t rm_events_dropped(struct RickmodState *rm) {
+	return rm->events ? __atomic_load_n(&rm->events->dropped, __ATOMIC_RELAXED) : 0;
+}
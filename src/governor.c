@@ -0,0 +1,125 @@
+#ifdef HOSTED
+
+#include "rickmod.h"
+#include "governor.h"
+#include "util.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define	GOVERNOR_RECOVER 75 // Percent of the budget the cost has to fall below before a voice gets linear back
+#define	GOVERNOR_DEGRADE_HOLD 20 // Per second, at most this many voices are degraded
+#define	GOVERNOR_RECOVER_HOLD 4 // Per second, recovery is slower so a voice doesn't flap
+
+
+struct RickmodGovernor {
+	uint32_t		budget; // ns per frame
+	int64_t			cost; // Smoothed ns per frame, 8 bit fraction
+	int32_t			hold; // Frames until the next tier change is allowed
+	uint64_t		start;
+	uint8_t			nearest[RM_MAX_CHANNELS];
+	int			degraded;
+};
+
+
+/* Quiet voices, and voices that are a small share of everything else on their side, are missed the least */
+static int _audibility(struct RickmodState *rm, int channel) {
+	int i, side = 0;
+
+	if (!rm->mix[channel].fraction_per_sample || !rm->mix[channel].volume)
+		return 0;
+	for (i = 0; i < rm->channels; i++)
+		if (rm->panning[i] == rm->panning[channel] && rm->mix[i].fraction_per_sample)
+			side += rm->mix[i].volume;
+	return rm->mix[channel].volume * 256 / side;
+}
+
+
+static int _pick(struct RickmodState *rm, int nearest, int loudest) {
+	int i, score, best = -1, best_score = 0;
+
+	for (i = 0; i < rm->channels; i++) {
+		if (rm->governor->nearest[i] != nearest)
+			continue;
+		/* A voice with no rate or no volume would score lowest, but degrading it saves nothing audible */
+		if (!loudest && (!rm->mix[i].fraction_per_sample || !rm->mix[i].volume))
+			continue;
+		score = _audibility(rm, i);
+		if (best < 0 || (loudest ? score > best_score : score < best_score))
+			best = i, best_score = score;
+	}
+
+	return best;
+}
+
+
+static void _set_tier(struct RickmodState *rm, int channel, int nearest) {
+	struct RickmodGovernor *gov = rm->governor;
+
+	gov->nearest[channel] = nearest;
+	__atomic_store_n(&gov->degraded, gov->degraded + (nearest ? 1 : -1), __ATOMIC_RELAXED);
+	gov->hold = rm->samplerate / (nearest ? GOVERNOR_DEGRADE_HOLD : GOVERNOR_RECOVER_HOLD);
+}
+
+
+void rickmod_governor_begin(struct RickmodState *rm) {
+	rm->governor->start = rickmod_now_ns();
+}
+
+
+/* One voice at a time, the cost average needs a few calls to show what the last change did */
+void rickmod_governor_end(struct RickmodState *rm, int samples) {
+	struct RickmodGovernor *gov = rm->governor;
+	int64_t cost;
+	int channel;
+
+	if (samples <= 0)
+		return;
+	cost = (int64_t) ((rickmod_now_ns() - gov->start) << 8) / samples;
+	gov->cost += (cost - gov->cost) / 4;
+	if ((gov->hold -= samples) > 0)
+		return;
+	gov->hold = 0;
+
+	if (gov->cost > (int64_t) gov->budget << 8) {
+		if ((channel = _pick(rm, 0, 0)) >= 0)
+			_set_tier(rm, channel, 1);
+	} else if (gov->degraded && gov->cost * 100 < ((int64_t) gov->budget << 8) * GOVERNOR_RECOVER) {
+		if ((channel = _pick(rm, 1, 1)) >= 0)
+			_set_tier(rm, channel, 0);
+	}
+}
+
+
+int rickmod_governor_nearest(struct RickmodState *rm, int channel) {
+	return rm->governor->nearest[channel];
+}
+
+
+int rickmod_governor_degraded(struct RickmodState *rm) {
+	return rm->governor->degraded;
+}
+
+
+void rickmod_governor_free(struct RickmodState *rm) {
+	free(rm->governor);
+	rm->governor = NULL;
+}
+
+
+int rm_budget_set(struct RickmodState *rm, uint32_t ns_per_frame) {
+	rickmod_governor_free(rm);
+	if (!ns_per_frame)
+		return 1;
+	if (!(rm->governor = calloc(1, sizeof(*rm->governor))))
+		return 0;
+	rm->governor->budget = ns_per_frame;
+	return 1;
+}
+
+
+uint32_t rm_budget_degraded(struct RickmodState *rm) {
+	return rm->governor ? __atomic_load_n(&rm->governor->degraded, __ATOMIC_RELAXED) : 0;
+}
+
+#endif
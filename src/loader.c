@@ -0,0 +1,55 @@
+#ifdef HOSTED
+
+#define	_DEFAULT_SOURCE
+
+#include "rickmod.h"
+#include "loader.h"
+
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+/* The mapping is shared with the page cache, pattern and sample data are read in place */
+struct RickmodState *rm_open_file(int sample_rate, const char *path) {
+	struct RickmodState *rm;
+	struct stat st;
+	void *map;
+	int fd, flags = MAP_SHARED;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || !st.st_size || st.st_size > INT32_MAX) {
+		close(fd);
+		return NULL;
+	}
+	#ifdef MAP_POPULATE
+	flags |= MAP_POPULATE;
+	#endif
+	map = mmap(NULL, st.st_size, PROT_READ, flags, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+	#ifndef MAP_POPULATE
+	madvise(map, st.st_size, MADV_WILLNEED);
+	#endif
+
+	if (!(rm = rm_init(sample_rate, map, st.st_size))) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+	rm->map = map;
+	rm->map_len = st.st_size;
+	return rm;
+}
+
+
+void rickmod_loader_free(struct RickmodState *rm) {
+	if (rm->map)
+		munmap(rm->map, rm->map_len);
+	rm->map = NULL;
+}
+
+#endif
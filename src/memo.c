@@ -0,0 +1,416 @@
+#include "rickmod.h"
+#include "memo.h"
+#include "command.h"
+#include "governor.h"
+#include "util.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Everything that changes while a pattern plays */
+struct RickmodMemoState {
+	struct RickmodPosition	cur;
+	uint8_t			end;
+	struct RickmodChannelState channel[RM_MAX_CHANNELS];
+	struct MAState		mix[RM_MAX_CHANNELS];
+};
+
+
+struct RickmodMemoEntry {
+	uint64_t		hash;
+	uint32_t		frames;
+	int32_t			*pcm; // Stereo, interleaved
+	struct RickmodMemoState	exit;
+	/* Relative entries play wherever the same patterns are in the same order, the exit position is a POSITION_* */
+	uint8_t			relative;
+	uint8_t			exit_pattern;
+	uint8_t			exit_next;
+	struct RickmodMemoEntry	*next;
+};
+
+
+struct RickmodMemo {
+	uint32_t		max_bytes;
+	uint32_t		bytes;
+	struct RickmodMemoEntry	*entries;
+
+	uint8_t			last_pattern;
+	uint8_t			last_row;
+	int			fast;
+
+	/* Pattern currently being recorded */
+	uint64_t		hash;
+	uint64_t		relative_hash;
+	int			relative;
+	int			jumped;
+	uint8_t			position;
+	uint32_t		sounding; // Voices that had a rate when the mixer last ran, one bit per channel
+	int32_t			*pcm;
+	uint32_t		frames;
+	uint32_t		size;
+	int			recording;
+
+	/* Pattern currently being replayed */
+	struct RickmodMemoEntry	*replay;
+	uint32_t		replay_pos;
+	uint8_t			replay_position;
+
+	struct RickmodMemoStats	stats;
+};
+
+
+#define	HASH(x) (h = rickmod_fnv64(h, &(x), sizeof(x)))
+
+#define	POSITION_SAME 0
+#define	POSITION_NEXT 1
+#define	POSITION_OTHER 2
+
+
+/* Where the song goes after pos without a jump, past the end it either wraps or ends */
+static uint8_t _next_position(struct RickmodState *rm, uint8_t pos) {
+	return pos + 1 < rm->song_length ? pos + 1 : 0;
+}
+
+
+static uint8_t _position_code(struct RickmodState *rm, uint8_t pos, uint8_t from) {
+	if (pos == from)
+		return POSITION_SAME;
+	return pos == _next_position(rm, from) ? POSITION_NEXT : POSITION_OTHER;
+}
+
+
+static uint8_t _position(struct RickmodState *rm, uint8_t code, uint8_t from) {
+	return code == POSITION_SAME ? from : _next_position(rm, from);
+}
+
+
+/*
+ * Hashed field by field, so that struct padding never leaks into the fingerprint.
+ * Silent voices keep their phase too, a trigger refills the buffer but the next note starts from that fraction.
+ */
+static uint64_t _fingerprint_state(struct RickmodState *rm, int fast) {
+	uint64_t h = RICKMOD_FNV64_INIT;
+	struct RickmodChannelEffect *rce;
+	struct MAState *ma;
+	int i;
+
+	HASH(fast);
+	HASH(rm->end), HASH(rm->repeat);
+	#ifdef TRACKER
+	HASH(rm->repeat_pattern);
+	#endif
+	HASH(rm->cur.row), HASH(rm->cur.bpm), HASH(rm->cur.speed);
+	HASH(rm->cur.samples_per_tick), HASH(rm->cur.samples_this_tick), HASH(rm->cur.tick);
+	HASH(rm->cur.set_on_tick), HASH(rm->cur.next_row);
+
+	for (i = 0; i < rm->channels; i++) {
+		HASH(rm->channel[i].sample), HASH(rm->channel[i].play_sample);
+		HASH(rm->channel[i].trigger), HASH(rm->channel[i].sample_pos);
+
+		rce = &rm->channel[i].rce;
+		HASH(rce->note), HASH(rce->row_note), HASH(rce->reset_note), HASH(rce->sample);
+		HASH(rce->effect), HASH(rce->volume), HASH(rce->finetune);
+		HASH(rce->portamento_target), HASH(rce->portamento_speed), HASH(rce->portamento_vol);
+		HASH(rce->arpeggio_save), HASH(rce->vibrato_pos), HASH(rce->vibrato_speed);
+		HASH(rce->vibrato_wave), HASH(rce->vibrato_vol), HASH(rce->last_vibrato);
+		HASH(rce->tremolo_pos), HASH(rce->tremolo_speed), HASH(rce->tremolo_wave);
+		HASH(rce->last_tremolo), HASH(rce->delay_ticks), HASH(rce->sample_pos);
+		HASH(rce->loop_count), HASH(rce->loop_row), HASH(rce->volume_slide), HASH(rce->retrig);
+
+		ma = &rm->mix[i];
+		HASH(ma->fraction_per_sample), HASH(ma->last_sample), HASH(ma->cur_sample), HASH(ma->volume);
+		#ifdef TRACKER
+		HASH(ma->mute);
+		#endif
+		HASH(ma->sample_pos), HASH(ma->next_sample);
+		if (ma->next_sample < (1 << MA_SAMPLE_BUFFER_LEN))
+			HASH(ma->buffer);
+	}
+
+	return h;
+}
+
+
+/*
+ * The absolute fingerprint only matches at the same position.
+ * The relative one stands for the patterns played from here on instead, it doesn't exist if the next position came from a jump.
+ */
+static int _fingerprint(struct RickmodState *rm, int fast, uint64_t *absolute, uint64_t *relative) {
+	uint64_t h = _fingerprint_state(rm, fast);
+	uint8_t pos = rm->cur.pattern, next = _next_position(rm, pos), code, last = next <= pos;
+
+	*relative = h;
+	HASH(rm->cur.pattern), HASH(rm->cur.next_pattern);
+	*absolute = h;
+
+	if ((code = _position_code(rm, rm->cur.next_pattern, pos)) == POSITION_OTHER)
+		return 0;
+	h = *relative;
+	HASH(rm->pattern_lookup[pos]), HASH(rm->pattern_lookup[next]), HASH(last), HASH(code);
+	*relative = h;
+	return 1;
+}
+
+
+static uint32_t _sounding(struct RickmodState *rm) {
+	uint32_t mask = 0;
+	int i;
+
+	for (i = 0; i < rm->channels; i++)
+		if (rm->mix[i].fraction_per_sample)
+			mask |= 1U << i;
+	return mask;
+}
+
+
+/* Random vibrato or tremolo waveforms, callbacks, events or taps that would be skipped and pending commands rule out replaying */
+static int _replayable(struct RickmodState *rm) {
+	int i;
+
+	if (rm->row_callback || rm->events || rm->taps || rickmod_command_peek(rm))
+		return 0;
+	#ifdef TRACKER
+	if (rm->repeat_callback)
+		return 0;
+	#endif
+	for (i = 0; i < rm->channels; i++)
+		if ((rm->channel[i].rce.vibrato_wave & 3) == 3 || (rm->channel[i].rce.tremolo_wave & 3) == 3)
+			return 0;
+	return 1;
+}
+
+
+static void _save(struct RickmodState *rm, struct RickmodMemoState *state) {
+	state->cur = rm->cur;
+	state->end = rm->end;
+	memcpy(state->channel, rm->channel, sizeof(*rm->channel) * rm->channels);
+	memcpy(state->mix, rm->mix, sizeof(*rm->mix) * rm->channels);
+}
+
+
+static void _restore(struct RickmodState *rm, struct RickmodMemoState *state) {
+	rm->cur = state->cur;
+	rm->end = state->end;
+	memcpy(rm->channel, state->channel, sizeof(*rm->channel) * rm->channels);
+	memcpy(rm->mix, state->mix, sizeof(*rm->mix) * rm->channels);
+	rm->s3m.row_pattern = -1;
+}
+
+
+static void _finish_recording(struct RickmodState *rm) {
+	struct RickmodMemo *memo = rm->memo;
+	struct RickmodMemoEntry *entry;
+
+	memo->recording = 0;
+	if (!memo->frames || memo->bytes + sizeof(*entry) + memo->frames * 8 > memo->max_bytes)
+		return;
+	if (!(entry = malloc(sizeof(*entry))))
+		return;
+	entry->frames = memo->frames;
+	entry->pcm = memo->pcm;
+	_save(rm, &entry->exit);
+	entry->exit_pattern = _position_code(rm, rm->cur.pattern, memo->position);
+	entry->exit_next = _position_code(rm, rm->cur.next_pattern, rm->cur.pattern);
+	entry->relative = memo->relative && !memo->jumped && entry->exit_pattern != POSITION_OTHER && entry->exit_next != POSITION_OTHER;
+	entry->hash = entry->relative ? memo->relative_hash : memo->hash;
+	entry->next = memo->entries;
+	memo->entries = entry;
+	memo->bytes += sizeof(*entry) + memo->frames * 8;
+	memo->stats.entries++;
+	memo->pcm = NULL;
+	memo->size = 0;
+}
+
+
+/* A new pattern entry either starts a replay or a recording */
+static void _enter_pattern(struct RickmodState *rm) {
+	struct RickmodMemo *memo = rm->memo;
+	struct RickmodMemoEntry *entry;
+	uint64_t hash, relative_hash;
+	int relative;
+
+	memo->last_pattern = rm->cur.pattern;
+	memo->last_row = rm->cur.row;
+	if (memo->recording)
+		_finish_recording(rm);
+	if (!_replayable(rm))
+		return;
+
+	relative = _fingerprint(rm, memo->fast, &hash, &relative_hash);
+	for (entry = memo->entries; entry; entry = entry->next)
+		if (entry->relative ? relative && entry->hash == relative_hash : entry->hash == hash) {
+			memo->replay = entry;
+			memo->replay_pos = 0;
+			memo->replay_position = rm->cur.pattern;
+			memo->stats.replays++;
+			return;
+		}
+
+	if (memo->bytes + sizeof(struct RickmodMemoEntry) < memo->max_bytes) {
+		memo->hash = hash;
+		memo->relative_hash = relative_hash;
+		memo->relative = relative;
+		memo->jumped = 0;
+		memo->position = rm->cur.pattern;
+		memo->sounding = _sounding(rm);
+		memo->frames = 0;
+		memo->recording = 1;
+	}
+}
+
+
+/* Jumps go to a fixed position, so what was recorded only plays back at the position it was recorded at */
+void rickmod_memo_jump(struct RickmodState *rm) {
+	rm->memo->jumped = 1;
+}
+
+
+/* Called after every tick, pattern entries are row changes that don't move forward in the same pattern */
+void rickmod_memo_tick(struct RickmodState *rm, int fast) {
+	struct RickmodMemo *memo = rm->memo;
+
+	memo->fast = fast;
+	memo->sounding = _sounding(rm);
+	if (rm->cur.tick || rm->end)
+		return;
+	if (rm->cur.pattern == memo->last_pattern && rm->cur.row > memo->last_row) {
+		memo->last_row = rm->cur.row;
+		return;
+	}
+	_enter_pattern(rm);
+}
+
+
+void rickmod_memo_record(struct RickmodState *rm, int32_t *left, int32_t *right, int samples) {
+	struct RickmodMemo *memo = rm->memo;
+	int32_t *pcm;
+	uint32_t size;
+	int i;
+
+	if (!memo->recording)
+		return;
+	/* Degraded output would outlive the load that caused it */
+	if (GOVERNOR_DEGRADED(rm)) {
+		memo->recording = 0;
+		return;
+	}
+	/*
+	 * A one shot that runs out keeps playing to the end of the mix call, and the caller decides where that is.
+	 * Neither what it left in the output nor the phase it stopped at would be the same at another call size.
+	 */
+	if (memo->sounding & ~_sounding(rm)) {
+		memo->recording = 0;
+		return;
+	}
+	if (memo->frames + samples > memo->size) {
+		for (size = memo->size ? memo->size : 4096; size < memo->frames + samples; size <<= 1);
+		if (memo->bytes + sizeof(struct RickmodMemoEntry) + size * 8 > memo->max_bytes || !(pcm = realloc(memo->pcm, size * 8))) {
+			memo->recording = 0;
+			return;
+		}
+		memo->pcm = pcm;
+		memo->size = size;
+	}
+
+	for (i = 0, pcm = memo->pcm + memo->frames * 2; i < samples; i++) {
+		*pcm++ = left[i];
+		*pcm++ = right[i];
+	}
+	memo->frames += samples;
+}
+
+
+int rickmod_memo_replaying(struct RickmodState *rm) {
+	return rm->memo->replay != NULL;
+}
+
+
+/* Copies cached output, and jumps to the cached exit state once all of it has been played */
+int rickmod_memo_replay(struct RickmodState *rm, int32_t *left, int32_t *right, int samples) {
+	struct RickmodMemo *memo = rm->memo;
+	struct RickmodMemoEntry *entry = memo->replay;
+	int32_t *pcm;
+	int i;
+
+	if (samples > (int) (entry->frames - memo->replay_pos))
+		samples = entry->frames - memo->replay_pos;
+	for (i = 0, pcm = entry->pcm + memo->replay_pos * 2; i < samples; i++) {
+		left[i] = *pcm++;
+		right[i] = *pcm++;
+	}
+
+	memo->replay_pos += samples;
+	memo->stats.frames_replayed += samples;
+	if (memo->replay_pos == entry->frames) {
+		memo->replay = NULL;
+		_restore(rm, &entry->exit);
+		if (entry->relative) {
+			rm->cur.pattern = _position(rm, entry->exit_pattern, memo->replay_position);
+			rm->cur.next_pattern = _position(rm, entry->exit_next, rm->cur.pattern);
+		}
+		_enter_pattern(rm);
+	}
+
+	return samples;
+}
+
+
+void rickmod_memo_abort(struct RickmodState *rm) {
+	if (!rm->memo)
+		return;
+	rm->memo->recording = 0;
+	rm->memo->replay = NULL;
+	rm->memo->last_pattern = rm->cur.pattern;
+	rm->memo->last_row = rm->cur.row;
+}
+
+
+/* Pattern or sample data changed, so nothing cached can be trusted anymore */
+void rickmod_memo_flush(struct RickmodState *rm) {
+	struct RickmodMemoEntry *entry, *next;
+
+	if (!rm->memo)
+		return;
+	for (entry = rm->memo->entries; entry; entry = next) {
+		next = entry->next;
+		free(entry->pcm);
+		free(entry);
+	}
+	rm->memo->entries = NULL;
+	rm->memo->bytes = 0;
+	rm->memo->stats.entries = 0;
+	rickmod_memo_abort(rm);
+}
+
+
+void rickmod_memo_free(struct RickmodState *rm) {
+	if (!rm->memo)
+		return;
+	rickmod_memo_flush(rm);
+	free(rm->memo->pcm);
+	free(rm->memo);
+	rm->memo = NULL;
+}
+
+
+int rm_memo_set(struct RickmodState *rm, uint32_t max_bytes) {
+	rickmod_memo_free(rm);
+	if (!max_bytes)
+		return 1;
+	if (!(rm->memo = calloc(1, sizeof(*rm->memo))))
+		return 0;
+	rm->memo->max_bytes = max_bytes;
+	rickmod_memo_abort(rm);
+	return 1;
+}
+
+
+void rm_memo_stats(struct RickmodState *rm, struct RickmodMemoStats *stats) {
+	if (!rm->memo) {
+		memset(stats, 0, sizeof(*stats));
+		return;
+	}
+	*stats = rm->memo->stats;
+	stats->bytes = rm->memo->bytes;
+}
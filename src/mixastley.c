@@ -118,6 +118,41 @@ void ma_add(struct MAState *rs, int32_t *sample, int samples) {
 }
 
 
+/* Same buffer scale as ma_add, so a voice can move between the two at any sample */
+void ma_add_nearest(struct MAState *rs, int32_t *sample, int samples) {
+	int i;
+	int32_t fraction_per_sample;
+
+	if (!rs->get_next_sample)
+		return;
+
+	if (!rs->fraction_per_sample) {
+		rs->cur_sample = rs->last_sample = 0;
+		return;
+	}
+
+	fraction_per_sample = rs->fraction_per_sample;
+
+	for (i = 0; i < samples; i++) {
+		#ifdef TRACKER
+		if (!rs->mute)
+		#endif
+			sample[i] += (((rs->last_sample >> 15) * rs->volume) >> 6);
+		rs->sample_pos += fraction_per_sample;
+		if (rs->sample_pos >= 0x10000) {
+			rs->next_sample += rs->sample_pos >> 16;
+			rs->sample_pos &= 0xFFFF;
+			if (rs->next_sample >= (1 << MA_SAMPLE_BUFFER_LEN)) {
+				rs->next_sample &= (0xFFFF >> (16 - MA_SAMPLE_BUFFER_LEN));
+				resample_refill(rs);
+			}
+			rs->last_sample = rs->cur_sample;
+			rs->cur_sample = rs->buffer[rs->next_sample];
+		}
+	}
+}
+
+
 void ma_add_fast(struct MAState *rs, int32_t *sample, int samples) {
 	int i;
 	int32_t tmp, fraction_per_sample;
@@ -151,6 +186,36 @@ void ma_add_fast(struct MAState *rs, int32_t *sample, int samples) {
 }
 
 
+/* Moves a voice along without mixing it, buffers are still refilled so the callback keeps its place */
+static void skip(struct MAState *rs, int samples, void (*refill)(struct MAState *rs)) {
+	uint64_t pos;
+	uint32_t steps, next;
+
+	if (!rs->get_next_sample || !rs->fraction_per_sample)
+		return;
+
+	pos = rs->sample_pos + (uint64_t) rs->fraction_per_sample * samples;
+	rs->sample_pos = pos & 0xFFFF;
+	if (!(steps = pos >> 16))
+		return;
+	for (next = rs->next_sample + steps; next >= (1 << MA_SAMPLE_BUFFER_LEN); next -= (1 << MA_SAMPLE_BUFFER_LEN))
+		refill(rs);
+	rs->next_sample = next;
+	rs->last_sample = steps > 1 && next ? rs->buffer[next - 1] : rs->cur_sample;
+	rs->cur_sample = rs->buffer[next];
+}
+
+
+void ma_skip(struct MAState *rs, int samples) {
+	skip(rs, samples, resample_refill);
+}
+
+
+void ma_skip_fast(struct MAState *rs, int samples) {
+	skip(rs, samples, resample_refill_fast);
+}
+
+
 struct MAState ma_init(int target_sample_rate) {
 	struct MAState rs;
 
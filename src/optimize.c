@@ -0,0 +1,211 @@
+#include "rickmod.h"
+#include "compiled.h"
+#include "memo.h"
+#include "util.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define	OPTIMIZE_RATE 44100
+#define	OPTIMIZE_CHUNK 1024
+#define	OPTIMIZE_MAX_FRAMES (OPTIMIZE_RATE * 600) // Songs that loop forever are compared for ten minutes
+#define	OPTIMIZE_BLOCK (1 << MA_SAMPLE_BUFFER_LEN)
+
+#define	STEP_MERGE 1
+#define	STEP_TRIM 2
+
+
+struct Original {
+	struct RickmodPattern	*pattern;
+	uint8_t			patterns;
+	uint8_t			order[128];
+	struct RickmodSample	sample[31];
+};
+
+
+/* What a fresh player makes of the module as rm_save_mem() would write it */
+static int _render_hash(struct RickmodState *rm, uint64_t *hash, uint32_t *bytes) {
+	struct RickmodState *player;
+	int16_t buff[OPTIMIZE_CHUNK * 2];
+	uint32_t len, frames;
+	uint8_t *mod;
+
+	if (!rm_save_mem(rm, &mod, &len))
+		return 0;
+	if (!(player = rm_init(OPTIMIZE_RATE, mod, len))) {
+		free(mod);
+		return 0;
+	}
+
+	*hash = RICKMOD_FNV64_INIT;
+	for (frames = 0; !rm_end_reached(player) && frames < OPTIMIZE_MAX_FRAMES; frames += OPTIMIZE_CHUNK) {
+		rm_mix_s16(player, buff, OPTIMIZE_CHUNK);
+		*hash = rickmod_fnv64(*hash, buff, sizeof(buff));
+	}
+	*bytes = len;
+
+	rm_free(player);
+	free(mod);
+	return 1;
+}
+
+
+static void _restore(struct RickmodState *rm, struct Original *orig) {
+	memcpy(rm->pattern, orig->pattern, sizeof(*rm->pattern) * orig->patterns);
+	rm->patterns = orig->patterns;
+	memcpy(rm->order, orig->order, sizeof(rm->order));
+	memcpy(rm->sample, orig->sample, sizeof(orig->sample));
+}
+
+
+/* Only orders inside the song are reachable, B and D effects past its end wrap to the first order */
+static void _dedupe_patterns(struct RickmodState *rm) {
+	struct RickmodPattern *pattern = rm->pattern;
+	uint64_t hash[128];
+	uint8_t map[128], used[128] = { 0 };
+	int i, j, kept = 0;
+
+	for (i = 0; i < rm->song_length; i++)
+		used[rm->order[i]] = 1;
+
+	for (i = 0; i < rm->patterns; i++) {
+		if (!used[i])
+			continue;
+		hash[kept] = rickmod_fnv64(RICKMOD_FNV64_INIT, &pattern[i], sizeof(*pattern));
+		for (j = 0; j < kept; j++)
+			if (hash[j] == hash[kept] && !memcmp(&pattern[j], &pattern[i], sizeof(*pattern)))
+				break;
+		map[i] = j;
+		if (j == kept) {
+			/* Kept patterns only ever move down, so nothing that is still to be looked at is overwritten */
+			if (kept != i)
+				pattern[kept] = pattern[i];
+			kept++;
+		}
+	}
+
+	for (i = 0; i < 128; i++)
+		rm->order[i] = i < rm->song_length ? map[rm->order[i]] : 0;
+	memset(&pattern[kept], 0, sizeof(*pattern) * (rm->patterns - kept));
+	rm->patterns = kept;
+}
+
+
+static int _same_sample(struct RickmodSample *a, struct RickmodSample *b) {
+	return a->length == b->length && a->repeat == b->repeat && a->repeat_length == b->repeat_length &&
+		a->finetune == b->finetune && a->volume == b->volume && !memcmp(a->sample_data, b->sample_data, a->length);
+}
+
+
+/*
+ * A sample that doesn't loop plays until the end of the mix call in which a refill runs out of data.
+ * Refills start on whole blocks of the sample, 9xx offsets are multiples of 256 too, so silence inside the last
+ * block runs out in the same refill and reads the same as the zeros the refill pads with. Anything more moves the end.
+ */
+static uint32_t _trim(struct RickmodSample *s) {
+	uint32_t last, keep;
+
+	if (!s->length || !(!s->repeat_length || (!s->repeat && s->repeat_length <= 2)))
+		return 0;
+	for (last = s->length; last > 0 && !s->sample_data[last - 1]; last--);
+	keep = ((s->length - 1) & ~(OPTIMIZE_BLOCK - 1)) + 1;
+	if (last > keep)
+		keep = last;
+	keep = (keep + 1) & ~1;
+	if (keep >= s->length)
+		return 0;
+	last = s->length - keep;
+	s->length = keep;
+	return last;
+}
+
+
+static void _optimize_samples(struct RickmodState *rm, int steps, struct RickmodOptimizeStats *stats) {
+	struct RickmodChannel *cell;
+	uint8_t map[256], used[256] = { 0 };
+	int i, j, cells = rm->patterns * 64 * 4;
+
+	cell = &rm->pattern[0].row[0].channel[0];
+	for (i = 0; i < cells; i++)
+		used[cell[i].sample] = 1;
+
+	for (i = 0; i < 256; i++)
+		map[i] = i;
+	for (i = 2; i <= 31; i++) {
+		if (!used[i] || !(steps & STEP_MERGE))
+			continue;
+		for (j = 1; j < i; j++)
+			if (used[j] && map[j] == j && _same_sample(&rm->sample[j - 1], &rm->sample[i - 1]))
+				break;
+		if (j < i) {
+			map[i] = j, used[i] = 0;
+			stats->samples_merged++;
+		}
+	}
+	for (i = 0; i < cells; i++)
+		if (cell[i].sample)
+			cell[i].sample = map[cell[i].sample];
+
+	for (i = 1; i <= 31; i++) {
+		if (!used[i]) {
+			if (rm->sample[i - 1].length && map[i] == i)
+				stats->samples_dropped++;
+			rm->sample[i - 1].length = rm->sample[i - 1].repeat = rm->sample[i - 1].repeat_length = 0;
+		} else if (steps & STEP_TRIM)
+			stats->bytes_trimmed += _trim(&rm->sample[i - 1]);
+	}
+}
+
+
+/* Tries everything first, then backs off the steps that can change what is heard until the render hash matches */
+int rm_optimize(struct RickmodState *rm, struct RickmodOptimizeStats *stats) {
+	static const int attempt[] = { STEP_MERGE | STEP_TRIM, STEP_MERGE, STEP_TRIM, 0 };
+	struct RickmodOptimizeStats before;
+	struct Original orig;
+	uint64_t hash;
+	unsigned i;
+
+	memset(stats, 0, sizeof(*stats));
+	if (rm->format != RM_FORMAT_MOD || !rickmod_compiled_own_patterns(rm))
+		return 0;
+	/* The editor can use patterns past the count the module was loaded with */
+	for (i = 0; i < 128; i++) {
+		rm->order[i] &= 127;
+		if (rm->order[i] >= rm->patterns)
+			rm->patterns = rm->order[i] + 1;
+	}
+	if (!_render_hash(rm, &stats->render_hash, &stats->bytes_before))
+		return 0;
+	stats->patterns_before = stats->patterns_after = rm->patterns;
+	stats->bytes_after = stats->bytes_before;
+	before = *stats;
+
+	orig.patterns = rm->patterns;
+	if (!(orig.pattern = malloc(sizeof(*rm->pattern) * orig.patterns)))
+		return 0;
+	memcpy(orig.pattern, rm->pattern, sizeof(*rm->pattern) * orig.patterns);
+	memcpy(orig.order, rm->order, sizeof(orig.order));
+	memcpy(orig.sample, rm->sample, sizeof(orig.sample));
+
+	for (i = 0; i < sizeof(attempt) / sizeof(*attempt); i++) {
+		*stats = before;
+		_dedupe_patterns(rm);
+		_optimize_samples(rm, attempt[i], stats);
+		/* Merged samples can leave more patterns the same */
+		_dedupe_patterns(rm);
+		stats->patterns_after = rm->patterns;
+		if (_render_hash(rm, &hash, &stats->bytes_after) && hash == stats->render_hash)
+			break;
+		_restore(rm, &orig);
+	}
+	free(orig.pattern);
+	if (i == sizeof(attempt) / sizeof(*attempt)) {
+		*stats = before;
+		return 0;
+	}
+
+	rickmod_memo_flush(rm);
+	rm_reset(rm);
+	return 1;
+}
@@ -0,0 +1,195 @@
+#ifdef HOSTED
+
+#define	_GNU_SOURCE
+
+#include "rickmod.h"
+#include "command.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+
+struct RickmodPlayback {
+	struct RickmodState	*rm;
+	int			format;
+	uint32_t		frame_size;
+	uint32_t		chunk_frames;
+	struct timespec		idle;
+
+	/* Single producer, single consumer, positions only ever grow and are masked on use */
+	uint8_t			*ring;
+	uint32_t		ring_frames;
+	_Atomic uint32_t	write_pos;
+	_Atomic uint32_t	read_pos;
+
+	_Atomic uint32_t	underruns;
+	_Atomic int		ended;
+	_Atomic int		running;
+	pthread_t		thread;
+};
+
+
+static void _render(struct RickmodPlayback *pb, uint8_t *buff, uint32_t frames) {
+	if (pb->format == RM_RENDER_S16)
+		rm_mix_s16(pb->rm, (int16_t *) buff, frames);
+	else if (pb->format == RM_RENDER_S16_FAST)
+		rm_mix_s16_fast(pb->rm, (int16_t *) buff, frames);
+	else
+		rm_mix_u8(pb->rm, buff, frames);
+}
+
+
+/*
+ * Renders straight into the ring, only up to the wrap point so every chunk is contiguous.
+ * Past the end only queued commands are worth a chunk, the mixer applies them and a jump plays on from there.
+ */
+static void *_producer(void *data) {
+	struct RickmodPlayback *pb = data;
+	uint32_t write_pos, read_pos, free_frames, offset, frames;
+
+	while (atomic_load_explicit(&pb->running, memory_order_relaxed)) {
+		write_pos = atomic_load_explicit(&pb->write_pos, memory_order_relaxed);
+		read_pos = atomic_load_explicit(&pb->read_pos, memory_order_acquire);
+		free_frames = pb->ring_frames - (write_pos - read_pos);
+		if (free_frames < pb->chunk_frames || (rm_end_reached(pb->rm) && !rickmod_command_peek(pb->rm))) {
+			nanosleep(&pb->idle, NULL);
+			continue;
+		}
+
+		offset = write_pos & (pb->ring_frames - 1);
+		frames = pb->chunk_frames;
+		if (frames > pb->ring_frames - offset)
+			frames = pb->ring_frames - offset;
+		_render(pb, pb->ring + offset * pb->frame_size, frames);
+		atomic_store_explicit(&pb->write_pos, write_pos + frames, memory_order_release);
+		atomic_store_explicit(&pb->ended, rm_end_reached(pb->rm), memory_order_release);
+	}
+
+	return NULL;
+}
+
+
+static void _set_scheduling(pthread_attr_t *attr, int priority, int cpu) {
+	struct sched_param param;
+
+	if (priority > 0) {
+		param.sched_priority = priority;
+		pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(attr, SCHED_FIFO);
+		pthread_attr_setschedparam(attr, &param);
+	}
+	#ifdef __linux__
+	if (cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+	}
+	#else
+	(void) cpu;
+	#endif
+}
+
+
+struct RickmodPlayback *rm_playback_start(struct RickmodState *rm, const struct RickmodPlaybackConfig *config) {
+	struct RickmodPlayback *pb;
+	pthread_attr_t attr;
+	uint64_t idle_ns;
+	int err;
+
+	if (config->format < RM_RENDER_S16 || config->format > RM_RENDER_U8 || !config->chunk_frames)
+		return NULL;
+	if (!(pb = calloc(1, sizeof(*pb))))
+		return NULL;
+
+	pb->rm = rm;
+	pb->format = config->format;
+	pb->frame_size = config->format == RM_RENDER_U8 ? 2 : 4;
+	pb->chunk_frames = config->chunk_frames;
+	for (pb->ring_frames = 1; pb->ring_frames < config->ring_frames || pb->ring_frames < 2 * config->chunk_frames; pb->ring_frames <<= 1);
+	if (!(pb->ring = calloc(pb->ring_frames, pb->frame_size))) {
+		free(pb);
+		return NULL;
+	}
+
+	/* When the ring is full, check back after half a chunk has been played */
+	idle_ns = (uint64_t) pb->chunk_frames * 500000000 / rm->samplerate;
+	pb->idle.tv_sec = idle_ns / 1000000000;
+	pb->idle.tv_nsec = idle_ns % 1000000000;
+	atomic_store(&pb->running, 1);
+
+	pthread_attr_init(&attr);
+	_set_scheduling(&attr, config->priority, config->cpu);
+	err = pthread_create(&pb->thread, &attr, _producer, pb);
+	pthread_attr_destroy(&attr);
+	/* Realtime priority usually needs privileges, so fall back to normal scheduling */
+	if (err && config->priority > 0) {
+		pthread_attr_init(&attr);
+		_set_scheduling(&attr, 0, config->cpu);
+		err = pthread_create(&pb->thread, &attr, _producer, pb);
+		pthread_attr_destroy(&attr);
+	}
+	if (err) {
+		free(pb->ring);
+		free(pb);
+		return NULL;
+	}
+
+	return pb;
+}
+
+
+/* Never blocks, whatever the ring can't provide is filled with silence and counted as an underrun */
+uint32_t rm_playback_read(struct RickmodPlayback *pb, void *buff, uint32_t frames) {
+	uint32_t write_pos, read_pos, available, offset, first, n;
+	uint8_t *out = buff;
+
+	read_pos = atomic_load_explicit(&pb->read_pos, memory_order_relaxed);
+	write_pos = atomic_load_explicit(&pb->write_pos, memory_order_acquire);
+	available = write_pos - read_pos;
+	n = frames < available ? frames : available;
+
+	offset = read_pos & (pb->ring_frames - 1);
+	first = n < pb->ring_frames - offset ? n : pb->ring_frames - offset;
+	memcpy(out, pb->ring + offset * pb->frame_size, first * pb->frame_size);
+	memcpy(out + first * pb->frame_size, pb->ring, (n - first) * pb->frame_size);
+	atomic_store_explicit(&pb->read_pos, read_pos + n, memory_order_release);
+
+	if (n < frames) {
+		memset(out + n * pb->frame_size, pb->format == RM_RENDER_U8 ? 0x80 : 0, (frames - n) * pb->frame_size);
+		if (!atomic_load_explicit(&pb->ended, memory_order_acquire))
+			atomic_fetch_add_explicit(&pb->underruns, 1, memory_order_relaxed);
+	}
+
+	return n;
+}
+
+
+uint32_t rm_playback_fill(struct RickmodPlayback *pb) {
+	return atomic_load_explicit(&pb->write_pos, memory_order_acquire) - atomic_load_explicit(&pb->read_pos, memory_order_acquire);
+}
+
+
+uint32_t rm_playback_underruns(struct RickmodPlayback *pb) {
+	return atomic_load_explicit(&pb->underruns, memory_order_relaxed);
+}
+
+
+int rm_playback_ended(struct RickmodPlayback *pb) {
+	return atomic_load_explicit(&pb->ended, memory_order_acquire) && !rm_playback_fill(pb);
+}
+
+
+void rm_playback_stop(struct RickmodPlayback *pb) {
+	atomic_store(&pb->running, 0);
+	pthread_join(pb->thread, NULL);
+	free(pb->ring);
+	free(pb);
+}
+
+#endif
@@ -0,0 +1,297 @@
+#ifdef HOSTED
+
+#include "rickmod.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+
+#define	PLAYLIST_CHUNK 1024 // Frames mixed at a time, the crossfade buffer lives on the stack
+#define	PLAYLIST_RETIRE_LEN 8 // Must be a power of two
+#define	PLAYLIST_IDLE_NS 10000000
+#define	PLAYLIST_MAX_FRAMES(rate) ((uint64_t) (rate) * 3600) // Songs that never end are cut after an hour
+
+
+/* A module that is loaded, measured and rewound, ready to start on any frame */
+struct PlaylistEntry {
+	struct RickmodState	*rm;
+	uint64_t		length; // Frames it plays for
+	uint64_t		played;
+};
+
+
+struct PlaylistPath {
+	struct PlaylistPath	*next;
+	char			path[];
+};
+
+
+struct RickmodPlaylist {
+	int			sample_rate;
+	uint32_t		crossfade_frames;
+	uint64_t		max_frames;
+	uint8_t			share_samples;
+
+	/* Paths waiting to be loaded, only the caller and the loader touch these */
+	pthread_mutex_t		lock;
+	struct PlaylistPath	*head;
+	struct PlaylistPath	**tail;
+
+	/* Loader to renderer, one module at a time */
+	_Atomic(struct PlaylistEntry *) ready;
+
+	/* Renderer to loader, finished modules are freed off the render path */
+	struct PlaylistEntry	*retire[PLAYLIST_RETIRE_LEN];
+	_Atomic uint32_t	retire_head;
+	_Atomic uint32_t	retire_tail;
+
+	/* Only the renderer touches these */
+	struct PlaylistEntry	*cur;
+	struct PlaylistEntry	*next; // Fading in
+
+	_Atomic uint32_t	pending; // Added and neither started nor failed
+	_Atomic uint32_t	started;
+	_Atomic uint32_t	failed;
+	_Atomic uint32_t	underruns;
+	_Atomic int		running;
+	pthread_t		thread;
+};
+
+
+static void _entry_free(struct PlaylistEntry *e) {
+	rm_free(e->rm);
+	free(e);
+}
+
+
+/* The song is played through once without mixing, so the renderer knows where it ends before it gets there */
+static struct PlaylistEntry *_prepare(struct RickmodPlaylist *pl, const char *path) {
+	struct PlaylistEntry *e;
+
+	if (!(e = calloc(1, sizeof(*e))))
+		return NULL;
+	if (!(e->rm = rm_open_file(pl->sample_rate, path))) {
+		free(e);
+		return NULL;
+	}
+	if (pl->share_samples)
+		rm_pool_share(e->rm);
+
+	e->length = rm_measure(e->rm, pl->max_frames);
+	rm_reset(e->rm);
+	return e;
+}
+
+
+static void *_loader(void *data) {
+	struct RickmodPlaylist *pl = data;
+	struct timespec idle = { 0, PLAYLIST_IDLE_NS };
+	struct PlaylistPath *p;
+	struct PlaylistEntry *e;
+	uint32_t tail;
+
+	while (atomic_load_explicit(&pl->running, memory_order_relaxed)) {
+		tail = atomic_load_explicit(&pl->retire_tail, memory_order_relaxed);
+		while (tail != atomic_load_explicit(&pl->retire_head, memory_order_acquire)) {
+			_entry_free(pl->retire[tail & (PLAYLIST_RETIRE_LEN - 1)]);
+			atomic_store_explicit(&pl->retire_tail, ++tail, memory_order_release);
+		}
+
+		p = NULL;
+		if (!atomic_load_explicit(&pl->ready, memory_order_acquire)) {
+			pthread_mutex_lock(&pl->lock);
+			if ((p = pl->head) && !(pl->head = p->next))
+				pl->tail = &pl->head;
+			pthread_mutex_unlock(&pl->lock);
+		}
+		if (!p) {
+			nanosleep(&idle, NULL);
+			continue;
+		}
+
+		if ((e = _prepare(pl, p->path)))
+			atomic_store_explicit(&pl->ready, e, memory_order_release);
+		else {
+			atomic_fetch_add_explicit(&pl->failed, 1, memory_order_relaxed);
+			atomic_fetch_sub_explicit(&pl->pending, 1, memory_order_relaxed);
+		}
+		free(p);
+	}
+
+	return NULL;
+}
+
+
+struct RickmodPlaylist *rm_playlist_new(const struct RickmodPlaylistConfig *config) {
+	struct RickmodPlaylist *pl;
+
+	if (config->sample_rate <= 0)
+		return NULL;
+	if (!(pl = calloc(1, sizeof(*pl))))
+		return NULL;
+	pl->sample_rate = config->sample_rate;
+	pl->crossfade_frames = config->crossfade_frames;
+	pl->max_frames = config->max_frames ? config->max_frames : PLAYLIST_MAX_FRAMES(config->sample_rate);
+	pl->share_samples = config->share_samples;
+	pl->tail = &pl->head;
+	pthread_mutex_init(&pl->lock, NULL);
+	atomic_store(&pl->running, 1);
+
+	if (pthread_create(&pl->thread, NULL, _loader, pl)) {
+		pthread_mutex_destroy(&pl->lock);
+		free(pl);
+		return NULL;
+	}
+	return pl;
+}
+
+
+int rm_playlist_add(struct RickmodPlaylist *pl, const char *path) {
+	struct PlaylistPath *p;
+
+	if (!(p = malloc(sizeof(*p) + strlen(path) + 1)))
+		return 0;
+	strcpy(p->path, path);
+	p->next = NULL;
+
+	pthread_mutex_lock(&pl->lock);
+	*pl->tail = p;
+	pl->tail = &p->next;
+	atomic_fetch_add_explicit(&pl->pending, 1, memory_order_relaxed);
+	pthread_mutex_unlock(&pl->lock);
+	return 1;
+}
+
+
+/* Only taken while the retire ring has room for everything the renderer holds */
+static struct PlaylistEntry *_take(struct RickmodPlaylist *pl) {
+	struct PlaylistEntry *e;
+	uint32_t held;
+
+	held = atomic_load_explicit(&pl->retire_head, memory_order_relaxed) - atomic_load_explicit(&pl->retire_tail, memory_order_acquire);
+	if (held > PLAYLIST_RETIRE_LEN - 2)
+		return NULL;
+	if (!atomic_load_explicit(&pl->ready, memory_order_acquire))
+		return NULL;
+	e = atomic_exchange_explicit(&pl->ready, NULL, memory_order_acq_rel);
+	atomic_fetch_sub_explicit(&pl->pending, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&pl->started, 1, memory_order_relaxed);
+	return e;
+}
+
+
+static void _retire(struct RickmodPlaylist *pl, struct PlaylistEntry *e) {
+	uint32_t head = atomic_load_explicit(&pl->retire_head, memory_order_relaxed);
+
+	pl->retire[head & (PLAYLIST_RETIRE_LEN - 1)] = e;
+	atomic_store_explicit(&pl->retire_head, head + 1, memory_order_release);
+}
+
+
+/* Linear ramps, the gain has 16 fraction bits and the step 32, written as one flat loop so the compiler vectorizes it */
+static void _crossfade(int16_t *out, const int16_t *in, uint32_t frames, uint64_t pos, uint64_t len) {
+	int64_t gain, step;
+	uint32_t i;
+
+	step = (int64_t) ((65536ULL << 16) / len);
+	gain = (int64_t) pos * step;
+	for (i = 0; i < frames * 2; i++) {
+		int32_t g = (gain + step * (i >> 1)) >> 16;
+		out[i] = (out[i] * (65536 - g) + in[i] * g) >> 16;
+	}
+}
+
+
+/* Never blocks and never allocates, when the next module isn't loaded yet the rest is silence */
+uint32_t rm_playlist_mix_s16(struct RickmodPlaylist *pl, int16_t *buff, uint32_t frames) {
+	int16_t fade[PLAYLIST_CHUNK * 2];
+	struct PlaylistEntry *cur;
+	uint64_t left, fade_at;
+	uint32_t done = 0, n;
+
+	while (done < frames) {
+		if (!pl->cur && !(pl->cur = _take(pl))) {
+			if (atomic_load_explicit(&pl->pending, memory_order_relaxed))
+				atomic_fetch_add_explicit(&pl->underruns, 1, memory_order_relaxed);
+			break;
+		}
+		cur = pl->cur;
+		if (!(left = cur->length - cur->played)) {
+			_retire(pl, cur);
+			pl->cur = pl->next;
+			pl->next = NULL;
+			continue;
+		}
+		/* A module shorter than the fade ends inside it, the outgoing one keeps fading */
+		if (pl->next && pl->next->played == pl->next->length) {
+			_retire(pl, pl->next);
+			pl->next = NULL;
+		}
+
+		n = frames - done < PLAYLIST_CHUNK ? frames - done : PLAYLIST_CHUNK;
+		if (n > left)
+			n = left;
+		fade_at = cur->length > pl->crossfade_frames ? cur->length - pl->crossfade_frames : cur->length;
+		if (cur->played < fade_at) {
+			if (n > fade_at - cur->played)
+				n = fade_at - cur->played;
+		} else if (!pl->next && (pl->next = _take(pl)))
+			continue;
+		if (pl->next && n > pl->next->length - pl->next->played)
+			n = pl->next->length - pl->next->played;
+
+		rm_mix_s16(cur->rm, buff + done * 2, n);
+		if (cur->played >= fade_at) {
+			if (pl->next) {
+				rm_mix_s16(pl->next->rm, fade, n);
+				pl->next->played += n;
+			} else
+				memset(fade, 0, n * 4);
+			_crossfade(buff + done * 2, fade, n, cur->played - fade_at, cur->length - fade_at);
+		}
+		cur->played += n;
+		done += n;
+	}
+
+	memset(buff + done * 2, 0, (frames - done) * 4);
+	return done;
+}
+
+
+void rm_playlist_status(struct RickmodPlaylist *pl, struct RickmodPlaylistStatus *status) {
+	status->pending = atomic_load_explicit(&pl->pending, memory_order_relaxed);
+	status->started = atomic_load_explicit(&pl->started, memory_order_relaxed);
+	status->failed = atomic_load_explicit(&pl->failed, memory_order_relaxed);
+	status->underruns = atomic_load_explicit(&pl->underruns, memory_order_relaxed);
+}
+
+
+void rm_playlist_free(struct RickmodPlaylist *pl) {
+	struct PlaylistEntry *e;
+	struct PlaylistPath *p;
+	uint32_t tail;
+
+	atomic_store(&pl->running, 0);
+	pthread_join(pl->thread, NULL);
+
+	tail = atomic_load(&pl->retire_tail);
+	for (; tail != atomic_load(&pl->retire_head); tail++)
+		_entry_free(pl->retire[tail & (PLAYLIST_RETIRE_LEN - 1)]);
+	if ((e = atomic_load(&pl->ready)))
+		_entry_free(e);
+	if (pl->cur)
+		_entry_free(pl->cur);
+	if (pl->next)
+		_entry_free(pl->next);
+	while ((p = pl->head)) {
+		pl->head = p->next;
+		free(p);
+	}
+	pthread_mutex_destroy(&pl->lock);
+	free(pl);
+}
+
+#endif
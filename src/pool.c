@@ -0,0 +1,196 @@
+#ifdef HOSTED
+
+#include "rickmod.h"
+#include "pool.h"
+#include "compiled.h"
+#include "loader.h"
+#include "util.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define	POOL_PAD ((1 << MA_SAMPLE_BUFFER_LEN) + 2) // Same silence the S3M loader leaves after its samples
+#define	POOL_BUCKETS_MIN 256
+
+
+struct RickmodPoolEntry {
+	uint64_t		hash;
+	uint32_t		length;
+	uint32_t		refs;
+	struct RickmodPoolEntry	*next;
+	int8_t			data[]; // length bytes, then POOL_PAD of silence
+};
+
+
+/* The references one player holds */
+struct RickmodPool {
+	struct RickmodPoolEntry	*entry[RM_MAX_SAMPLES];
+};
+
+
+/* Shared by every player in the process, entries go when the last player using them is freed */
+static struct {
+	pthread_mutex_t		lock;
+	struct RickmodPoolEntry	**bucket;
+	uint32_t		buckets; // Power of two
+	struct RickmodPoolStats	stats;
+} pool = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+
+#ifndef TRACKER
+
+static int8_t silence[POOL_PAD];
+
+
+/* Called with the lock held, a table that can't grow is only slower */
+static void _grow(void) {
+	struct RickmodPoolEntry **bucket, *e, *next;
+	uint32_t i, buckets;
+
+	buckets = pool.buckets ? pool.buckets * 2 : POOL_BUCKETS_MIN;
+	if (!(bucket = calloc(buckets, sizeof(*bucket))))
+		return;
+	for (i = 0; i < pool.buckets; i++)
+		for (e = pool.bucket[i]; e; e = next) {
+			next = e->next;
+			e->next = bucket[e->hash & (buckets - 1)];
+			bucket[e->hash & (buckets - 1)] = e;
+		}
+	free(pool.bucket);
+	pool.bucket = bucket;
+	pool.buckets = buckets;
+}
+
+
+static struct RickmodPoolEntry *_acquire(const int8_t *data, uint32_t length) {
+	struct RickmodPoolEntry *e;
+	uint64_t hash;
+
+	/* Hashed outside the lock, only the lookup is serialized */
+	hash = rickmod_fnv64(rickmod_fnv64(RICKMOD_FNV64_INIT, &length, sizeof(length)), data, length);
+
+	pthread_mutex_lock(&pool.lock);
+	if (pool.stats.samples >= pool.buckets)
+		_grow();
+	if (!pool.buckets) {
+		pthread_mutex_unlock(&pool.lock);
+		return NULL;
+	}
+	for (e = pool.bucket[hash & (pool.buckets - 1)]; e; e = e->next)
+		if (e->hash == hash && e->length == length && !memcmp(e->data, data, length))
+			break;
+
+	if (e) {
+		e->refs++;
+		pool.stats.bytes_saved += length;
+	} else if ((e = malloc(sizeof(*e) + length + POOL_PAD))) {
+		e->hash = hash;
+		e->length = length;
+		e->refs = 1;
+		memcpy(e->data, data, length);
+		memset(e->data + length, 0, POOL_PAD);
+		e->next = pool.bucket[hash & (pool.buckets - 1)];
+		pool.bucket[hash & (pool.buckets - 1)] = e;
+		pool.stats.samples++;
+		pool.stats.bytes += length + POOL_PAD;
+	}
+	if (e)
+		pool.stats.references++;
+	pthread_mutex_unlock(&pool.lock);
+	return e;
+}
+
+#endif
+
+
+static void _release(struct RickmodPoolEntry *e) {
+	struct RickmodPoolEntry **p;
+
+	pthread_mutex_lock(&pool.lock);
+	pool.stats.references--;
+	if (--e->refs) {
+		pool.stats.bytes_saved -= e->length;
+		pthread_mutex_unlock(&pool.lock);
+		return;
+	}
+	for (p = &pool.bucket[e->hash & (pool.buckets - 1)]; *p != e; p = &(*p)->next);
+	*p = e->next;
+	pool.stats.samples--;
+	pool.stats.bytes -= e->length + POOL_PAD;
+	pthread_mutex_unlock(&pool.lock);
+	free(e);
+}
+
+
+static void _release_all(struct RickmodPool *refs) {
+	int i;
+
+	for (i = 0; i < RM_MAX_SAMPLES; i++)
+		if (refs->entry[i])
+			_release(refs->entry[i]);
+	free(refs);
+}
+
+
+void rickmod_pool_free(struct RickmodState *rm) {
+	if (rm->pool)
+		_release_all(rm->pool);
+	rm->pool = NULL;
+}
+
+
+#ifdef TRACKER
+
+/* The editor writes into its samples, those can't be shared */
+int rm_pool_share(struct RickmodState *rm) {
+	(void) rm;
+	return 0;
+}
+
+#else
+
+int rm_pool_share(struct RickmodState *rm) {
+	struct RickmodPool *refs;
+	int i;
+
+	if (rm->pool)
+		return 1;
+	/* Patterns of compiled modules point into the image, they have to be copied before it can go */
+	if (rm->format == RM_FORMAT_MOD && !rickmod_compiled_own_patterns(rm))
+		return 0;
+	if (!(refs = calloc(1, sizeof(*refs))))
+		return 0;
+	for (i = 0; i < rm->samples; i++) {
+		if (!rm->sample[i].length)
+			continue;
+		if (!(refs->entry[i] = _acquire(rm->sample[i].sample_data, rm->sample[i].length))) {
+			_release_all(refs);
+			return 0;
+		}
+	}
+
+	for (i = 0; i < rm->samples; i++)
+		rm->sample[i].sample_data = refs->entry[i] ? refs->entry[i]->data : silence;
+	rm->pool = refs;
+
+	/* S3M patterns are still decoded from the file, protracker modules need nothing more from it */
+	if (rm->format == RM_FORMAT_S3M)
+		free(rm->data);
+	else
+		rickmod_loader_free(rm);
+	rm->data = NULL;
+	return 1;
+}
+
+#endif
+
+
+void rm_pool_stats(struct RickmodPoolStats *stats) {
+	pthread_mutex_lock(&pool.lock);
+	*stats = pool.stats;
+	pthread_mutex_unlock(&pool.lock);
+}
+
+#endif
@@ -0,0 +1,53 @@
+#include "rickmod.h"
+#include "s3m.h"
+#include "compiled.h"
+
+#include <stdint.h>
+#include <string.h>
+
+
+/* Only the first 1084 bytes are read, the pattern count comes from the order list like in rm_init() */
+static int _probe_mod(const uint8_t *mod, int mod_len, struct RickmodInfo *info) {
+	int i, mask;
+	const uint8_t *s;
+
+	if (mod_len < 1084)
+		return 0;
+	if (mod[1080] == 'M' && mod[1082] == 'K')
+		mask = (mod[1081] == '!' && mod[1083] == '!') ? 127 : 63;
+	else if (!memcmp(mod + 1080, "4CHN", 4))
+		mask = 127;
+	else
+		return 0;
+
+	info->format = RM_FORMAT_MOD;
+	memcpy(info->name, mod, 20);
+	memcpy(info->tag, mod + 1080, 4);
+	info->channels = 4;
+	info->samples = 31;
+	info->initial_speed = 6;
+	info->initial_bpm = 125;
+	info->orders = mod[950] > 128 ? 128 : mod[950];
+	for (i = 0; i < 128; i++)
+		if ((mod[952 + i] & mask) >= info->patterns)
+			info->patterns = (mod[952 + i] & mask) + 1;
+
+	info->data_len = 1084 + 1024 * info->patterns;
+	for (i = 0; i < 31; i++) {
+		s = mod + 20 + i * 30;
+		memcpy(info->sample_name[i], s, 22);
+		info->data_len += (s[22] << 9) | (s[23] << 1);
+	}
+
+	return 1;
+}
+
+
+int rm_probe(const uint8_t *mod, int mod_len, struct RickmodInfo *info) {
+	memset(info, 0, sizeof(*info));
+	if (rickmod_compiled_check(mod, mod_len))
+		return rickmod_compiled_probe(mod, mod_len, info);
+	if (mod_len >= 48 && !memcmp(mod + 44, "SCRM", 4))
+		return rickmod_s3m_probe(mod, mod_len, info);
+	return _probe_mod(mod, mod_len, info);
+}
@@ -0,0 +1,348 @@
+#ifdef HOSTED
+
+#define	_POSIX_C_SOURCE 200809L
+
+#include "rickmod.h"
+#include "util.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define	RENDER_CHUNK 1024
+#define	CACHE_MAGIC 0x43524D52 // RMRC
+#define	CACHE_VERSION 1
+#define	PREVIEW_RATE 11025
+#define	OVERVIEW_RATE 8000
+
+
+/* Cache files are a header followed by the rendered PCM, they are host local so native endian is fine */
+struct RenderCacheHeader {
+	uint32_t		magic;
+	uint32_t		version;
+	uint64_t		hash;
+	uint32_t		mod_len;
+	uint32_t		sample_rate;
+	uint32_t		format;
+	uint32_t		repeat;
+	uint32_t		max_frames;
+	uint32_t		frames;
+	uint32_t		size;
+	uint32_t		reserved[5];
+};
+
+
+struct RenderCacheFile {
+	char			name[32];
+	off_t			size;
+	struct timespec		mtime;
+};
+
+
+static int _frame_size(int format) {
+	return format == RM_RENDER_U8 || format == RM_RENDER_S16_MONO ? 2 : 4;
+}
+
+
+static uint64_t _hash(uint8_t *mod, int mod_len, const struct RickmodRenderParams *params) {
+	uint64_t h = RICKMOD_FNV64_INIT;
+	uint32_t field[4];
+
+	field[0] = params->sample_rate;
+	field[1] = params->format;
+	field[2] = params->repeat;
+	field[3] = params->max_frames;
+	h = rickmod_fnv64(h, mod, mod_len);
+	return rickmod_fnv64(h, field, sizeof(field));
+}
+
+
+int rm_render(uint8_t *mod, int mod_len, const struct RickmodRenderParams *params, struct RickmodRender *out) {
+	struct RickmodState *rm;
+	uint32_t frame_size, chunk, alloc = 0;
+	uint8_t *data = NULL, *tmp;
+
+	memset(out, 0, sizeof(*out));
+	if (params->repeat && !params->max_frames)
+		return 0;
+	if (params->format < RM_RENDER_S16 || params->format > RM_RENDER_S16_MONO)
+		return 0;
+	if (!(rm = rm_init(params->sample_rate, mod, mod_len)))
+		return 0;
+	rm_repeat_set(rm, params->repeat);
+	frame_size = _frame_size(params->format);
+
+	while (!rm_end_reached(rm) && (!params->max_frames || out->frames < params->max_frames)) {
+		chunk = RENDER_CHUNK;
+		if (params->max_frames && out->frames + chunk > params->max_frames)
+			chunk = params->max_frames - out->frames;
+		if ((out->frames + chunk) * frame_size > alloc) {
+			alloc = alloc ? alloc * 2 : RENDER_CHUNK * frame_size * 64;
+			if (!(tmp = realloc(data, alloc))) {
+				free(data);
+				rm_free(rm);
+				return 0;
+			}
+			data = tmp;
+		}
+
+		if (params->format == RM_RENDER_S16)
+			rm_mix_s16(rm, (int16_t *) (data + out->frames * frame_size), chunk);
+		else if (params->format == RM_RENDER_S16_FAST)
+			rm_mix_s16_fast(rm, (int16_t *) (data + out->frames * frame_size), chunk);
+		else if (params->format == RM_RENDER_U8)
+			rm_mix_u8(rm, data + out->frames * frame_size, chunk);
+		else
+			rm_mix_s16_mono(rm, (int16_t *) (data + out->frames * frame_size), chunk);
+		out->frames += chunk;
+	}
+
+	rm_free(rm);
+	out->data = data;
+	out->size = out->frames * frame_size;
+	return 1;
+}
+
+
+int rm_preview(uint8_t *mod, int mod_len, int sample_rate, uint32_t max_frames, struct RickmodRender *out) {
+	struct RickmodRenderParams params;
+
+	params.sample_rate = sample_rate ? sample_rate : PREVIEW_RATE;
+	params.format = RM_RENDER_S16_MONO;
+	params.repeat = 0;
+	params.max_frames = max_frames;
+	return rm_render(mod, mod_len, &params, out);
+}
+
+
+static int _overview_add(struct RickmodOverview *out, uint32_t *alloc, int min, int max, uint64_t square, uint32_t frames) {
+	struct RickmodOverviewBucket *tmp;
+
+	if (out->buckets == *alloc) {
+		*alloc = *alloc ? *alloc * 2 : 1024;
+		if (!(tmp = realloc(out->bucket, *alloc * sizeof(*tmp))))
+			return 0;
+		out->bucket = tmp;
+	}
+	out->bucket[out->buckets].min = min;
+	out->bucket[out->buckets].max = max;
+	out->bucket[out->buckets].rms = sqrt((double) square / frames);
+	out->buckets++;
+	return 1;
+}
+
+
+/* Buckets are folded chunk by chunk, the song is never held as PCM */
+int rm_overview(uint8_t *mod, int mod_len, const struct RickmodOverviewParams *params, struct RickmodOverview *out) {
+	struct RickmodState *rm;
+	int16_t pcm[RENDER_CHUNK];
+	uint32_t alloc = 0, fill = 0, chunk, i;
+	int min = INT16_MAX, max = INT16_MIN;
+	uint64_t square = 0;
+
+	memset(out, 0, sizeof(*out));
+	if (!params->bucket_frames)
+		return 0;
+	if (!(rm = rm_init(params->sample_rate ? params->sample_rate : OVERVIEW_RATE, mod, mod_len)))
+		return 0;
+
+	while (!rm_end_reached(rm) && (!params->max_frames || out->frames < params->max_frames)) {
+		chunk = RENDER_CHUNK;
+		if (params->max_frames && out->frames + chunk > params->max_frames)
+			chunk = params->max_frames - out->frames;
+		rm_mix_s16_mono(rm, pcm, chunk);
+		for (i = 0; i < chunk; i++) {
+			if (pcm[i] < min)
+				min = pcm[i];
+			if (pcm[i] > max)
+				max = pcm[i];
+			square += pcm[i] * pcm[i];
+			if (++fill < params->bucket_frames)
+				continue;
+			if (!_overview_add(out, &alloc, min, max, square, fill))
+				goto fail;
+			min = INT16_MAX, max = INT16_MIN, square = 0, fill = 0;
+		}
+		out->frames += chunk;
+	}
+	if (fill && !_overview_add(out, &alloc, min, max, square, fill))
+		goto fail;
+
+	rm_free(rm);
+	return 1;
+
+fail:
+	rm_free(rm);
+	rm_overview_free(out);
+	return 0;
+}
+
+
+void rm_overview_free(struct RickmodOverview *overview) {
+	free(overview->bucket);
+	memset(overview, 0, sizeof(*overview));
+}
+
+
+static int _cache_open(const char *path, uint64_t hash, int mod_len, const struct RickmodRenderParams *params, struct RickmodRender *out) {
+	struct RenderCacheHeader *header;
+	struct stat st;
+	void *map;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return 0;
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(*header)) {
+		close(fd);
+		return 0;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	/* Bumping the modification time is what keeps recently used renders from being evicted */
+	futimens(fd, NULL);
+	close(fd);
+	if (map == MAP_FAILED)
+		return 0;
+
+	header = map;
+	if (header->magic != CACHE_MAGIC || header->version != CACHE_VERSION || header->hash != hash
+	    || header->mod_len != (uint32_t) mod_len || header->sample_rate != (uint32_t) params->sample_rate
+	    || header->format != (uint32_t) params->format || header->repeat != params->repeat
+	    || header->max_frames != params->max_frames || header->size != st.st_size - sizeof(*header)) {
+		munmap(map, st.st_size);
+		return 0;
+	}
+
+	out->data = (uint8_t *) map + sizeof(*header);
+	out->frames = header->frames;
+	out->size = header->size;
+	out->map = map;
+	out->map_len = st.st_size;
+	return 1;
+}
+
+
+/* Written under a temporary name and renamed into place, so readers only ever see complete files */
+static void _cache_store(const char *cache_dir, const char *path, uint64_t hash, int mod_len, const struct RickmodRenderParams *params, struct RickmodRender *render) {
+	struct RenderCacheHeader header;
+	char tmp[4096];
+	int fd;
+
+	memset(&header, 0, sizeof(header));
+	header.magic = CACHE_MAGIC;
+	header.version = CACHE_VERSION;
+	header.hash = hash;
+	header.mod_len = mod_len;
+	header.sample_rate = params->sample_rate;
+	header.format = params->format;
+	header.repeat = params->repeat;
+	header.max_frames = params->max_frames;
+	header.frames = render->frames;
+	header.size = render->size;
+
+	if (snprintf(tmp, sizeof(tmp), "%s/.rmc-XXXXXX", cache_dir) >= (int) sizeof(tmp))
+		return;
+	if ((fd = mkstemp(tmp)) < 0)
+		return;
+	if (write(fd, &header, sizeof(header)) != sizeof(header) || write(fd, render->data, render->size) != (ssize_t) render->size) {
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+	fchmod(fd, 0644);
+	close(fd);
+	if (rename(tmp, path) < 0)
+		unlink(tmp);
+}
+
+
+static int _cache_file_cmp(const void *a, const void *b) {
+	const struct RenderCacheFile *fa = a, *fb = b;
+
+	if (fa->mtime.tv_sec != fb->mtime.tv_sec)
+		return (fa->mtime.tv_sec > fb->mtime.tv_sec) - (fa->mtime.tv_sec < fb->mtime.tv_sec);
+	return (fa->mtime.tv_nsec > fb->mtime.tv_nsec) - (fa->mtime.tv_nsec < fb->mtime.tv_nsec);
+}
+
+
+/* Least recently used renders are removed until the cache fits in max_bytes */
+static void _cache_evict(const char *cache_dir, uint64_t max_bytes) {
+	struct RenderCacheFile *files = NULL, *tmp;
+	struct dirent *de;
+	struct stat st;
+	char path[4096];
+	uint64_t total = 0;
+	int i, count = 0, alloc = 0;
+	DIR *dir;
+
+	if (!(dir = opendir(cache_dir)))
+		return;
+	while ((de = readdir(dir))) {
+		if (strlen(de->d_name) != 20 || strcmp(de->d_name + 16, ".rmc"))
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", cache_dir, de->d_name);
+		if (stat(path, &st) < 0)
+			continue;
+		if (count == alloc) {
+			alloc = alloc ? alloc * 2 : 64;
+			if (!(tmp = realloc(files, alloc * sizeof(*files))))
+				break;
+			files = tmp;
+		}
+		strcpy(files[count].name, de->d_name);
+		files[count].size = st.st_size;
+		files[count].mtime = st.st_mtim;
+		total += st.st_size;
+		count++;
+	}
+	closedir(dir);
+
+	if (total > max_bytes) {
+		qsort(files, count, sizeof(*files), _cache_file_cmp);
+		for (i = 0; i < count && total > max_bytes; i++) {
+			snprintf(path, sizeof(path), "%s/%s", cache_dir, files[i].name);
+			if (!unlink(path))
+				total -= files[i].size;
+		}
+	}
+
+	free(files);
+}
+
+
+int rm_render_cached(const char *cache_dir, uint64_t max_cache_bytes, uint8_t *mod, int mod_len, const struct RickmodRenderParams *params, struct RickmodRender *out) {
+	char path[4096];
+	uint64_t hash;
+
+	memset(out, 0, sizeof(*out));
+	hash = _hash(mod, mod_len, params);
+	if (snprintf(path, sizeof(path), "%s/%.16llx.rmc", cache_dir, (unsigned long long) hash) >= (int) sizeof(path))
+		return rm_render(mod, mod_len, params, out);
+	if (_cache_open(path, hash, mod_len, params, out))
+		return 1;
+
+	if (!rm_render(mod, mod_len, params, out))
+		return 0;
+	if (out->size + sizeof(struct RenderCacheHeader) <= max_cache_bytes) {
+		_cache_store(cache_dir, path, hash, mod_len, params, out);
+		_cache_evict(cache_dir, max_cache_bytes);
+	}
+	return 1;
+}
+
+
+void rm_render_free(struct RickmodRender *render) {
+	if (render->map)
+		munmap(render->map, render->map_len);
+	else
+		free(render->data);
+	memset(render, 0, sizeof(*render));
+}
+
+#endif
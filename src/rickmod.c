@@ -1,9 +1,23 @@
 #include "mixastley.h"
 #include "rickmod.h"
 #include "lut.h"
+#include "s3m.h"
+#include "memo.h"
+#include "command.h"
+#include "events.h"
+#include "taps.h"
+#include "spectrum.h"
+#include "trace.h"
+#include "governor.h"
+#include "loader.h"
+#include "compiled.h"
+#include "pool.h"
+#include "sfx.h"
+#include "util.h"
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 
 #ifdef TRACKER
@@ -19,6 +33,22 @@
 int rand(void);
 #endif
 
+/* Only the mixing thread writes, relaxed atomics keep other threads from reading torn counters */
+#if !defined(STATS)
+#define	STAT_ADD(rm, field, n)
+#elif defined(HOSTED)
+#define	STAT_ADD(rm, field, n) __atomic_store_n(&(rm)->stats.field, (rm)->stats.field + (n), __ATOMIC_RELAXED)
+#else
+#define	STAT_ADD(rm, field, n) ((rm)->stats.field += (n))
+#endif
+
+/* The editor can fill any pattern, a player only has the ones the module uses */
+#ifdef TRACKER
+#define	PATTERN_CAPACITY(rm) 128
+#else
+#define	PATTERN_CAPACITY(rm) ((rm)->patterns)
+#endif
+
 static uint16_t valid_notes[36] = {
 	856, 808, 762, 720, 678, 640, 604, 570, 538, 508, 480, 453,
 	428, 404, 381, 360, 339, 320, 302, 285, 269, 254, 240, 226,
@@ -163,7 +193,7 @@ static void _calculate_volume_slide(struct RickmodChannelEffect *rce, uint8_t fa
 }
 
 
-static void _do_row(struct RickmodState *rm, int channel) {
+static void _row_channel(struct RickmodState *rm, int channel) {
 	struct RickmodChannelEffect rce = rm->channel[channel].rce;
 	int8_t reset = 0xFF;
 	uint32_t pos = 2;
@@ -231,6 +261,8 @@ static void _do_row(struct RickmodState *rm, int channel) {
 		if (rce.effect & 0xFF)
 			rce.volume_slide = rce.effect & 0xFF;
 	} else if ((rce.effect & 0xF00) == 0xB00) {
+		if (rm->memo)
+			rickmod_memo_jump(rm);
 		rm->cur.next_pattern = rce.effect & 0xFF;
 		if (rm->cur.next_pattern >= rm->song_length) {
 			rm->cur.next_pattern = 0;
@@ -253,15 +285,22 @@ static void _do_row(struct RickmodState *rm, int channel) {
 			rm->cur.next_pattern = 0;
 		}
 	} else if ((rce.effect & 0xFF0) == 0xE10) {
-		rce.note -= rce.effect & 0xF;
-		if (rce.note < 113)
-			rce.note = 113;
-		_set_samplerate_finetune(&rm->mix[channel], rickmod_lut_samplerate[rce.note - 113], rce.finetune);
+		/* Nothing to slide before the first note */
+		if (rce.note) {
+			if (rce.note > (rce.effect & 0xF) + 113)
+				rce.note -= rce.effect & 0xF;
+			else
+				rce.note = 113;
+			_set_samplerate_finetune(&rm->mix[channel], rickmod_lut_samplerate[rce.note - 113], rce.finetune);
+		}
 	} else if ((rce.effect & 0xFF0) == 0xE20) {
-		rce.note += rce.effect & 0xF;
-		if (rce.note > 856)
-			rce.note = 856;
-		_set_samplerate_finetune(&rm->mix[channel], rickmod_lut_samplerate[rce.note - 113], rce.finetune);
+		if (rce.note) {
+			if (rce.note + (rce.effect & 0xF) > 856)
+				rce.note = 856;
+			else
+				rce.note += rce.effect & 0xF;
+			_set_samplerate_finetune(&rm->mix[channel], rickmod_lut_samplerate[rce.note - 113], rce.finetune);
+		}
 	} else if ((rce.effect & 0xFF0) == 0xE60) {
 		if (rce.effect & 0xF) {
 			if (!rce.loop_count)
@@ -303,6 +342,7 @@ static void _do_row(struct RickmodState *rm, int channel) {
 		}
 	} else {
 		fprintf(stderr, "Unhandled effect 0x%.3X\n", rce.effect);
+		STAT_ADD(rm, unhandled_effects, 1);
 	}
 
 	ma_set_volume(&rm->mix[channel], rce.volume);
@@ -324,6 +364,16 @@ no_volume:
 	}
 
 	rm->channel[channel].rce = rce;
+	if (rce.reset_note && rm->events)
+		rickmod_event_emit(rm, RM_EVENT_NOTE, channel);
+}
+
+
+static void _do_row(struct RickmodState *rm, int channel) {
+	uint64_t begin = TRACE_BEGIN(rm);
+
+	_row_channel(rm, channel);
+	TRACE_END(rm, RICKMOD_TRACE_ROW, channel, begin);
 }
 
 
@@ -332,8 +382,8 @@ static void _handle_tick_effect(struct RickmodState *rm, int channel) {
 	uint16_t note;
 	rce = rm->channel[channel].rce;
 
-	if (!rce.effect) {
-		return;
+	if (!rce.effect || !rce.note) {
+		return; // Nothing has been played on the channel, so there is nothing to change
 	} else if ((rce.effect & 0xF00) == 0x000) {
 		int mode = rm->cur.tick % 3;
 		int arpeggio = rce.effect & 0xFF;
@@ -396,15 +446,17 @@ special_note:
 
 
 static void _handle_tick_effects(struct RickmodState *rm) {
+	uint64_t begin = TRACE_BEGIN(rm);
 	int i;
-	for (i = 0; i < 4; i++)
+	for (i = 0; i < rm->channels; i++)
 		_handle_tick_effect(rm, i);
+	TRACE_END(rm, RICKMOD_TRACE_TICK_EFFECTS, 0, begin);
 }
 
 
 static void _handle_delayed_row(struct RickmodState *rm) {
 	int i;
-	for (i = 0; i < 4; i++)
+	for (i = 0; i < rm->channels; i++)
 		_do_row(rm, i);
 }
 
@@ -412,7 +464,7 @@ static void _handle_delayed_row(struct RickmodState *rm) {
 static void _handle_retrig(struct RickmodState *rm) {
 	int i;
 
-	for (i = 0; i < 4; i++) {
+	for (i = 0; i < rm->channels; i++) {
 		if (rm->channel[i].rce.retrig && !(rm->cur.tick % rm->channel[i].rce.retrig))
 			_do_row(rm, i);
 		else if (rm->channel[i].rce.delay_ticks == rm->cur.tick)
@@ -421,16 +473,24 @@ static void _handle_retrig(struct RickmodState *rm) {
 }
 
 
+static struct RickmodChannel *_get_cell(struct RickmodState *rm, int channel) {
+	if (rm->format == RM_FORMAT_S3M)
+		return &rickmod_s3m_row(rm, rm->pattern_lookup[rm->cur.pattern], rm->cur.row)[channel];
+	return &rm->pattern[rm->pattern_lookup[rm->cur.pattern]].row[rm->cur.row].channel[channel];
+}
+
+
 static void _set_row_channel(struct RickmodState *rm, int channel) {
 	//int i;
 	uint8_t sample;
 	uint32_t note, finetune;
 	int effect;
 	struct RickmodChannelEffect rce = rm->channel[channel].rce;
+	struct RickmodChannel *cell = _get_cell(rm, channel);
 	/* TODO: Look at effect value */
 
-	note = rm->pattern[rm->pattern_lookup[rm->cur.pattern]].row[rm->cur.row].channel[channel].note;
-	effect = rm->pattern[rm->pattern_lookup[rm->cur.pattern]].row[rm->cur.row].channel[channel].effect;
+	note = cell->note;
+	effect = cell->effect;
 	rce.effect = effect;
 	
 	if (!note || note == 0xFFF) {
@@ -452,7 +512,7 @@ static void _set_row_channel(struct RickmodState *rm, int channel) {
 		}
 	}
 
-	sample = rm->pattern[rm->pattern_lookup[rm->cur.pattern]].row[rm->cur.row].channel[channel].sample;
+	sample = cell->sample;
 	if (!sample) {
 		sample = rm->channel[channel].sample;
 		/*if (rce.reset_note) {
@@ -476,6 +536,9 @@ static void _set_row_channel(struct RickmodState *rm, int channel) {
 		rce.finetune = finetune;
 	}
 
+	if (cell->volume)
+		rce.volume = cell->volume - 1;
+
 	rm->channel[channel].rce = rce;
 	rce.note = note;
 
@@ -483,18 +546,115 @@ static void _set_row_channel(struct RickmodState *rm, int channel) {
 }
 
 
-static void _handle_tick(struct RickmodState *rm) {
+static void _apply_command(struct RickmodState *rm, struct RickmodCommand *cmd) {
+	struct RickmodChannelState *rcs;
+	struct RickmodSample *s;
+	int i;
+
+	switch (cmd->type) {
+		case RM_COMMAND_CELL:
+			/* S3M patterns are played straight from the packed file */
+			if (rm->format != RM_FORMAT_MOD || cmd->pattern >= PATTERN_CAPACITY(rm) || cmd->row >= 64 || cmd->channel >= rm->channels)
+				return;
+			if (!rickmod_compiled_own_patterns(rm))
+				return;
+			rm->pattern[cmd->pattern].row[cmd->row].channel[cmd->channel] = cmd->cell;
+			rickmod_memo_flush(rm);
+			break;
+		#ifdef TRACKER
+		case RM_COMMAND_MUTE:
+			if (cmd->channel < rm->channels)
+				rm->mix[cmd->channel].mute = cmd->value;
+			break;
+		case RM_COMMAND_SOLO:
+			for (i = 0; i < rm->channels; i++)
+				rm->mix[i].mute = cmd->value && i != cmd->channel;
+			break;
+		case RM_COMMAND_REPEAT_PATTERN:
+			rm->repeat_pattern = cmd->value;
+			break;
+		#endif
+		case RM_COMMAND_BPM:
+			rm->cur.bpm = cmd->value;
+			_set_bpm(rm);
+			break;
+		case RM_COMMAND_JUMP:
+			if (cmd->pattern >= rm->song_length || cmd->row >= 64)
+				return;
+			/* Makes the next _handle_tick() start the row right away, without it counting as a loop */
+			rm->cur.pattern = rm->cur.next_pattern = cmd->pattern;
+			rm->cur.next_row = cmd->row;
+			rm->cur.tick = rm->cur.speed + rm->cur.set_on_tick;
+			rm->cur.samples_this_tick = 0;
+			rm->end = 0;
+			break;
+		case RM_COMMAND_SAMPLE:
+			if (!cmd->value || cmd->value > rm->samples)
+				return;
+			s = &rm->sample[cmd->value - 1];
+			s->length = cmd->sample.length;
+			s->finetune = cmd->sample.finetune;
+			s->volume = cmd->sample.volume;
+			s->repeat = cmd->sample.repeat;
+			s->repeat_length = cmd->sample.repeat_length;
+			s->sample_data = cmd->sample.sample_data;
+			/* Voices that are already past the end of the new data are cut */
+			for (i = 0; i < rm->channels; i++) {
+				rcs = &rm->channel[i];
+				if (!rcs->play_sample || rcs->sample != cmd->value)
+					continue;
+				if (rcs->sample_pos >= (rcs->trigger ? s->length : s->repeat + s->repeat_length)) {
+					rcs->play_sample = 0;
+					ma_set_samplerate(&rm->mix[i], 0);
+				}
+			}
+			rickmod_memo_flush(rm);
+			break;
+		default:
+			return;
+	}
+
+	rickmod_memo_abort(rm);
+}
+
+
+/* Drained at tick boundaries only, so edits are tick exact and never race with the mixer */
+static void _apply_commands(struct RickmodState *rm) {
+	struct RickmodCommand *cmd;
+
+	while ((cmd = rickmod_command_peek(rm))) {
+		_apply_command(rm, cmd);
+		rickmod_command_done(rm);
+	}
+}
+
+
+static void _end(struct RickmodState *rm) {
+	rm->end = 1;
+	if (rm->events)
+		rickmod_event_emit(rm, RM_EVENT_END, 0);
+}
+
+
+static void _tick(struct RickmodState *rm) {
+	int i, loop = 0;
+
+	_apply_commands(rm);
+	STAT_ADD(rm, ticks, 1);
 	if (rm->cur.tick >= rm->cur.speed + rm->cur.set_on_tick) {
 		if (rm->cur.next_pattern < rm->cur.pattern) {
 			if (!rm->repeat)
-				return (void) (rm->end = 1);
+				return _end(rm);
 			#ifdef TRACKER
 			else if (rm->repeat_callback)
 				rm->repeat_callback(rm->repeat_user_data);
 			#endif
+			loop = 1;
 		}
 
 		rm->cur.row = rm->cur.next_row, rm->cur.pattern = rm->cur.next_pattern;
+		if (loop && rm->events)
+			rickmod_event_emit(rm, RM_EVENT_LOOP, 0);
 		rm->cur.tick = 0;
 		rm->cur.set_on_tick = 0;
 		rm->cur.next_row++;
@@ -512,14 +672,15 @@ static void _handle_tick(struct RickmodState *rm) {
 			if (rm->repeat) {
 				rm->cur.next_pattern = 0;
 			} else {
-				rm->end = 1;
+				_end(rm);
 				return;
 			}
 		}
-		_set_row_channel(rm, 0);
-		_set_row_channel(rm, 1);
-		_set_row_channel(rm, 2);
-		_set_row_channel(rm, 3);
+		STAT_ADD(rm, rows, 1);
+		for (i = 0; i < rm->channels; i++)
+			_set_row_channel(rm, i);
+		if (rm->events)
+			rickmod_event_row(rm);
 		_handle_delayed_row(rm);
 		if (rm->row_callback)
 			rm->row_callback(rm->user_data);
@@ -530,16 +691,52 @@ static void _handle_tick(struct RickmodState *rm) {
 }
 
 
+static void _handle_tick(struct RickmodState *rm) {
+	uint64_t begin = TRACE_BEGIN(rm);
+
+	_tick(rm);
+	TRACE_END(rm, RICKMOD_TRACE_TICK, 0, begin);
+}
+
+
+/* The voice is rendered on its own first, so the taps see it after volume but before panning */
+static void _add_tapped(struct RickmodState *rm, int channel, int32_t *buffer, int samples, void (*add)(struct MAState *, int32_t *, int), int fast) {
+	int32_t *voice = rickmod_taps_scratch(rm);
+	int i;
+
+	memset(voice, 0, sizeof(*voice) * samples);
+	add(&rm->mix[channel], voice, samples);
+	for (i = 0; i < samples; i++)
+		buffer[i] += voice[i];
+	rickmod_taps_write(rm, channel, voice, samples, fast);
+}
+
+
 /* Stereo, non-interleaved */
 static void _mix(struct RickmodState *rm, int32_t *buffer, int samples) {
-	int i, len;
+	uint64_t begin;
+	int i, j, len;
+	#ifdef STATS
+	int active;
+	#endif
 
 	memset(buffer, 0, 4*2*samples);
-	if (rm->end)
-		return;
+	if (rm->end) {
+		/* A jump is the only way back from the end */
+		_apply_commands(rm);
+		if (rm->end)
+			return;
+		_handle_tick(rm);
+	}
 	
 	/* TODO: This is where all timing will be handled regarding row/pattern/effect playback */
 	for (i = 0; i < samples;) {
+		if (rm->memo && rickmod_memo_replaying(rm)) {
+			len = rickmod_memo_replay(rm, buffer + i, buffer + samples + i, samples - i);
+			rm->frame += len;
+			i += len;
+			continue;
+		}
 		len = rm->cur.samples_per_tick - rm->cur.samples_this_tick;
 		#ifdef TRACKER
 		if (len <= 0)
@@ -547,11 +744,23 @@ static void _mix(struct RickmodState *rm, int32_t *buffer, int samples) {
 		#endif
 		if (i + len > samples)
 			len = samples - i;
-		ma_add(&rm->mix[0], buffer + i, len);
-		ma_add(&rm->mix[3], buffer + i, len);
-		ma_add(&rm->mix[1], buffer + samples + i, len);
-		ma_add(&rm->mix[2], buffer + samples + i, len);
+		#ifdef STATS
+		for (j = 0, active = 0; j < rm->channels; j++)
+			active += rm->mix[j].fraction_per_sample != 0;
+		STAT_ADD(rm, voice_samples, active * len);
+		#endif
+		for (j = 0; j < rm->channels; j++) {
+			begin = TRACE_BEGIN(rm);
+			if (rm->taps)
+				_add_tapped(rm, j, buffer + (rm->panning[j] ? samples : 0) + i, len, GOVERNOR_KERNEL(rm, j), 0);
+			else
+				GOVERNOR_KERNEL(rm, j)(&rm->mix[j], buffer + (rm->panning[j] ? samples : 0) + i, len);
+			TRACE_END(rm, RICKMOD_TRACE_MA_ADD, j, begin);
+		}
+		if (rm->memo)
+			rickmod_memo_record(rm, buffer + i, buffer + samples + i, len);
 		rm->cur.samples_this_tick += len;
+		rm->frame += len;
 		i += len;
 		if (rm->cur.samples_this_tick < rm->cur.samples_per_tick)
 			return; // Our work here is done
@@ -562,6 +771,8 @@ static void _mix(struct RickmodState *rm, int32_t *buffer, int samples) {
 		rm->cur.tick++;
 		rm->cur.samples_this_tick = 0;
 		_handle_tick(rm);
+		if (rm->memo)
+			rickmod_memo_tick(rm, 0);
 		if (rm->end)
 			break;
 	}
@@ -570,14 +781,29 @@ static void _mix(struct RickmodState *rm, int32_t *buffer, int samples) {
 
 /* Stereo, non-interleaved */
 static void _mix_fast(struct RickmodState *rm, int32_t *buffer, int samples) {
-	int i, len;
+	uint64_t begin;
+	int i, j, len;
+	#ifdef STATS
+	int active;
+	#endif
 
 	memset(buffer, 0, 4*2*samples);
-	if (rm->end)
-		return;
+	if (rm->end) {
+		/* A jump is the only way back from the end */
+		_apply_commands(rm);
+		if (rm->end)
+			return;
+		_handle_tick(rm);
+	}
 	
 	/* TODO: This is where all timing will be handled regarding row/pattern/effect playback */
 	for (i = 0; i < samples;) {
+		if (rm->memo && rickmod_memo_replaying(rm)) {
+			len = rickmod_memo_replay(rm, buffer + i, buffer + samples + i, samples - i);
+			rm->frame += len;
+			i += len;
+			continue;
+		}
 		len = rm->cur.samples_per_tick - rm->cur.samples_this_tick;
 		#ifdef TRACKER
 		if (len <= 0)
@@ -585,11 +811,23 @@ static void _mix_fast(struct RickmodState *rm, int32_t *buffer, int samples) {
 		#endif
 		if (i + len > samples)
 			len = samples - i;
-		ma_add_fast(&rm->mix[0], buffer + i, len);
-		ma_add_fast(&rm->mix[3], buffer + i, len);
-		ma_add_fast(&rm->mix[1], buffer + samples + i, len);
-		ma_add_fast(&rm->mix[2], buffer + samples + i, len);
+		#ifdef STATS
+		for (j = 0, active = 0; j < rm->channels; j++)
+			active += rm->mix[j].fraction_per_sample != 0;
+		STAT_ADD(rm, voice_samples, active * len);
+		#endif
+		for (j = 0; j < rm->channels; j++) {
+			begin = TRACE_BEGIN(rm);
+			if (rm->taps)
+				_add_tapped(rm, j, buffer + (rm->panning[j] ? samples : 0) + i, len, ma_add_fast, 1);
+			else
+				ma_add_fast(&rm->mix[j], buffer + (rm->panning[j] ? samples : 0) + i, len);
+			TRACE_END(rm, RICKMOD_TRACE_MA_ADD, j, begin);
+		}
+		if (rm->memo)
+			rickmod_memo_record(rm, buffer + i, buffer + samples + i, len);
 		rm->cur.samples_this_tick += len;
+		rm->frame += len;
 		i += len;
 		if (rm->cur.samples_this_tick < rm->cur.samples_per_tick)
 			return; // Our work here is done
@@ -600,19 +838,21 @@ static void _mix_fast(struct RickmodState *rm, int32_t *buffer, int samples) {
 		rm->cur.tick++;
 		rm->cur.samples_this_tick = 0;
 		_handle_tick(rm);
+		if (rm->memo)
+			rickmod_memo_tick(rm, 1);
 		if (rm->end)
 			break;
 	}
 }
 
 
-static void _pull_samples(void *ptr, int8_t *buff) {
-	struct RickmodChannelState *rcs = ptr;
+static void _fill_samples(struct RickmodChannelState *rcs, int8_t *buff) {
 	struct RickmodSample *s;
 	int i = 0;
 	int8_t sample, *data;
 	uint32_t pos, repeat, wrap, len;
 
+	STAT_ADD(rcs->rm, refills, 1);
 	sample = rcs->sample;
 	if (rcs->play_sample == 0)
 		return memset(buff, 0, (1 << MA_SAMPLE_BUFFER_LEN)), (void) 0;
@@ -624,6 +864,9 @@ static void _pull_samples(void *ptr, int8_t *buff) {
 loop:
 	wrap = rcs->trigger?s->length:s->repeat_length+repeat;
 	for (; i < (1 << MA_SAMPLE_BUFFER_LEN);) {
+		/* Sample offsets can point past the end, that is the same as reaching it */
+		if (pos > wrap)
+			pos = wrap;
 		len = wrap - pos;
 		if (len > (1 << MA_SAMPLE_BUFFER_LEN) - i)
 			len = (1 << MA_SAMPLE_BUFFER_LEN) - i;
@@ -643,6 +886,7 @@ loop:
 
 		pos = repeat;
 		rcs->trigger = 0;
+		STAT_ADD(rcs->rm, loop_wraps, 1);
 		goto loop;
 	}
 
@@ -650,16 +894,21 @@ loop:
 }
 
 
-static void _parse_sample_info(struct RickmodState *rm, uint8_t *mod, uint16_t wavepos, int samples) {
+static void _pull_samples(void *ptr, int8_t *buff) {
+	struct RickmodChannelState *rcs = ptr;
+	uint64_t begin = TRACE_BEGIN(rcs->rm);
+
+	_fill_samples(rcs, buff);
+	TRACE_END(rcs->rm, RICKMOD_TRACE_PULL_SAMPLES, rcs->channel, begin);
+}
+
+
+/* Samples that run past the end of the file are cut short, and loops are kept inside their sample */
+static int _parse_sample_info(struct RickmodState *rm, uint8_t *mod, uint32_t mod_len, uint32_t wavepos, int samples) {
 	int i, j;
 	uint8_t *sample_data;
 	uint32_t next_wave = wavepos;
 
-	#ifdef TRACKER
-	rm->data = malloc(1024*128*31);
-	memset(rm->data, 0, 1024*128*31);
-	#endif
-
 	for (i = 0; i < samples; i++) {
 		sample_data = mod + 20 + i*30;
 		memcpy(rm->sample[i].name, sample_data, 22);
@@ -674,11 +923,22 @@ static void _parse_sample_info(struct RickmodState *rm, uint8_t *mod, uint16_t w
 		rm->sample[i].volume = sample_data[25];
 		rm->sample[i].repeat = (sample_data[26] << 9) | (sample_data[27] << 1);
 		rm->sample[i].repeat_length = (sample_data[28] << 9) | (sample_data[29] << 1);
+		rm->sample[i].c2spd = 0; // Finetune does that job here
+		if (next_wave >= mod_len)
+			rm->sample[i].length = 0;
+		else if (rm->sample[i].length > mod_len - next_wave)
+			rm->sample[i].length = mod_len - next_wave;
+		if (rm->sample[i].repeat >= rm->sample[i].length)
+			rm->sample[i].repeat = rm->sample[i].repeat_length = 0;
+		else if (rm->sample[i].repeat + rm->sample[i].repeat_length > rm->sample[i].length)
+			rm->sample[i].repeat_length = rm->sample[i].length - rm->sample[i].repeat;
 		rm->sample[i].sample_data = (int8_t *) mod + next_wave;
 		
 		#ifdef TRACKER
-		memcpy(rm->data + 1024*128*i, rm->sample[i].sample_data, rm->sample[i].length);
-		rm->sample[i].sample_data = (int8_t *) rm->data + 1024*128*i;
+		if (!(rm->sample_buffer[i] = malloc(rm->sample[i].length ? rm->sample[i].length : 1)))
+			return 0;
+		memcpy(rm->sample_buffer[i], rm->sample[i].sample_data, rm->sample[i].length);
+		rm->sample[i].sample_data = rm->sample_buffer[i];
 		#endif
 
 		#ifndef TRACKER
@@ -686,6 +946,8 @@ static void _parse_sample_info(struct RickmodState *rm, uint8_t *mod, uint16_t w
 		#endif
 		next_wave += rm->sample[i].length;
 	}
+
+	return 1;
 }
 
 
@@ -695,31 +957,83 @@ static void _find_number_of_patterns(struct RickmodState *rm, int max_patterns)
 
 	max = 0;
 
-	for (i = 0; i < 128; i++)
-		if ((rm->pattern_lookup[i] & mask) > max)
-			max = (rm->pattern_lookup[i] & mask), rm->pattern_lookup[i] &= mask;
+	for (i = 0; i < 128; i++) {
+		rm->pattern_lookup[i] &= mask;
+		if (rm->pattern_lookup[i] > max)
+			max = rm->pattern_lookup[i];
+	}
 	max++;
 	rm->patterns = max;
 }
 
 
-static void _parse_pattern_data(struct RickmodState *rm, uint8_t *data) {
+/* Patterns missing from a truncated file are left empty, periods stay as they are for rm_save() and playback clamps them */
+static void _parse_pattern_data(struct RickmodState *rm, uint8_t *data, int available) {
+	struct RickmodChannel *cell;
 	int i, j, k;
 
-	for (i = 0; i < rm->patterns; i++)
+	for (i = 0; i < rm->patterns && i < available; i++)
 		for (j = 0; j < 64; j++)
 			for (k = 0; k < 4; k++, data += 4) {
-				rm->pattern[i].row[j].channel[k].sample = (data[0] & 0xF0) | (data[2] >> 4);
-				rm->pattern[i].row[j].channel[k].note = ((data[0] & 0xF) << 8) | data[1];
-				rm->pattern[i].row[j].channel[k].effect = ((data[2] & 0xF) << 8) | data[3];
+				cell = &rm->pattern[i].row[j].channel[k];
+				cell->sample = (data[0] & 0xF0) | (data[2] >> 4);
+				cell->note = ((data[0] & 0xF) << 8) | data[1];
+				cell->effect = ((data[2] & 0xF) << 8) | data[3];
+				cell->volume = 0;
+				if (cell->sample > rm->samples)
+					cell->sample = 0;
 			}
 }
 
 
+/* The order list is copied, so nothing is ever written to the module and it can be a read only mapping */
+static int _load_mod(struct RickmodState *rm, uint8_t *mod, uint32_t mod_len, int max_patterns) {
+	memcpy(rm->name, mod, 20);
+	rm->name[20] = 0;
+	rm->song_length = mod[950] > 128 ? 128 : mod[950];
+	memcpy(rm->order, mod + 952, 128);
+	rm->pattern_lookup = rm->order;
+	_find_number_of_patterns(rm, max_patterns);
+	rm->samples = 31;
+	if (!_parse_sample_info(rm, mod, mod_len, 1084 + 1024*rm->patterns, 31))
+		return 0;
+	if (!(rm->pattern = calloc(PATTERN_CAPACITY(rm), sizeof(*rm->pattern))))
+		return 0;
+	_parse_pattern_data(rm, mod + 1084, (mod_len - 1084) / 1024);
+	return 1;
+}
+
+
+static void _set_mod_layout(struct RickmodState *rm) {
+	int i;
+
+	rm->format = RM_FORMAT_MOD;
+	rm->channels = 4;
+	for (i = 0; i < rm->channels; i++)
+		rm->panning[i] = ((i + 1) >> 1) & 1; // LRRL
+	rm->initial_speed = 6;
+	rm->initial_bpm = 125;
+}
+
+
+/* The output stages have headroom for two full volume channels per side */
+static void _set_mix_shift(struct RickmodState *rm) {
+	int i, left = 0, right = 0;
+
+	for (i = 0; i < rm->channels; i++)
+		rm->panning[i] ? right++ : left++;
+	if (right > left)
+		left = right;
+	for (rm->mix_shift = 0; (2 << rm->mix_shift) < left; rm->mix_shift++);
+}
+
+
 void rm_reset(struct RickmodState *rm) {
 	struct RickmodChannelState rcs = { 0 };
-	rm->cur.bpm = 125;
-	rm->cur.speed = 6;
+	int i;
+
+	rm->cur.bpm = rm->initial_bpm;
+	rm->cur.speed = rm->initial_speed;
 	rm->cur.samples_this_tick = 0;
 	rm->cur.tick = 0;
 	rm->cur.set_on_tick = 0;
@@ -727,7 +1041,8 @@ void rm_reset(struct RickmodState *rm) {
 	rm->cur.next_pattern = 0;
 	rm->cur.row = rm->cur.pattern = 0;
 	rm->end = 0;
-	rm->channel[0] = rm->channel[1] = rm->channel[2] = rm->channel[3] = rcs;
+	for (i = 0; i < rm->channels; i++)
+		rm->channel[i] = rcs;
 	_set_bpm(rm);
 	// TODO: Set pattern
 
@@ -738,11 +1053,11 @@ void rm_reset(struct RickmodState *rm) {
 void rm_clear(struct RickmodState *rm) {
 	int i;
 
-	rm->cur.speed = 6;
+	rm->cur.speed = rm->initial_speed;
 	rm->cur.tick = 0;
 	rm->cur.samples_this_tick = 0;
 
-	for (i = 0; i < 4; i++) {
+	for (i = 0; i < rm->channels; i++) {
 		#ifdef TRACKER
 		int mute;
 		#endif
@@ -767,6 +1082,7 @@ void rm_clear(struct RickmodState *rm) {
 	rm->repeat_pattern = 0;
 	#endif
 
+	rickmod_memo_abort(rm);
 }
 
 
@@ -779,51 +1095,72 @@ struct RickmodState *rm_init(int sample_rate, uint8_t *mod, int mod_len) {
 	rm->samplerate = sample_rate;
 	rm->repeat = rm->end = 0;
 	rm->row_callback = NULL;
+	rm->memo = NULL;
+	rm->events = NULL;
+	rm->taps = NULL;
+	rm->spectrum = NULL;
+	rm->trace = NULL;
+	rm->governor = NULL;
+	rm->pool = NULL;
+	rm->sfx = NULL;
+	rm->map = NULL;
+	rm->pattern = NULL;
+	rm->pattern_borrowed = 0;
+	memset(&rm->stats, 0, sizeof(rm->stats));
+	rm->frame = 0;
+	rickmod_command_init(rm);
 	#ifdef TRACKER
 	rm->repeat_callback = NULL;
+	memset(rm->sample_buffer, 0, sizeof(rm->sample_buffer));
 	#endif
+	_set_mod_layout(rm);
 
-	if (mod[1080] == 'M' && mod[1082] == 'K') {
+	if (rickmod_compiled_check(mod, mod_len)) {
+		fprintf(stderr, "Found compiled module\n");
+		if (!rickmod_compiled_load(rm, mod, mod_len)) {
+			free(rm);
+			return NULL;
+		}
+	} else if (mod_len >= 48 && !memcmp(mod + 44, "SCRM", 4)) {
+		fprintf(stderr, "Found S3M\n");
+		if (!rickmod_s3m_load(rm, mod, mod_len)) {
+			free(rm);
+			return NULL;
+		}
+	} else if (mod_len >= 1084 && mod[1080] == 'M' && mod[1082] == 'K') {
 		fprintf(stderr, "Found 31 sample mod\n");
 		max_patterns = (mod[1081] == '!' && mod[1083] == '!') ? 128 : 64;
 		if (max_patterns == 128)
 			fprintf(stderr, "This mod has 128 patterns\n");
-		rm->song_length = mod[950];
-		rm->pattern_lookup = mod + 952;
-		_find_number_of_patterns(rm, max_patterns);
-		_parse_sample_info(rm, mod, 1084 + 1024*rm->patterns, 31);
-		rm->samples = 31;
-		_parse_pattern_data(rm, mod + 1084);
-	} else if (!memcmp(mod + 1080, "4CHN", 4)) {
+		if (!_load_mod(rm, mod, mod_len, max_patterns)) {
+			rm_free(rm);
+			return NULL;
+		}
+	} else if (mod_len >= 1084 && !memcmp(mod + 1080, "4CHN", 4)) {
 		fprintf(stderr, "Mystery 4 channel format\n");
-		rm->song_length = mod[950];
-		rm->pattern_lookup = mod + 952;
-		_find_number_of_patterns(rm, 128);
-		_parse_sample_info(rm, mod, 1084 + 1024*rm->patterns, 31);
-		rm->samples = 31;
-		_parse_pattern_data(rm, mod + 1084);
+		if (!_load_mod(rm, mod, mod_len, 128)) {
+			rm_free(rm);
+			return NULL;
+		}
 	} else {
 		free(rm);
-		fprintf(stderr, "Unsupported module format %c%c%c%c\n", mod[1080], mod[1081], mod[1082], mod[1083]);
+		fprintf(stderr, "Unsupported module format\n");
 		return NULL;
 
 	}
 
-	
+	_set_mix_shift(rm);
 	rm_reset(rm);
 	rm_clear(rm);
 
-	memcpy(rm->name, mod, 20);
-	rm->name[20] = 0;
-
 	#if 0
 	else {
 		rm->song_length = mod[470];
 		rm->pattern_lookup = mod + 472;
 		_find_number_of_patterns(rm, 64);
-		_parse_sample_info(rm, mod, 600 + 1024 * rm->patterns, 15);
+		_parse_sample_info(rm, mod, mod_len, 600 + 1024 * rm->patterns, 15);
 		rm->samples = 15;
-		_parse_pattern_data(rm, mod + 600);
+		_parse_pattern_data(rm, mod + 600, (mod_len - 600) / 1024);
 	}
 	#endif
 	
@@ -845,39 +1182,173 @@ static void _print_pattern(struct RickmodState *rm, int pattern) {
 #endif
 
 
+#ifdef STATS
+static uint64_t _stats_start(void) {
+	#ifdef HOSTED
+	return rickmod_now_ns();
+	#else
+	return 0;
+	#endif
+}
+
+
+static void _stats_end(struct RickmodState *rm, int samples, uint32_t clipped, uint64_t start) {
+	#ifdef HOSTED
+	uint64_t ns = _stats_start() - start;
+
+	STAT_ADD(rm, mix_ns_total, ns);
+	if (ns > rm->stats.mix_ns_max)
+		STAT_ADD(rm, mix_ns_max, ns - rm->stats.mix_ns_max);
+	#else
+	(void) start;
+	#endif
+	STAT_ADD(rm, frames, samples);
+	STAT_ADD(rm, clipped, clipped);
+	STAT_ADD(rm, mix_calls, 1);
+}
+#else
+static inline uint64_t _stats_start(void) {
+	return 0;
+}
+
+
+static inline void _stats_end(struct RickmodState *rm, int samples, uint32_t clipped, uint64_t start) {
+	(void) rm;
+	(void) samples;
+	(void) clipped;
+	(void) start;
+}
+#endif
+
+
 void rm_mix_s16_fast(struct RickmodState *rm, int16_t *buff, int samples) {
-	int32_t sample[samples * 2];
+	int32_t sample[samples * 2], l, r;
+	uint64_t start = _stats_start();
+	#ifdef HOSTED
+	uint64_t frame = rm->frame;
+	#endif
+	uint32_t clipped = 0;
 	int i;
 
 	_mix_fast(rm, sample, samples);
+	if (rm->sfx)
+		rickmod_sfx_mix(rm, sample, samples, 1);
+	#ifdef HOSTED
+	if (rm->spectrum)
+		rickmod_spectrum_feed(rm, sample, samples, rm->mix_shift, frame);
+	#endif
 	for (i = 0; i < samples; i++) {
-		buff[i<<1] = ((sample[i]));
-		buff[(i<<1) + 1] = ((sample[i+samples]));
+		l = sample[i] >> rm->mix_shift;
+		r = sample[i+samples] >> rm->mix_shift;
+		clipped += (l != (int16_t) l) + (r != (int16_t) r);
+		buff[i<<1] = l;
+		buff[(i<<1) + 1] = r;
 	}
 
+	_stats_end(rm, samples, clipped, start);
 }
 
 
 void rm_mix_s16(struct RickmodState *rm, int16_t *buff, int samples) {
-	int32_t sample[samples * 2];
+	int32_t sample[samples * 2], l, r;
+	uint64_t start = _stats_start();
+	#ifdef HOSTED
+	uint64_t frame = rm->frame;
+	#endif
+	uint32_t clipped = 0;
 	int i;
 
+	#ifdef HOSTED
+	if (rm->governor)
+		rickmod_governor_begin(rm);
+	#endif
 	_mix(rm, sample, samples);
+	if (rm->sfx)
+		rickmod_sfx_mix(rm, sample, samples, 0);
+	#ifdef HOSTED
+	if (rm->governor)
+		rickmod_governor_end(rm, samples);
+	if (rm->spectrum)
+		rickmod_spectrum_feed(rm, sample, samples, 1 + rm->mix_shift, frame);
+	#endif
 	for (i = 0; i < samples; i++) {
-		buff[i<<1] = (((sample[i] * 70) + (sample[i + samples] * 30))/100) >> 1;
-		buff[(i<<1) + 1] = (((sample[i+samples] * 70) + (sample[i] * 30))/100) >> 1;
+		l = (((sample[i] * 70) + (sample[i + samples] * 30))/100) >> (1 + rm->mix_shift);
+		r = (((sample[i+samples] * 70) + (sample[i] * 30))/100) >> (1 + rm->mix_shift);
+		clipped += (l != (int16_t) l) + (r != (int16_t) r);
+		buff[i<<1] = l;
+		buff[(i<<1) + 1] = r;
 	}
+
+	_stats_end(rm, samples, clipped, start);
 }
 
 void rm_mix_u8(struct RickmodState *rm, uint8_t *buff, int samples) {
-	int32_t sample[samples * 2];
+	int32_t sample[samples * 2], l, r;
+	uint64_t start = _stats_start();
+	#ifdef HOSTED
+	uint64_t frame = rm->frame;
+	#endif
+	uint32_t clipped = 0;
 	int i;
 
 	_mix_fast(rm, sample, samples);
+	if (rm->sfx)
+		rickmod_sfx_mix(rm, sample, samples, 1);
+	#ifdef HOSTED
+	if (rm->spectrum)
+		rickmod_spectrum_feed(rm, sample, samples, rm->mix_shift, frame);
+	#endif
 	for (i = 0; i < samples; i++) {
-		buff[i<<1] = ((sample[i] >> 9) & 0xFF) + 128;
-		buff[(i<<1) + 1] = ((sample[i+samples] >> 9) & 0xFF) + 128;
+		l = sample[i] >> (9 + rm->mix_shift);
+		r = sample[i+samples] >> (9 + rm->mix_shift);
+		clipped += (l != (int8_t) l) + (r != (int8_t) r);
+		buff[i<<1] = (l & 0xFF) + 128;
+		buff[(i<<1) + 1] = (r & 0xFF) + 128;
 	}
+
+	_stats_end(rm, samples, clipped, start);
+}
+
+
+/* Nearest neighbour and down mixed, for previews at low rates where interpolation wouldn't be heard anyway */
+void rm_mix_s16_mono(struct RickmodState *rm, int16_t *buff, int samples) {
+	int32_t sample[samples * 2], m;
+	uint64_t start = _stats_start();
+	#ifdef HOSTED
+	uint64_t frame = rm->frame;
+	#endif
+	uint32_t clipped = 0;
+	int i;
+
+	_mix_fast(rm, sample, samples);
+	if (rm->sfx)
+		rickmod_sfx_mix(rm, sample, samples, 1);
+	#ifdef HOSTED
+	if (rm->spectrum)
+		rickmod_spectrum_feed(rm, sample, samples, rm->mix_shift, frame);
+	#endif
+	for (i = 0; i < samples; i++) {
+		m = (sample[i] + sample[i + samples]) >> (1 + rm->mix_shift);
+		clipped += m != (int16_t) m;
+		buff[i] = m;
+	}
+
+	_stats_end(rm, samples, clipped, start);
+}
+
+
+/* Same tick sequence as _mix, voices are set up but never pulled */
+uint64_t rm_measure(struct RickmodState *rm, uint64_t max_frames) {
+	uint64_t frames = 0;
+
+	while (!rm->end && frames < max_frames) {
+		frames += rm->cur.samples_per_tick - rm->cur.samples_this_tick;
+		rm->cur.tick++;
+		rm->cur.samples_this_tick = 0;
+		_handle_tick(rm);
+	}
+
+	return frames;
 }
 
 
@@ -893,13 +1364,52 @@ uint8_t rm_end_reached(struct RickmodState *rm) {
 
 void rm_free(struct RickmodState *rm) {
 	#ifdef TRACKER
-	free(rm->data);
+	int i;
+	#endif
+
+	rickmod_memo_free(rm);
+	rickmod_events_free(rm);
+	rickmod_taps_free(rm);
+	rickmod_sfx_free(rm);
+	#ifdef HOSTED
+	rickmod_spectrum_free(rm);
+	rickmod_trace_free(rm);
+	rickmod_governor_free(rm);
+	rickmod_loader_free(rm);
+	rickmod_pool_free(rm);
+	#endif
+	#ifdef TRACKER
+	for (i = 0; i < RM_MAX_SAMPLES; i++)
+		free(rm->sample_buffer[i]);
 	#endif
+	if (rm->format == RM_FORMAT_S3M)
+		free(rm->data);
+	if (!rm->pattern_borrowed)
+		free(rm->pattern);
 
 	free(rm);
 }
 
 
+void rm_get_stats(struct RickmodState *rm, struct RickmodStats *stats) {
+	#if defined(STATS) && defined(HOSTED)
+	stats->frames = __atomic_load_n(&rm->stats.frames, __ATOMIC_RELAXED);
+	stats->ticks = __atomic_load_n(&rm->stats.ticks, __ATOMIC_RELAXED);
+	stats->rows = __atomic_load_n(&rm->stats.rows, __ATOMIC_RELAXED);
+	stats->refills = __atomic_load_n(&rm->stats.refills, __ATOMIC_RELAXED);
+	stats->loop_wraps = __atomic_load_n(&rm->stats.loop_wraps, __ATOMIC_RELAXED);
+	stats->voice_samples = __atomic_load_n(&rm->stats.voice_samples, __ATOMIC_RELAXED);
+	stats->clipped = __atomic_load_n(&rm->stats.clipped, __ATOMIC_RELAXED);
+	stats->unhandled_effects = __atomic_load_n(&rm->stats.unhandled_effects, __ATOMIC_RELAXED);
+	stats->mix_calls = __atomic_load_n(&rm->stats.mix_calls, __ATOMIC_RELAXED);
+	stats->mix_ns_max = __atomic_load_n(&rm->stats.mix_ns_max, __ATOMIC_RELAXED);
+	stats->mix_ns_total = __atomic_load_n(&rm->stats.mix_ns_total, __ATOMIC_RELAXED);
+	#else
+	*stats = rm->stats;
+	#endif
+}
+
+
 void rm_row_callback_set(struct RickmodState *rm, void (*row_callback)(void *data), void *user_data) {
 	rm->user_data = user_data;
 	rm->row_callback = row_callback;
@@ -909,16 +1419,29 @@ void rm_row_callback_set(struct RickmodState *rm, void (*row_callback)(void *dat
 
 #ifdef TRACKER
 
+/* Stands in for the data of empty samples, so the player never copies from a null pointer */
+static int8_t empty_sample[2];
+
+
 struct RickmodState *rm_new(int sample_rate) {
 	struct RickmodState *rm;
 	int i;
 
-	rm = malloc(sizeof(*rm));
+	if (!(rm = malloc(sizeof(*rm))))
+		return NULL;
+	/* Pages of patterns that are never edited are never touched */
+	if (!(rm->pattern = calloc(128, sizeof(*rm->pattern)))) {
+		free(rm);
+		return NULL;
+	}
+	rm->pattern_borrowed = 0;
 	memset(rm->name, 0, 21);
-	rm->data = malloc(128*1024*31);
+	_set_mod_layout(rm);
+	_set_mix_shift(rm);
+	rm->data = NULL;
 	rm->samples = 31;
-	rm->pattern_lookup = malloc(128);
-	memset(rm->pattern_lookup, 0, 128);
+	memset(rm->order, 0, 128);
+	rm->pattern_lookup = rm->order;
 	rm->patterns = 128;
 	rm->song_length = 1;
 
@@ -927,16 +1450,28 @@ struct RickmodState *rm_new(int sample_rate) {
 		rm->sample[i].repeat = 0, rm->sample[i].repeat_length = 2;
 		rm->sample[i].length = 0;
 		rm->sample[i].finetune = 0;
+		rm->sample[i].c2spd = 0;
 		rm->sample[i].volume = 0x40;
-		rm->sample[i].sample_data = (int8_t *) rm->data + 128*1024*i;
+		rm->sample[i].sample_data = empty_sample;
 	}
-
-	memset(rm->pattern, 0, sizeof(rm->pattern));
+	memset(rm->sample_buffer, 0, sizeof(rm->sample_buffer));
 
 	rm->samplerate = sample_rate;
 	rm->repeat = 0;
 	rm->end = 0;
 	rm->row_callback = NULL;
+	rm->memo = NULL;
+	rm->events = NULL;
+	rm->taps = NULL;
+	rm->spectrum = NULL;
+	rm->trace = NULL;
+	rm->governor = NULL;
+	rm->pool = NULL;
+	rm->sfx = NULL;
+	rm->map = NULL;
+	memset(&rm->stats, 0, sizeof(rm->stats));
+	rm->frame = 0;
+	rickmod_command_init(rm);
 	#ifdef TRACKER
 	rm->repeat_callback = NULL;
 	#endif
@@ -951,7 +1486,7 @@ struct RickmodState *rm_new(int sample_rate) {
 	rm->cur.row = rm->cur.pattern = 0;
 	_set_bpm(rm);
 	
-	for (i = 0; i < 4; i++) {
+	for (i = 0; i < rm->channels; i++) {
 		rm->channel[i].rm = rm, rm->channel[i].channel = i, rm->channel[i].sample = rm->channel[i].trigger = rm->channel[i].play_sample = 0;
 		memset(&rm->channel[i].rce, 0, sizeof(rm->channel[i].rce));
 		rm->channel[i].sample_pos = 0;
@@ -967,70 +1502,35 @@ struct RickmodState *rm_new(int sample_rate) {
 }
 
 
-int rm_save(struct RickmodState *rm, const char *path) {
-	FILE *fp;
-	int i, j, k;
-	uint8_t ch;
-
-	// When the mod file was loaded, extra bits were already masked out, so this is fine
-	_find_number_of_patterns(rm, 128);
+/* Loops that no longer fit are cut like the loader cuts them, the old data is freed */
+int rm_sample_resize(struct RickmodState *rm, int sample, uint32_t length) {
+	struct RickmodSample *s;
+	uint32_t keep;
+	int8_t *data;
 
-	if (!(fp = fopen(path, "wb")))
+	if (sample < 1 || sample > rm->samples || length > 0x1FFFE)
 		return 0;
-	fwrite(rm->name, 20, 1, fp);
-	for (i = 0; i < 31; i++) {
-		fwrite(rm->sample[i].name, 22, 1, fp);
-		ch = rm->sample[i].length >> 9;
-		fwrite(&ch, 1, 1, fp);
-		ch = rm->sample[i].length >> 1;
-		fwrite(&ch, 1, 1, fp);
-		
-		ch = rm->sample[i].finetune & 0xF;
-		fwrite(&ch, 1, 1, fp);
-		fwrite(&rm->sample[i].volume, 1, 1, fp);
-	
-		ch = rm->sample[i].repeat >> 9;
-		fwrite(&ch, 1, 1, fp);
-		ch = rm->sample[i].repeat >> 1;
-		fwrite(&ch, 1, 1, fp);
-
-		ch = rm->sample[i].repeat_length >> 9;
-		fwrite(&ch, 1, 1, fp);
-		ch = rm->sample[i].repeat_length >> 1;
-		fwrite(&ch, 1, 1, fp);
-	}
+	s = &rm->sample[sample - 1];
+	keep = s->length < length ? s->length : length;
 
-	fwrite(&rm->song_length, 1, 1, fp);
-	ch = 127;
-	fwrite(&ch, 1, 1, fp);
-	fwrite(rm->pattern_lookup, 128, 1, fp);
-
-	if (rm->patterns > 63)
-		fwrite("M!K!", 4, 1, fp);
-	else
-		fwrite("M.K.", 4, 1, fp);
-	
-	for (i = 0; i < rm->patterns; i++)
-		for (j = 0; j < 64; j++)
-			for (k = 0; k < 4; k++) {
-				ch = (rm->pattern[i].row[j].channel[k].sample & 0xF0) | ((rm->pattern[i].row[j].channel[k].note >> 8) & 0xF);
-				fwrite(&ch, 1, 1, fp);
-				ch = rm->pattern[i].row[j].channel[k].note;
-				fwrite(&ch, 1, 1, fp);
-				ch = ((rm->pattern[i].row[j].channel[k].sample & 0xF) << 4) | ((rm->pattern[i].row[j].channel[k].effect >> 8) & 0xF);
-				fwrite(&ch, 1, 1, fp);
-				ch = rm->pattern[i].row[j].channel[k].effect & 0xFF;
-				fwrite(&ch, 1, 1, fp);
-			}
-	
-	for (i = 0; i < 31; i++)
-		fwrite(rm->sample[i].sample_data, rm->sample[i].length, 1, fp);
-
-	#ifdef MODFILE_SIGNATURE
-	fputs(MODFILE_SIGNATURE, fp);
-	#endif
-
-	fclose(fp);
+	/* Data handed over with RM_COMMAND_SAMPLE belongs to the caller, so it's copied instead */
+	if (s->sample_data == rm->sample_buffer[sample - 1]) {
+		if (!(data = realloc(rm->sample_buffer[sample - 1], length ? length : 1)))
+			return 0;
+	} else {
+		if (!(data = malloc(length ? length : 1)))
+			return 0;
+		memcpy(data, s->sample_data, keep);
+		free(rm->sample_buffer[sample - 1]);
+	}
+	memset(data + keep, 0, length - keep);
+
+	rm->sample_buffer[sample - 1] = s->sample_data = data;
+	s->length = length;
+	if (s->repeat >= s->length)
+		s->repeat = s->repeat_length = 0;
+	else if (s->repeat + s->repeat_length > s->length)
+		s->repeat_length = s->length - s->repeat;
 	return 1;
 }
 
@@ -1099,7 +1599,7 @@ int main(int argc, char **argv) {
 	}
 	
 	fclose(fp);
-	free(rm);
+	rm_free(rm);
 	free(data);
 
 
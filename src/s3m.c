@@ -0,0 +1,384 @@
+#include "rickmod.h"
+#include "s3m.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef STANDALONE
+#include <stdio.h>
+#else
+#define fprintf(...)
+#endif
+
+/* Amiga periods of octave 2, at a C-4 rate of 8363 Hz */
+static uint16_t s3m_periods[12] = {
+	1712, 1616, 1524, 1440, 1356, 1280, 1208, 1140, 1076, 1016, 960, 907,
+};
+
+
+static uint32_t _le16(const uint8_t *p) {
+	return p[0] | (p[1] << 8);
+}
+
+
+static uint32_t _le32(const uint8_t *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+
+/* The engine only knows Amiga periods 113..856, so notes outside of that are folded by octave */
+static uint16_t _period(struct RickmodState *rm, uint8_t note, int sample) {
+	uint32_t c2spd = 8363, period;
+
+	if ((note & 0xF) > 11)
+		return 0;
+	if (sample > 0 && sample <= rm->samples && rm->sample[sample - 1].c2spd)
+		c2spd = rm->sample[sample - 1].c2spd;
+	period = ((8363U * 4 * s3m_periods[note & 0xF]) >> (note >> 4)) / c2spd;
+	if (!period)
+		period = 113;
+	while (period > 856)
+		period >>= 1;
+	while (period < 113)
+		period <<= 1;
+	return period;
+}
+
+
+/* Translates an S3M command into the equivalent protracker effect, 0 if there is none */
+static uint16_t _effect(struct RickmodState *rm, uint8_t cmd, uint8_t info) {
+	switch (cmd + 'A' - 1) {
+		case 'A':
+			if (!info)
+				return 0;
+			return 0xF00 | (info < 0x20 ? info : 0x1F);
+		case 'B':
+			return 0xB00 | rm->s3m.order_remap[info];
+		case 'C':
+			return 0xD00 | info;
+		case 'D':
+			if ((info & 0xF) == 0xF && (info & 0xF0))
+				return 0xEA0 | (info >> 4);
+			if ((info & 0xF0) == 0xF0 && (info & 0xF))
+				return 0xEB0 | (info & 0xF);
+			return 0xA00 | info;
+		case 'E':
+			if (info >= 0xF0)
+				return 0xE20 | (info & 0xF);
+			if (info >= 0xE0)
+				return 0xE20 | ((info & 0xF) >> 2);
+			return 0x200 | info;
+		case 'F':
+			if (info >= 0xF0)
+				return 0xE10 | (info & 0xF);
+			if (info >= 0xE0)
+				return 0xE10 | ((info & 0xF) >> 2);
+			return 0x100 | info;
+		case 'G':
+			return 0x300 | info;
+		case 'H':
+			return 0x400 | info;
+		case 'J':
+			return info;
+		case 'K':
+			return 0x600 | info;
+		case 'L':
+			return 0x500 | info;
+		case 'O':
+			return 0x900 | info;
+		case 'Q':
+			return 0xE90 | (info & 0xF);
+		case 'R':
+			return 0x700 | info;
+		case 'S':
+			switch (info >> 4) {
+				case 0xB:
+					return 0xE60 | (info & 0xF); // Pattern loop, E6x in protracker
+				case 0xC:
+				case 0xD:
+				case 0xE:
+					return 0xE00 | info;
+			}
+			return 0;
+		case 'T':
+			return info >= 0x20 ? 0xF00 | info : 0;
+	}
+
+	fprintf(stderr, "Unhandled S3M command %c%.2X\n", cmd + 'A' - 1, info);
+	return 0;
+}
+
+
+/* Decodes (or skips, if store is 0) the packed row at rm->s3m.row_pos */
+static void _decode_row(struct RickmodState *rm, int store) {
+	uint8_t *file = rm->s3m.file;
+	uint32_t pos = rm->s3m.row_pos, end = rm->s3m.row_end;
+	uint8_t what, note = 0xFF, ins = 0, vol = 0xFF, cmd = 0, info = 0;
+	struct RickmodChannel *cell;
+	int channel;
+
+	if (store)
+		memset(rm->s3m.row, 0, sizeof(rm->s3m.row));
+
+	while (pos < end && (what = file[pos++])) {
+		if (what & 0x20) {
+			if (pos + 2 > end)
+				break;
+			note = file[pos], ins = file[pos + 1], pos += 2;
+		}
+		if (what & 0x40) {
+			if (pos + 1 > end)
+				break;
+			vol = file[pos++];
+		}
+		if (what & 0x80) {
+			if (pos + 2 > end)
+				break;
+			cmd = file[pos], info = file[pos + 1], pos += 2;
+		}
+
+		channel = rm->s3m.chanmap[what & 0x1F];
+		if (!store || channel == 0xFF)
+			goto next;
+		cell = &rm->s3m.row[channel];
+
+		if (what & 0x20) {
+			cell->sample = ins <= rm->samples ? ins : 0;
+			if (note == 254)
+				cell->effect = 0xC00;
+			else if (note < 254)
+				cell->note = _period(rm, note, ins ? ins : rm->channel[channel].rce.sample);
+		}
+		if ((what & 0x40) && vol <= 64)
+			cell->volume = vol + 1;
+		if ((what & 0x80) && cmd)
+			cell->effect = _effect(rm, cmd, info);
+	next:
+		note = 0xFF, ins = 0, vol = 0xFF, cmd = info = 0;
+	}
+
+	rm->s3m.row_pos = pos;
+}
+
+
+struct RickmodChannel *rickmod_s3m_row(struct RickmodState *rm, int pattern, int row) {
+	uint32_t offset, len;
+
+	if (pattern == rm->s3m.row_pattern && row == rm->s3m.row_index)
+		return rm->s3m.row;
+
+	/* Rows are variable length, so we can only decode forwards from the start of the pattern */
+	if (pattern != rm->s3m.row_pattern || row < rm->s3m.row_index) {
+		rm->s3m.row_pattern = pattern;
+		rm->s3m.row_index = -1;
+		rm->s3m.row_pos = rm->s3m.row_end = 0;
+		if (pattern < rm->s3m.patterns) {
+			offset = _le16(rm->s3m.pattern_para + pattern * 2) * 16;
+			if (offset && offset + 2 <= rm->s3m.file_len) {
+				len = _le16(rm->s3m.file + offset);
+				rm->s3m.row_pos = offset + 2;
+				rm->s3m.row_end = offset + len;
+				if (rm->s3m.row_end > rm->s3m.file_len)
+					rm->s3m.row_end = rm->s3m.file_len;
+			}
+		}
+	}
+
+	for (rm->s3m.row_index++; rm->s3m.row_index < row; rm->s3m.row_index++)
+		_decode_row(rm, 0);
+	_decode_row(rm, 1);
+
+	return rm->s3m.row;
+}
+
+
+static int _parse_instruments(struct RickmodState *rm, uint8_t *mod, uint32_t mod_len, uint8_t *para, int ffi) {
+	int i, width;
+	uint8_t *ins, *src;
+	int8_t *dst;
+	uint32_t offset, data_offset, total, j, length, loop_begin, loop_end;
+
+	for (i = 0, total = 0; i < rm->samples; i++) {
+		memset(&rm->sample[i], 0, sizeof(rm->sample[i]));
+		offset = _le16(para + i * 2) * 16;
+		if (!offset || offset + 80 > mod_len)
+			continue;
+		ins = mod + offset;
+		memcpy(rm->sample[i].name, ins + 48, 22);
+		rm->sample[i].name[22] = 0;
+		rm->sample[i].volume = ins[28] > 64 ? 64 : ins[28];
+		rm->sample[i].c2spd = _le32(ins + 32);
+		if (ins[0] != 1 || ins[30]) {
+			fprintf(stderr, "Sample %i is not a PCM sample\n", i + 1);
+			continue;
+		}
+
+		width = (ins[31] & 4) ? 2 : 1;
+		data_offset = ((ins[13] << 16) | (ins[15] << 8) | ins[14]) * 16;
+		length = _le32(ins + 16);
+		if (data_offset >= mod_len)
+			length = 0;
+		else if (length > (mod_len - data_offset) / width)
+			length = (mod_len - data_offset) / width;
+
+		loop_begin = _le32(ins + 20);
+		loop_end = _le32(ins + 24);
+		if (loop_end > length)
+			loop_end = length;
+		/* Nothing past the loop end is ever played, the first pass loops there too */
+		if ((ins[31] & 1) && loop_begin < loop_end) {
+			rm->sample[i].repeat = loop_begin;
+			rm->sample[i].repeat_length = loop_end - loop_begin;
+			length = loop_end;
+		}
+
+		rm->sample[i].length = length;
+		total += length;
+	}
+
+	/* Sample data is converted to signed 8-bit, with silence at the end for anything that overreads */
+	if (!(rm->data = calloc(total + (1 << MA_SAMPLE_BUFFER_LEN) + 2, 1)))
+		return 0;
+
+	for (i = 0, dst = (int8_t *) rm->data; i < rm->samples; i++) {
+		rm->sample[i].sample_data = dst;
+		if (!rm->sample[i].length) {
+			rm->sample[i].sample_data = (int8_t *) rm->data + total;
+			continue;
+		}
+
+		ins = mod + _le16(para + i * 2) * 16;
+		width = (ins[31] & 4) ? 2 : 1;
+		src = mod + ((ins[13] << 16) | (ins[15] << 8) | ins[14]) * 16 + width - 1;
+		for (j = 0; j < rm->sample[i].length; j++, src += width)
+			*dst++ = ffi == 2 ? *src ^ 0x80 : *src;
+	}
+
+	return 1;
+}
+
+
+int rickmod_s3m_load(struct RickmodState *rm, uint8_t *mod, int mod_len) {
+	int i, ordnum, insnum, patnum, ffi;
+	uint8_t settings;
+
+	if (mod_len < 96)
+		return 0;
+	ordnum = _le16(mod + 32);
+	insnum = _le16(mod + 34);
+	patnum = _le16(mod + 36);
+	ffi = _le16(mod + 42);
+	if (96 + ordnum + insnum * 2 + patnum * 2 > mod_len) {
+		fprintf(stderr, "S3M header is truncated\n");
+		return 0;
+	}
+
+	rm->format = RM_FORMAT_S3M;
+	memcpy(rm->name, mod, 20);
+	rm->name[20] = 0;
+	rm->s3m.file = mod;
+	rm->s3m.file_len = mod_len;
+	rm->s3m.patterns = patnum;
+	rm->s3m.pattern_para = mod + 96 + ordnum + insnum * 2;
+	rm->s3m.row_pattern = -1;
+	rm->s3m.row_index = -1;
+
+	/* Only PCM channels are played, adlib and disabled channels are dropped */
+	for (i = 0, rm->channels = 0; i < 32; i++) {
+		settings = mod[64 + i];
+		rm->s3m.chanmap[i] = 0xFF;
+		if (settings >= 16 || rm->channels == RM_MAX_CHANNELS)
+			continue;
+		rm->panning[rm->channels] = settings >= 8;
+		rm->s3m.chanmap[i] = rm->channels++;
+	}
+
+	/* Marker orders (254) are removed, so B effects have to be remapped */
+	for (i = 0, rm->song_length = 0; i < ordnum && i < 256; i++) {
+		rm->s3m.order_remap[i] = rm->song_length;
+		if (mod[96 + i] == 255)
+			break;
+		if (mod[96 + i] == 254 || rm->song_length == 255)
+			continue;
+		rm->s3m.order[rm->song_length++] = mod[96 + i];
+	}
+	for (; i < 256; i++)
+		rm->s3m.order_remap[i] = rm->song_length;
+	rm->pattern_lookup = rm->s3m.order;
+	rm->patterns = patnum > 255 ? 255 : patnum;
+
+	if (!rm->channels || !rm->song_length) {
+		fprintf(stderr, "S3M has no playable channels or orders\n");
+		return 0;
+	}
+
+	rm->initial_speed = (mod[49] && mod[49] != 255) ? mod[49] : 6;
+	rm->initial_bpm = mod[50] >= 33 ? mod[50] : 125;
+
+	rm->samples = insnum > RM_MAX_SAMPLES ? RM_MAX_SAMPLES : insnum;
+	if (!_parse_instruments(rm, mod, mod_len, mod + 96 + ordnum, ffi))
+		return 0;
+
+	fprintf(stderr, "S3M with %i channels, %i orders, %i patterns, %i samples\n", rm->channels, rm->song_length, patnum, rm->samples);
+	return 1;
+}
+
+
+/* Header fields only, nothing is decoded or copied */
+int rickmod_s3m_probe(const uint8_t *mod, int mod_len, struct RickmodInfo *info) {
+	int i, ordnum, insnum, patnum, width;
+	const uint8_t *ins;
+	uint32_t offset, end;
+
+	if (mod_len < 96)
+		return 0;
+	ordnum = _le16(mod + 32);
+	insnum = _le16(mod + 34);
+	patnum = _le16(mod + 36);
+	if (96 + ordnum + insnum * 2 + patnum * 2 > mod_len)
+		return 0;
+
+	info->format = RM_FORMAT_S3M;
+	memcpy(info->name, mod, 28);
+	memcpy(info->tag, "SCRM", 4);
+	for (i = 0; i < 32; i++)
+		if (mod[64 + i] < 16 && info->channels < RM_MAX_CHANNELS)
+			info->channels++;
+	for (i = 0; i < ordnum && mod[96 + i] != 255; i++)
+		if (mod[96 + i] != 254)
+			info->orders++;
+	if (!info->channels || !info->orders)
+		return 0;
+	if (info->orders > 255)
+		info->orders = 255;
+	info->patterns = patnum;
+	info->initial_speed = (mod[49] && mod[49] != 255) ? mod[49] : 6;
+	info->initial_bpm = mod[50] >= 33 ? mod[50] : 125;
+	info->samples = insnum > RM_MAX_SAMPLES ? RM_MAX_SAMPLES : insnum;
+
+	/* The furthest byte any instrument or pattern points at */
+	info->data_len = 96 + ordnum + insnum * 2 + patnum * 2;
+	for (i = 0; i < info->samples; i++) {
+		offset = _le16(mod + 96 + ordnum + i * 2) * 16;
+		if (!offset || offset + 80 > (uint32_t) mod_len)
+			continue;
+		ins = mod + offset;
+		memcpy(info->sample_name[i], ins + 48, 28);
+		end = offset + 80;
+		if (ins[0] == 1) {
+			width = (ins[31] & 4) ? 2 : 1;
+			end = ((ins[13] << 16) | (ins[15] << 8) | ins[14]) * 16 + _le32(ins + 16) * width;
+		}
+		if (end > info->data_len)
+			info->data_len = end;
+	}
+	for (i = 0; i < patnum; i++) {
+		offset = _le16(mod + 96 + ordnum + insnum * 2 + i * 2) * 16;
+		end = offset + 2 <= (uint32_t) mod_len ? offset + _le16(mod + offset) : offset + 2;
+		if (offset && end > info->data_len)
+			info->data_len = end;
+	}
+
+	return 1;
+}
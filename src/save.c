@@ -0,0 +1,140 @@
+#include "rickmod.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef TRACKER
+#include <stdio.h>
+#endif
+
+#if defined(TRACKER) && defined(HOSTED)
+#include <unistd.h>
+#endif
+
+#ifdef MODFILE_SIGNATURE
+#define	SIGNATURE_LEN (sizeof(MODFILE_SIGNATURE) - 1)
+#else
+#define	SIGNATURE_LEN 0
+#endif
+
+
+/* The header counts in words, so an odd byte at the end can't be written */
+static uint32_t _length(struct RickmodSample *s) {
+	return s->length > 0x1FFFE ? 0x1FFFE : s->length & ~1;
+}
+
+
+static void _be16(uint8_t *p, uint32_t v) {
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+
+/* Same count the loader arrives at, order entries past the song length count too */
+static int _patterns(struct RickmodState *rm) {
+	int i, max = 0;
+
+	for (i = 0; i < 128; i++)
+		if ((rm->pattern_lookup[i] & 127) > max)
+			max = rm->pattern_lookup[i] & 127;
+	return max + 1;
+}
+
+
+/* The size is known up front, so the module is written in one pass without growing the buffer */
+int rm_save_mem(struct RickmodState *rm, uint8_t **buf, uint32_t *len) {
+	struct RickmodChannel *cell;
+	struct RickmodSample *s;
+	uint32_t size, length;
+	uint8_t *out, *p;
+	int i, j, patterns;
+
+	/* Only protracker modules can be written back */
+	if (rm->format != RM_FORMAT_MOD)
+		return 0;
+
+	patterns = _patterns(rm);
+	size = 1084 + 1024 * patterns + SIGNATURE_LEN;
+	for (i = 0; i < 31; i++)
+		size += _length(&rm->sample[i]);
+	if (!(out = malloc(size)))
+		return 0;
+
+	memcpy(out, rm->name, 20);
+	for (i = 0, p = out + 20; i < 31; i++, p += 30) {
+		s = &rm->sample[i];
+		memcpy(p, s->name, 22);
+		_be16(p + 22, _length(s) >> 1);
+		p[24] = s->finetune & 0xF;
+		p[25] = s->volume;
+		_be16(p + 26, s->repeat >> 1);
+		_be16(p + 28, s->repeat_length >> 1);
+	}
+
+	out[950] = rm->song_length;
+	out[951] = 127;
+	for (i = 0; i < 128; i++)
+		out[952 + i] = rm->pattern_lookup[i] & 127;
+	memcpy(out + 1080, patterns > 63 ? "M!K!" : "M.K.", 4);
+
+	for (i = 0, p = out + 1084; i < patterns; i++)
+		for (j = 0; j < 64 * 4; j++, p += 4) {
+			cell = &rm->pattern[i].row[j >> 2].channel[j & 3];
+			p[0] = (cell->sample & 0xF0) | ((cell->note >> 8) & 0xF);
+			p[1] = cell->note;
+			p[2] = ((cell->sample & 0xF) << 4) | ((cell->effect >> 8) & 0xF);
+			p[3] = cell->effect;
+		}
+
+	for (i = 0; i < 31; i++) {
+		length = _length(&rm->sample[i]);
+		memcpy(p, rm->sample[i].sample_data, length);
+		p += length;
+	}
+
+	#ifdef MODFILE_SIGNATURE
+	memcpy(p, MODFILE_SIGNATURE, SIGNATURE_LEN);
+	#endif
+
+	*buf = out;
+	*len = size;
+	return 1;
+}
+
+
+#ifdef TRACKER
+
+/* Written next to the old module and renamed over it, a crash halfway leaves the old one intact */
+int rm_save(struct RickmodState *rm, const char *path) {
+	char tmp[4096];
+	uint8_t *buf;
+	uint32_t len;
+	FILE *fp;
+	int ok;
+
+	if ((size_t) snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= sizeof(tmp))
+		return 0;
+	if (!rm_save_mem(rm, &buf, &len))
+		return 0;
+	if (!(fp = fopen(tmp, "wb"))) {
+		free(buf);
+		return 0;
+	}
+
+	/* Unbuffered, so the whole module goes out in a single write */
+	setvbuf(fp, NULL, _IONBF, 0);
+	ok = fwrite(buf, 1, len, fp) == len;
+	#ifdef HOSTED
+	ok = ok && !fsync(fileno(fp));
+	#endif
+	ok = !fclose(fp) && ok;
+	free(buf);
+
+	if (ok && !rename(tmp, path))
+		return 1;
+	remove(tmp);
+	return 0;
+}
+
+#endif
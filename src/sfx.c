@@ -0,0 +1,292 @@
+#include "rickmod.h"
+#include "sfx.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define	SFX_PLAY 0
+#define	SFX_STOP 1
+#define	SFX_VOLUME 2
+#define	SFX_DEFAULT_RATE 8363
+#define	SFX_MAX_RATE 0xFFFF
+
+/* Only the mixing thread writes, relaxed atomics keep rm_sfx_stats() from reading torn counters */
+#define	SFX_COUNT(sfx, field, n) __atomic_store_n(&(sfx)->stats.field, (sfx)->stats.field + (n), __ATOMIC_RELAXED)
+
+
+struct SfxRequest {
+	uint8_t			type;
+	uint32_t		id;
+	struct RickmodSfxParams	params; // Only volume and pan for SFX_VOLUME
+};
+
+
+struct SfxVoice {
+	uint32_t		id; // 0 = free
+	struct RickmodState	*rm;
+	uint8_t			sample;
+	uint8_t			volume;
+	uint8_t			pan;
+	uint8_t			priority;
+	uint8_t			ending; // The data ran out in the buffer being played
+	uint8_t			done;
+
+	const int8_t		*data;
+	uint32_t		length;
+	uint32_t		repeat;
+	uint32_t		repeat_length;
+	uint32_t		pos;
+	struct MAState		ma;
+};
+
+
+struct RickmodSfx {
+	int			voices;
+	struct SfxVoice		voice[RM_SFX_MAX_VOICES];
+	struct RickmodSfxStats	stats;
+
+	/* Single producer, single consumer, positions only ever grow and are masked on use */
+	struct SfxRequest	queue[RM_SFX_QUEUE_LEN];
+	uint32_t		head;
+	uint32_t		tail;
+};
+
+
+/* Module samples are looked up on every refill, so sample commands and edits are picked up like the music does */
+static void _fill(void *ptr, int8_t *buff) {
+	struct SfxVoice *v = ptr;
+	struct RickmodSample *s;
+	const int8_t *data = v->data;
+	uint32_t length = v->length, repeat = v->repeat, repeat_length = v->repeat_length, end, len;
+	int i = 0, loop;
+
+	if (v->ending) {
+		v->done = 1;
+		memset(buff, 0, 1 << MA_SAMPLE_BUFFER_LEN);
+		return;
+	}
+	if (v->sample) {
+		s = &v->rm->sample[v->sample - 1];
+		data = s->sample_data;
+		length = s->length;
+		repeat = s->repeat;
+		repeat_length = s->repeat_length;
+	}
+
+	loop = repeat_length && !(!repeat && repeat_length <= 2) && repeat + repeat_length <= length;
+	end = loop ? repeat + repeat_length : length;
+	while (i < (1 << MA_SAMPLE_BUFFER_LEN)) {
+		if (v->pos >= end) {
+			if (!loop) {
+				v->ending = 1;
+				memset(buff + i, 0, (1 << MA_SAMPLE_BUFFER_LEN) - i);
+				return;
+			}
+			v->pos = repeat;
+		}
+		len = end - v->pos;
+		if (len > (uint32_t) (1 << MA_SAMPLE_BUFFER_LEN) - i)
+			len = (1 << MA_SAMPLE_BUFFER_LEN) - i;
+		memcpy(buff + i, data + v->pos, len);
+		i += len;
+		v->pos += len;
+	}
+}
+
+
+/* A free voice if there is one, otherwise the lowest priority voice that has played longest */
+static struct SfxVoice *_voice(struct RickmodSfx *sfx, uint8_t priority) {
+	struct SfxVoice *v, *victim = NULL;
+	int i;
+
+	for (i = 0; i < sfx->voices; i++) {
+		v = &sfx->voice[i];
+		if (!v->id)
+			return v;
+		if (!victim || v->priority < victim->priority || (v->priority == victim->priority && v->id - victim->id > 0x80000000U))
+			victim = v;
+	}
+	if (!victim || victim->priority > priority)
+		return NULL;
+	SFX_COUNT(sfx, stolen, 1);
+	SFX_COUNT(sfx, active, -1);
+	return victim;
+}
+
+
+static void _play(struct RickmodState *rm, struct SfxRequest *req) {
+	struct RickmodSfx *sfx = rm->sfx;
+	struct RickmodSfxParams *p = &req->params;
+	struct SfxVoice *v;
+	uint32_t rate = p->rate;
+
+	if (p->sample > rm->samples || !(v = _voice(sfx, p->priority))) {
+		SFX_COUNT(sfx, dropped, 1);
+		return;
+	}
+	if (!rate)
+		rate = p->sample && rm->sample[p->sample - 1].c2spd ? rm->sample[p->sample - 1].c2spd : SFX_DEFAULT_RATE;
+	/* A step has to stay inside one sample buffer */
+	if (rate > SFX_MAX_RATE)
+		rate = SFX_MAX_RATE;
+
+	memset(v, 0, sizeof(*v));
+	v->id = req->id;
+	v->rm = rm;
+	v->sample = p->sample;
+	v->volume = p->volume > 64 ? 64 : p->volume;
+	v->pan = p->pan;
+	v->priority = p->priority;
+	v->data = p->data;
+	v->length = p->data ? p->length : 0;
+	v->repeat = p->repeat;
+	v->repeat_length = p->repeat_length;
+
+	v->ma = ma_init(rm->samplerate);
+	ma_set_callback(&v->ma, _fill, v);
+	ma_set_volume(&v->ma, v->volume);
+	/* Set directly, ma_set_samplerate() overflows above 32 kHz */
+	v->ma.fraction_per_sample = (uint64_t) rate * 0x10000 / rm->samplerate;
+	SFX_COUNT(sfx, played, 1);
+	SFX_COUNT(sfx, active, 1);
+}
+
+
+static struct SfxVoice *_find(struct RickmodSfx *sfx, uint32_t id) {
+	int i;
+
+	for (i = 0; i < sfx->voices; i++)
+		if (id && sfx->voice[i].id == id)
+			return &sfx->voice[i];
+	return NULL;
+}
+
+
+static void _drain(struct RickmodState *rm) {
+	struct RickmodSfx *sfx = rm->sfx;
+	struct SfxRequest *req;
+	struct SfxVoice *v;
+	uint32_t tail = sfx->tail;
+
+	for (; tail != __atomic_load_n(&sfx->head, __ATOMIC_ACQUIRE); tail++) {
+		req = &sfx->queue[tail & (RM_SFX_QUEUE_LEN - 1)];
+		if (req->type == SFX_PLAY)
+			_play(rm, req);
+		else if ((v = _find(sfx, req->id)) && req->type == SFX_STOP) {
+			v->id = 0;
+			SFX_COUNT(sfx, active, -1);
+		} else if (v) {
+			v->volume = req->params.volume > 64 ? 64 : req->params.volume;
+			v->pan = req->params.pan;
+			ma_set_volume(&v->ma, v->volume);
+		}
+	}
+	__atomic_store_n(&sfx->tail, tail, __ATOMIC_RELEASE);
+}
+
+
+/* Added to the music before it is scaled, with the kernel the music used so the levels match */
+void rickmod_sfx_mix(struct RickmodState *rm, int32_t *buffer, int samples, int fast) {
+	struct RickmodSfx *sfx = rm->sfx;
+	void (*add)(struct MAState *rs, int32_t *sample, int samples) = fast ? ma_add_fast : ma_add;
+	int32_t mono[samples];
+	struct SfxVoice *v;
+	int i, j;
+
+	_drain(rm);
+	for (i = 0; i < sfx->voices; i++) {
+		v = &sfx->voice[i];
+		if (!v->id)
+			continue;
+
+		if (!v->volume)
+			(fast ? ma_skip_fast : ma_skip)(&v->ma, samples);
+		else if (v->pan == 0 || v->pan == 255)
+			add(&v->ma, buffer + (v->pan ? samples : 0), samples);
+		else {
+			memset(mono, 0, sizeof(mono));
+			add(&v->ma, mono, samples);
+			for (j = 0; j < samples; j++) {
+				buffer[j] += (mono[j] * (256 - v->pan)) >> 8;
+				buffer[j + samples] += (mono[j] * v->pan) >> 8;
+			}
+		}
+
+		if (v->done) {
+			v->id = 0;
+			SFX_COUNT(sfx, active, -1);
+		}
+	}
+}
+
+
+void rickmod_sfx_free(struct RickmodState *rm) {
+	free(rm->sfx);
+	rm->sfx = NULL;
+}
+
+
+int rm_sfx_set(struct RickmodState *rm, int voices) {
+	rickmod_sfx_free(rm);
+	if (!voices)
+		return 1;
+	if (voices < 0 || voices > RM_SFX_MAX_VOICES)
+		return 0;
+	if (!(rm->sfx = calloc(1, sizeof(*rm->sfx))))
+		return 0;
+	rm->sfx->voices = voices;
+	return 1;
+}
+
+
+/* Only one thread may send at a time, the player picks requests up at the start of its next mix call */
+static uint32_t _send(struct RickmodState *rm, uint8_t type, uint32_t id, const struct RickmodSfxParams *params) {
+	struct RickmodSfx *sfx = rm->sfx;
+	struct SfxRequest *req;
+	uint32_t head;
+
+	if (!sfx)
+		return 0;
+	head = __atomic_load_n(&sfx->head, __ATOMIC_RELAXED);
+	if (head - __atomic_load_n(&sfx->tail, __ATOMIC_ACQUIRE) >= RM_SFX_QUEUE_LEN)
+		return 0;
+	req = &sfx->queue[head & (RM_SFX_QUEUE_LEN - 1)];
+	req->type = type;
+	req->id = type == SFX_PLAY ? head + 1 : id;
+	req->params = *params;
+	__atomic_store_n(&sfx->head, head + 1, __ATOMIC_RELEASE);
+	return head + 1;
+}
+
+
+uint32_t rm_sfx_play(struct RickmodState *rm, const struct RickmodSfxParams *params) {
+	return _send(rm, SFX_PLAY, 0, params);
+}
+
+
+int rm_sfx_volume(struct RickmodState *rm, uint32_t id, uint8_t volume, uint8_t pan) {
+	struct RickmodSfxParams params = { .volume = volume, .pan = pan };
+
+	return _send(rm, SFX_VOLUME, id, &params) != 0;
+}
+
+
+int rm_sfx_stop(struct RickmodState *rm, uint32_t id) {
+	struct RickmodSfxParams params = { 0 };
+
+	return _send(rm, SFX_STOP, id, &params) != 0;
+}
+
+
+void rm_sfx_stats(struct RickmodState *rm, struct RickmodSfxStats *stats) {
+	struct RickmodSfx *sfx = rm->sfx;
+
+	memset(stats, 0, sizeof(*stats));
+	if (!sfx)
+		return;
+	stats->played = __atomic_load_n(&sfx->stats.played, __ATOMIC_RELAXED);
+	stats->stolen = __atomic_load_n(&sfx->stats.stolen, __ATOMIC_RELAXED);
+	stats->dropped = __atomic_load_n(&sfx->stats.dropped, __ATOMIC_RELAXED);
+	stats->active = __atomic_load_n(&sfx->stats.active, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,224 @@
+#ifdef HOSTED
+
+#include "rickmod.h"
+#include "spectrum.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define	SPECTRUM_FRAMES 4 // Must be a power of two
+#define	SPECTRUM_FLOOR -120.0f
+#define	SPECTRUM_LOW_HZ 20.0f
+#define	SPECTRUM_PI 3.14159265358979f
+
+
+struct RickmodSpectrum {
+	uint32_t		size; // FFT length, real input
+	uint32_t		hop;
+	uint32_t		bins;
+
+	float			*history; // Ring of the last size input samples
+	uint32_t		pos;
+	uint32_t		fill;
+	float			*window;
+	float			*re, *im; // size / 2 complex points
+	float			*cos, *sin; // Twiddles for size, the half size FFT uses every other one
+	uint32_t		*rev;
+	uint32_t		*edge; // bins + 1 FFT bin edges
+	float			norm;
+
+	/* Ring of finished spectra, head only ever grows */
+	float			*out;
+	uint64_t		out_frame[SPECTRUM_FRAMES];
+	uint32_t		head;
+};
+
+
+static void _fft(struct RickmodSpectrum *sp) {
+	uint32_t n = sp->size / 2, len, half, step, i, j, k;
+	float tr, ti, wr, wi;
+
+	for (i = 0; i < n; i++)
+		if (sp->rev[i] > i) {
+			tr = sp->re[i], sp->re[i] = sp->re[sp->rev[i]], sp->re[sp->rev[i]] = tr;
+			ti = sp->im[i], sp->im[i] = sp->im[sp->rev[i]], sp->im[sp->rev[i]] = ti;
+		}
+
+	for (len = 2; len <= n; len <<= 1) {
+		half = len / 2;
+		step = sp->size / len;
+		for (i = 0; i < n; i += len)
+			for (j = 0, k = 0; j < half; j++, k += step) {
+				wr = sp->cos[k], wi = sp->sin[k];
+				tr = sp->re[i + j + half] * wr - sp->im[i + j + half] * wi;
+				ti = sp->re[i + j + half] * wi + sp->im[i + j + half] * wr;
+				sp->re[i + j + half] = sp->re[i + j] - tr;
+				sp->im[i + j + half] = sp->im[i + j] - ti;
+				sp->re[i + j] += tr;
+				sp->im[i + j] += ti;
+			}
+	}
+}
+
+
+/* Real input packed as size / 2 complex points, then split into the size / 2 + 1 real spectrum */
+static void _analyze(struct RickmodSpectrum *sp, uint64_t frame) {
+	uint32_t n = sp->size / 2, i, k, b;
+	float *out, evr, evi, odr, odi, xr, xi, mag, peak;
+
+	for (i = 0; i < n; i++) {
+		sp->re[i] = sp->history[(sp->pos + 2 * i) & (sp->size - 1)] * sp->window[2 * i];
+		sp->im[i] = sp->history[(sp->pos + 2 * i + 1) & (sp->size - 1)] * sp->window[2 * i + 1];
+	}
+	_fft(sp);
+
+	out = sp->out + (sp->head & (SPECTRUM_FRAMES - 1)) * sp->bins;
+	for (b = 0, peak = 0; b < sp->bins; b++, peak = 0) {
+		for (k = sp->edge[b]; k < sp->edge[b + 1]; k++) {
+			if (k == n) {
+				mag = fabsf(sp->re[0] - sp->im[0]);
+			} else {
+				evr = (sp->re[k] + sp->re[(n - k) & (n - 1)]) * 0.5f;
+				evi = (sp->im[k] - sp->im[(n - k) & (n - 1)]) * 0.5f;
+				odr = (sp->im[k] + sp->im[(n - k) & (n - 1)]) * 0.5f;
+				odi = (sp->re[(n - k) & (n - 1)] - sp->re[k]) * 0.5f;
+				xr = evr + odr * sp->cos[k] - odi * sp->sin[k];
+				xi = evi + odr * sp->sin[k] + odi * sp->cos[k];
+				mag = sqrtf(xr * xr + xi * xi);
+			}
+			if (mag > peak)
+				peak = mag;
+		}
+		out[b] = peak > 0 ? 20.0f * log10f(peak * sp->norm) : SPECTRUM_FLOOR;
+		if (out[b] < SPECTRUM_FLOOR)
+			out[b] = SPECTRUM_FLOOR;
+	}
+
+	sp->out_frame[sp->head & (SPECTRUM_FRAMES - 1)] = frame;
+	__atomic_store_n(&sp->head, sp->head + 1, __ATOMIC_RELEASE);
+}
+
+
+/* Takes the int32 mix before conversion, shift brings it down to 16 bit and frame is where the mix starts */
+void rickmod_spectrum_feed(struct RickmodState *rm, int32_t *mix, int samples, int shift, uint64_t frame) {
+	struct RickmodSpectrum *sp = rm->spectrum;
+	float scale = 1.0f / (65536 << shift);
+	int i;
+
+	for (i = 0; i < samples; i++) {
+		sp->history[sp->pos] = (mix[i] + mix[i + samples]) * scale;
+		sp->pos = (sp->pos + 1) & (sp->size - 1);
+		if (++sp->fill >= sp->hop) {
+			sp->fill = 0;
+			_analyze(sp, frame + i + 1);
+		}
+	}
+}
+
+
+void rickmod_spectrum_free(struct RickmodState *rm) {
+	struct RickmodSpectrum *sp = rm->spectrum;
+
+	if (!sp)
+		return;
+	free(sp->history);
+	free(sp->window);
+	free(sp->re);
+	free(sp->im);
+	free(sp->cos);
+	free(sp->sin);
+	free(sp->rev);
+	free(sp->edge);
+	free(sp->out);
+	free(sp);
+	rm->spectrum = NULL;
+}
+
+
+static void _set_edges(struct RickmodSpectrum *sp, int samplerate) {
+	uint32_t n = sp->size / 2, b, k;
+	float lo, ratio;
+
+	lo = SPECTRUM_LOW_HZ * sp->size / samplerate;
+	if (lo < 1)
+		lo = 1;
+	ratio = powf((n + 1) / lo, 1.0f / sp->bins);
+	sp->edge[0] = lo;
+	for (b = 1; b <= sp->bins; b++) {
+		k = lo * powf(ratio, b);
+		if (k <= sp->edge[b - 1])
+			k = sp->edge[b - 1] + 1;
+		sp->edge[b] = k > n + 1 ? n + 1 : k;
+	}
+}
+
+
+int rm_spectrum_set(struct RickmodState *rm, uint32_t size, uint32_t hop, uint32_t bins) {
+	struct RickmodSpectrum *sp;
+	uint32_t i, j, bits;
+
+	rickmod_spectrum_free(rm);
+	if (!size)
+		return 1;
+	if (size < 16 || (size & (size - 1)) || !bins || bins > size / 2)
+		return 0;
+	if (!(sp = rm->spectrum = calloc(1, sizeof(*sp))))
+		return 0;
+	sp->size = size;
+	sp->hop = hop ? hop : size / 2;
+	sp->bins = bins;
+	/* A full scale sine peaks at size / 4 through the Hann window */
+	sp->norm = 4.0f / size;
+
+	sp->history = calloc(size, sizeof(float));
+	sp->window = malloc(size * sizeof(float));
+	sp->re = malloc(size / 2 * sizeof(float));
+	sp->im = malloc(size / 2 * sizeof(float));
+	sp->cos = malloc(size / 2 * sizeof(float));
+	sp->sin = malloc(size / 2 * sizeof(float));
+	sp->rev = malloc(size / 2 * sizeof(uint32_t));
+	sp->edge = malloc((bins + 1) * sizeof(uint32_t));
+	sp->out = calloc(SPECTRUM_FRAMES * bins, sizeof(float));
+	if (!sp->history || !sp->window || !sp->re || !sp->im || !sp->cos || !sp->sin || !sp->rev || !sp->edge || !sp->out)
+		return rickmod_spectrum_free(rm), 0;
+
+	for (i = 0; i < size; i++)
+		sp->window[i] = 0.5f - 0.5f * cosf(2.0f * SPECTRUM_PI * i / size);
+	for (i = 0; i < size / 2; i++) {
+		sp->cos[i] = cosf(2.0f * SPECTRUM_PI * i / size);
+		sp->sin[i] = -sinf(2.0f * SPECTRUM_PI * i / size);
+	}
+	for (bits = 0; (2u << bits) < size; bits++);
+	for (i = 0; i < size / 2; i++) {
+		for (j = 0, sp->rev[i] = 0; j < bits; j++)
+			sp->rev[i] |= ((i >> j) & 1) << (bits - 1 - j);
+	}
+	_set_edges(sp, rm->samplerate);
+	return 1;
+}
+
+
+/* Copies the newest spectrum in dB relative to full scale, returns how many have been published so far */
+uint32_t rm_spectrum_read(struct RickmodState *rm, float *bins, uint64_t *frame) {
+	struct RickmodSpectrum *sp = rm->spectrum;
+	uint32_t head;
+	int tries;
+
+	if (!sp)
+		return 0;
+	for (tries = 0; tries < 4; tries++) {
+		if (!(head = __atomic_load_n(&sp->head, __ATOMIC_ACQUIRE)))
+			return 0;
+		memcpy(bins, sp->out + ((head - 1) & (SPECTRUM_FRAMES - 1)) * sp->bins, sp->bins * sizeof(float));
+		if (frame)
+			*frame = sp->out_frame[(head - 1) & (SPECTRUM_FRAMES - 1)];
+		if (__atomic_load_n(&sp->head, __ATOMIC_ACQUIRE) - head < SPECTRUM_FRAMES - 1)
+			return head;
+	}
+
+	return 0;
+}
+
+#endif
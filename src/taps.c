@@ -0,0 +1,160 @@
+#include "rickmod.h"
+#include "taps.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+struct RickmodTapChannel {
+	int16_t			*ring;
+	uint32_t		head; // Only ever grows, masked on use
+	uint32_t		phase;
+
+	uint32_t		meter_count;
+	uint32_t		peak;
+	uint64_t		sum;
+	uint32_t		meter; // peak << 16 | rms of the last finished block
+};
+
+
+struct RickmodTaps {
+	uint32_t		len;
+	uint32_t		decimate;
+	uint32_t		meter_frames;
+	int32_t			*scratch; // One voice worth of ma_add output, a tick at most
+	struct RickmodTapChannel channel[RM_MAX_CHANNELS];
+};
+
+
+static uint32_t _isqrt(uint64_t n) {
+	uint64_t bit = 1ULL << 62, res = 0;
+
+	while (bit > n)
+		bit >>= 2;
+	for (; bit; bit >>= 2) {
+		if (n >= res + bit) {
+			n -= res + bit;
+			res = (res >> 1) + bit;
+		} else
+			res >>= 1;
+	}
+
+	return res;
+}
+
+
+int32_t *rickmod_taps_scratch(struct RickmodState *rm) {
+	return rm->taps->scratch;
+}
+
+
+/* Scaled like the s16 output before the channel count attenuation */
+void rickmod_taps_write(struct RickmodState *rm, int channel, int32_t *data, int samples, int fast) {
+	struct RickmodTaps *taps = rm->taps;
+	struct RickmodTapChannel *tc = &taps->channel[channel];
+	uint32_t head = tc->head, mag;
+	int32_t v;
+	int i;
+
+	for (i = 0; i < samples; i++) {
+		v = fast ? data[i] : data[i] >> 1;
+		if (v > 32767)
+			v = 32767;
+		if (v < -32768)
+			v = -32768;
+		if (++tc->phase >= taps->decimate) {
+			tc->ring[head++ & (taps->len - 1)] = v;
+			tc->phase = 0;
+		}
+
+		mag = v < 0 ? -v : v;
+		if (mag > tc->peak)
+			tc->peak = mag;
+		tc->sum += mag * mag;
+		if (++tc->meter_count == taps->meter_frames) {
+			__atomic_store_n(&tc->meter, (tc->peak > 0xFFFF ? 0xFFFF : tc->peak) << 16 | _isqrt(tc->sum / tc->meter_count), __ATOMIC_RELAXED);
+			tc->peak = tc->meter_count = 0;
+			tc->sum = 0;
+		}
+	}
+
+	__atomic_store_n(&tc->head, head, __ATOMIC_RELEASE);
+}
+
+
+void rickmod_taps_free(struct RickmodState *rm) {
+	int i;
+
+	if (!rm->taps)
+		return;
+	for (i = 0; i < RM_MAX_CHANNELS; i++)
+		free(rm->taps->channel[i].ring);
+	free(rm->taps->scratch);
+	free(rm->taps);
+	rm->taps = NULL;
+}
+
+
+int rm_taps_set(struct RickmodState *rm, uint32_t len, uint32_t decimate, uint32_t meter_frames) {
+	struct RickmodTaps *taps;
+	uint32_t size;
+	int i;
+
+	rickmod_taps_free(rm);
+	if (!len)
+		return 1;
+	for (size = 1; size < len; size <<= 1);
+	if (!(taps = calloc(1, sizeof(*taps))))
+		return 0;
+	rm->taps = taps;
+	taps->len = size;
+	taps->decimate = decimate ? decimate : 1;
+	taps->meter_frames = meter_frames ? meter_frames : rm->samplerate / 50;
+	/* A tick is never longer than a second */
+	if (!(taps->scratch = malloc(rm->samplerate * sizeof(*taps->scratch))))
+		return rickmod_taps_free(rm), 0;
+	for (i = 0; i < rm->channels; i++)
+		if (!(taps->channel[i].ring = calloc(size, sizeof(*taps->channel[i].ring))))
+			return rickmod_taps_free(rm), 0;
+	return 1;
+}
+
+
+/* Copies the most recent frames, retrying if the mixer lapped the copy */
+uint32_t rm_tap_read(struct RickmodState *rm, int channel, int16_t *buff, uint32_t frames) {
+	struct RickmodTapChannel *tc;
+	uint32_t head, start, offset, first;
+	int tries;
+
+	if (!rm->taps || channel < 0 || channel >= rm->channels)
+		return 0;
+	tc = &rm->taps->channel[channel];
+	if (frames > rm->taps->len / 2)
+		frames = rm->taps->len / 2;
+
+	for (tries = 0; tries < 4; tries++) {
+		head = __atomic_load_n(&tc->head, __ATOMIC_ACQUIRE);
+		if (frames > head)
+			frames = head;
+		start = head - frames;
+		offset = start & (rm->taps->len - 1);
+		first = frames < rm->taps->len - offset ? frames : rm->taps->len - offset;
+		memcpy(buff, tc->ring + offset, first * sizeof(*buff));
+		memcpy(buff + first, tc->ring, (frames - first) * sizeof(*buff));
+		if (__atomic_load_n(&tc->head, __ATOMIC_ACQUIRE) - start <= rm->taps->len)
+			return frames;
+	}
+
+	return 0;
+}
+
+
+void rm_tap_meter(struct RickmodState *rm, int channel, uint16_t *peak, uint16_t *rms) {
+	uint32_t meter = 0;
+
+	if (rm->taps && channel >= 0 && channel < rm->channels)
+		meter = __atomic_load_n(&rm->taps->channel[channel].meter, __ATOMIC_RELAXED);
+	*peak = meter >> 16;
+	*rms = meter & 0xFFFF;
+}
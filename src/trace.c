@@ -0,0 +1,101 @@
+#ifdef HOSTED
+
+#define	_POSIX_C_SOURCE 200809L
+
+#include "rickmod.h"
+#include "trace.h"
+#include "util.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+
+struct RickmodTraceSpan {
+	uint64_t		begin;
+	uint32_t		duration;
+	uint8_t			type;
+	uint8_t			channel;
+};
+
+
+/* Preallocated, recording simply stops when it is full */
+struct RickmodTrace {
+	uint64_t		start;
+	uint32_t		len;
+	uint32_t		count;
+	uint32_t		dropped;
+	struct RickmodTraceSpan	span[];
+};
+
+
+static const char *_name[] = {
+	"_handle_tick",
+	"_do_row",
+	"_handle_tick_effects",
+	"ma_add",
+	"_pull_samples",
+};
+
+
+void rickmod_trace_end(struct RickmodState *rm, int type, int channel, uint64_t begin) {
+	struct RickmodTrace *trace = rm->trace;
+	struct RickmodTraceSpan *span;
+
+	if (trace->count == trace->len) {
+		trace->dropped++;
+		return;
+	}
+
+	span = &trace->span[trace->count++];
+	span->begin = begin - trace->start;
+	span->duration = rickmod_now_ns() - begin;
+	span->type = type;
+	span->channel = channel;
+}
+
+
+void rickmod_trace_free(struct RickmodState *rm) {
+	free(rm->trace);
+	rm->trace = NULL;
+}
+
+
+int rm_trace_set(struct RickmodState *rm, uint32_t max_spans) {
+	rickmod_trace_free(rm);
+	if (!max_spans)
+		return 1;
+	if (!(rm->trace = malloc(sizeof(*rm->trace) + max_spans * sizeof(struct RickmodTraceSpan))))
+		return 0;
+	rm->trace->start = rickmod_now_ns();
+	rm->trace->len = max_spans;
+	rm->trace->count = rm->trace->dropped = 0;
+	return 1;
+}
+
+
+/* Chrome trace-event JSON, one complete event per span, channels show up as arguments */
+int rm_trace_dump(struct RickmodState *rm, const char *path) {
+	struct RickmodTrace *trace = rm->trace;
+	struct RickmodTraceSpan *span;
+	uint32_t i;
+	FILE *fp;
+
+	if (!trace || !(fp = fopen(path, "w")))
+		return 0;
+
+	fprintf(fp, "{\"traceEvents\":[\n");
+	for (i = 0; i < trace->count; i++) {
+		span = &trace->span[i];
+		fprintf(fp, "{\"name\":\"%s\",\"cat\":\"rickmod\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f",
+			_name[span->type], span->begin / 1000.0, span->duration / 1000.0);
+		if (span->type != RICKMOD_TRACE_TICK && span->type != RICKMOD_TRACE_TICK_EFFECTS)
+			fprintf(fp, ",\"args\":{\"channel\":%i}", span->channel);
+		fprintf(fp, "}%s\n", i + 1 < trace->count ? "," : "");
+	}
+	fprintf(fp, "],\"displayTimeUnit\":\"ns\",\"otherData\":{\"dropped\":%u}}\n", trace->dropped);
+
+	return !fclose(fp);
+}
+
+#endif
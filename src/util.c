@@ -0,0 +1,30 @@
+#ifdef HOSTED
+#define	_POSIX_C_SOURCE 200809L
+#endif
+
+#include "util.h"
+
+#include <stdint.h>
+#ifdef HOSTED
+#include <time.h>
+#endif
+
+
+/* FNV-1a, start from RICKMOD_FNV64_INIT and chain the result through further calls */
+uint64_t rickmod_fnv64(uint64_t h, const void *data, uint32_t len) {
+	const uint8_t *p = data;
+
+	while (len--)
+		h = (h ^ *p++) * 0x100000001B3ULL;
+	return h;
+}
+
+
+#ifdef HOSTED
+uint64_t rickmod_now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
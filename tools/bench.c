@@ -0,0 +1,245 @@
+#define	_GNU_SOURCE
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "rickmod.h"
+
+/* Frames per second of the mixing paths and kernels, usage: bench [-s seconds] module... */
+
+#define	KERNEL_S16 0
+#define	KERNEL_S16_FAST 1
+#define	KERNEL_U8 2
+#define	KERNEL_MA_ADD 3
+#define	KERNEL_MA_ADD_FAST 4
+#define	KERNEL_MA_MIX8 5
+
+static const char *kernel_name[] = {
+	"rm_mix_s16", "rm_mix_s16_fast", "rm_mix_u8", "ma_add", "ma_add_fast", "ma_mix8",
+};
+
+static const int rates[] = { 22050, 44100, 48000 };
+static const int buffers[] = { 64, 256, 1024, 4096 };
+
+static int perf_cycles = -1, perf_instructions = -1;
+static int8_t wave[256];
+
+
+struct Measure {
+	uint64_t		ns;
+	uint64_t		cycles;
+	uint64_t		instructions;
+};
+
+
+static uint64_t _now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+#ifdef __linux__
+static int _perf_open(uint64_t config) {
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = config;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+
+static void _perf_init(void) {
+	#ifdef __linux__
+	perf_cycles = _perf_open(PERF_COUNT_HW_CPU_CYCLES);
+	perf_instructions = _perf_open(PERF_COUNT_HW_INSTRUCTIONS);
+	#endif
+}
+
+
+static void _measure_start(struct Measure *m) {
+	#ifdef __linux__
+	if (perf_cycles >= 0)
+		ioctl(perf_cycles, PERF_EVENT_IOC_RESET, 0), ioctl(perf_cycles, PERF_EVENT_IOC_ENABLE, 0);
+	if (perf_instructions >= 0)
+		ioctl(perf_instructions, PERF_EVENT_IOC_RESET, 0), ioctl(perf_instructions, PERF_EVENT_IOC_ENABLE, 0);
+	#endif
+	m->ns = _now();
+}
+
+
+static void _measure_stop(struct Measure *m) {
+	m->ns = _now() - m->ns;
+	m->cycles = m->instructions = 0;
+	#ifdef __linux__
+	if (perf_cycles >= 0) {
+		ioctl(perf_cycles, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(perf_cycles, &m->cycles, sizeof(m->cycles)) != sizeof(m->cycles))
+			m->cycles = 0;
+	}
+	if (perf_instructions >= 0) {
+		ioctl(perf_instructions, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(perf_instructions, &m->instructions, sizeof(m->instructions)) != sizeof(m->instructions))
+			m->instructions = 0;
+	}
+	#endif
+}
+
+
+static void _report(const char *what, const char *kernel, int rate, int buffer, uint64_t frames, struct Measure *m) {
+	printf("%-20s %-16s %6i %5i %12.0f %9.2f", what, kernel, rate, buffer, frames * 1e9 / (m->ns ? m->ns : 1), (double) m->ns / frames);
+	if (m->cycles)
+		printf(" %9.2f %9.2f\n", (double) m->cycles / frames, (double) m->instructions / frames);
+	else
+		printf(" %9s %9s\n", "-", "-");
+}
+
+
+static void _wave_pull(void *ptr, int8_t *buff) {
+	(void) ptr;
+	memcpy(buff, wave, 1 << MA_SAMPLE_BUFFER_LEN);
+}
+
+
+/* The bare resampling kernels on a looping waveform, a C-3 voice at full volume */
+static void _bench_kernel(int kernel, int rate, int buffer, uint64_t frames) {
+	struct MAState ma;
+	struct MAMix mix;
+	struct Measure m;
+	int32_t *out;
+	uint8_t *out8;
+	uint64_t done;
+	int i;
+
+	out = calloc(buffer, sizeof(*out));
+	out8 = calloc(buffer, 2);
+	ma = ma_init(rate);
+	ma_set_callback(&ma, _wave_pull, NULL);
+	ma_set_samplerate(&ma, 16574);
+	ma_set_volume(&ma, 64);
+	mix = ma_mix_create(rate);
+	for (i = 0; i < MA_CHANNELS; i++) {
+		ma_set_callback(&mix.left[i], _wave_pull, NULL), ma_set_callback(&mix.right[i], _wave_pull, NULL);
+		ma_set_samplerate(&mix.left[i], 16574), ma_set_samplerate(&mix.right[i], 16574);
+		ma_set_volume(&mix.left[i], 64), ma_set_volume(&mix.right[i], 64);
+	}
+
+	_measure_start(&m);
+	for (done = 0; done < frames; done += buffer) {
+		if (kernel == KERNEL_MA_ADD)
+			ma_add(&ma, out, buffer);
+		else if (kernel == KERNEL_MA_ADD_FAST)
+			ma_add_fast(&ma, out, buffer);
+		else
+			ma_mix8(&mix, out8, buffer);
+	}
+	_measure_stop(&m);
+	_report("(kernel)", kernel_name[kernel], rate, buffer, done, &m);
+
+	free(out);
+	free(out8);
+}
+
+
+/* A whole player, repeating so every buffer does real work */
+static void _bench_player(const char *path, uint8_t *data, int len, int kernel, int rate, int buffer, uint64_t frames) {
+	struct RickmodState *rm;
+	struct Measure m;
+	const char *name;
+	uint64_t done;
+	void *out;
+
+	if (!(rm = rm_init(rate, data, len)))
+		return;
+	rm_repeat_set(rm, 1);
+	out = malloc(buffer * 4);
+
+	_measure_start(&m);
+	for (done = 0; done < frames; done += buffer) {
+		if (kernel == KERNEL_S16)
+			rm_mix_s16(rm, out, buffer);
+		else if (kernel == KERNEL_S16_FAST)
+			rm_mix_s16_fast(rm, out, buffer);
+		else
+			rm_mix_u8(rm, out, buffer);
+	}
+	_measure_stop(&m);
+
+	name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+	_report(name, kernel_name[kernel], rate, buffer, done, &m);
+	free(out);
+	rm_free(rm);
+}
+
+
+static uint8_t *_load(const char *path, int *len) {
+	uint8_t *data;
+	FILE *fp;
+
+	if (!(fp = fopen(path, "rb")))
+		return NULL;
+	fseek(fp, 0, SEEK_END);
+	*len = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	data = malloc(*len);
+	if (fread(data, 1, *len, fp) != (size_t) *len) {
+		free(data);
+		data = NULL;
+	}
+	fclose(fp);
+	return data;
+}
+
+
+int main(int argc, char **argv) {
+	int i, j, r, b, k, len;
+	double seconds = 10;
+	uint8_t *data;
+
+	for (i = 1; i < argc && argv[i][0] == '-'; i++)
+		if (!strcmp(argv[i], "-s") && i + 1 < argc)
+			seconds = atof(argv[++i]);
+	for (j = 0; j < 256; j++)
+		wave[j] = (j & 0x80) ? 100 - (j & 0x7F) : (j & 0x7F) - 28;
+
+	_perf_init();
+	if (perf_cycles < 0)
+		fprintf(stderr, "Hardware counters unavailable, reporting wall time only\n");
+	printf("%-20s %-16s %6s %5s %12s %9s %9s %9s\n", "module", "path", "rate", "buf", "frames/s", "ns/frame", "cyc/frame", "ins/frame");
+
+	for (r = 0; r < (int) (sizeof(rates) / sizeof(*rates)); r++)
+		for (b = 0; b < (int) (sizeof(buffers) / sizeof(*buffers)); b++)
+			for (k = KERNEL_MA_ADD; k <= KERNEL_MA_MIX8; k++)
+				_bench_kernel(k, rates[r], buffers[b], seconds * rates[r]);
+
+	for (; i < argc; i++) {
+		if (!(data = _load(argv[i], &len))) {
+			fprintf(stderr, "Unable to load %s\n", argv[i]);
+			continue;
+		}
+		for (r = 0; r < (int) (sizeof(rates) / sizeof(*rates)); r++)
+			for (b = 0; b < (int) (sizeof(buffers) / sizeof(*buffers)); b++)
+				for (k = KERNEL_S16; k <= KERNEL_U8; k++)
+					_bench_player(argv[i], data, len, k, rates[r], buffers[b], seconds * rates[r]);
+		free(data);
+	}
+
+	return 0;
+}
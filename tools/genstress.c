@@ -0,0 +1,361 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+/*
+ * Writes a 4 channel M.K. module that puts the player under as much load as the format allows.
+ * With "replay" after the seed the song starts with a pattern played four times over, from the second time on it starts
+ * from the same state, so the pattern memo replays it even when the song doesn't loop.
+ * With "s3m" it writes an 8 channel S3M instead, with every command, 8 and 16-bit samples at different c2spd.
+ */
+
+#define	PATTERNS 4
+#define	SAMPLE_LEN 16384
+
+static uint16_t periods[36] = {
+	856, 808, 762, 720, 678, 640, 604, 570, 538, 508, 480, 453,
+	428, 404, 381, 360, 339, 320, 302, 285, 269, 254, 240, 226,
+	214, 202, 190, 180, 170, 160, 151, 143, 135, 127, 120, 113,
+};
+
+static uint8_t mod[1084 + PATTERNS * 1024 + 31 * SAMPLE_LEN];
+static uint8_t s3m[0x20000];
+static uint32_t s3m_len;
+static uint32_t seed = 1;
+
+
+static uint32_t _random(void) {
+	seed = seed * 1103515245 + 12345;
+	return seed >> 16;
+}
+
+
+static void _put16(uint8_t *p, int v) {
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+
+static void _cell(int pattern, int row, int channel, int sample, int period, int effect) {
+	uint8_t *p = mod + 1084 + pattern * 1024 + row * 16 + channel * 4;
+
+	p[0] = (sample & 0xF0) | (period >> 8);
+	p[1] = period;
+	p[2] = ((sample & 0xF) << 4) | (effect >> 8);
+	p[3] = effect;
+}
+
+
+/* Short samples with tiny loops, long one shots and everything between, so refills and wraps happen constantly */
+static int _samples(uint8_t *data) {
+	int i, j, len, loop, total = 0;
+	uint8_t *p;
+
+	for (i = 0; i < 31; i++) {
+		p = mod + 20 + i * 30;
+		snprintf((char *) p, 22, "stress %i", i + 1);
+		if (i < 8)
+			len = 4 << i, loop = i < 4 ? 4 : len / 2;
+		else if (i < 24)
+			len = 256 << (i & 3), loop = (i & 4) ? len / 2 : 0;
+		else
+			len = SAMPLE_LEN, loop = i & 1 ? SAMPLE_LEN / 2 : 0;
+
+		for (j = 0; j < len; j++) {
+			if (i % 3 == 0)
+				data[j] = (j & 8) ? 0x7F : 0x80;
+			else if (i % 3 == 1)
+				data[j] = j * 7;
+			else
+				data[j] = _random();
+		}
+		data += len;
+		total += len;
+
+		_put16(p + 22, len / 2);
+		p[24] = i & 0xF;
+		p[25] = 64 - i;
+		_put16(p + 26, loop ? (len - loop) / 2 : 0);
+		_put16(p + 28, loop ? loop / 2 : 1);
+	}
+
+	return total;
+}
+
+
+/* Speed 1 at 255 BPM, notes on every row at the highest pitches, cycling through all samples */
+static void _pattern_speed(int pattern) {
+	int row, ch;
+
+	for (row = 0; row < 64; row++)
+		for (ch = 0; ch < 4; ch++)
+			_cell(pattern, row, ch, (row * 4 + ch) % 31 + 1, periods[35 - ((row + ch) & 3)], 0);
+	_cell(pattern, 0, 0, 1, periods[35], 0xF01);
+	_cell(pattern, 0, 1, 2, periods[35], 0xFFF);
+}
+
+
+/* Every effect and extended effect, each with a note so nothing runs on an unset period */
+static void _pattern_effects(int pattern) {
+	static const uint16_t effects[] = {
+		0x037, 0x103, 0x203, 0x310, 0x000, 0x448, 0x402, 0x500, 0x520, 0x600, 0x610,
+		0x748, 0x700, 0x902, 0xA0F, 0xAF0, 0xC20, 0xE01, 0xE11, 0xE21, 0xE31, 0xE41,
+		0xE51, 0xE60, 0xE71, 0xE81, 0xE93, 0xEA4, 0xEB4, 0xEC2, 0xED2, 0xEE1, 0xE62,
+		0xF03, 0xF7D, 0x423, 0x777, 0xE47, 0xE77, 0x0C7, 0x1FF, 0x2FF, 0x3FF,
+	};
+	int row, ch, i = 0;
+
+	for (row = 0; row < 64; row++)
+		for (ch = 0; ch < 4; ch++, i++)
+			_cell(pattern, row, ch, 25 + (i % 7), periods[(row * 5 + ch * 7) % 36], effects[i % (sizeof(effects) / sizeof(*effects))]);
+	_cell(pattern, 0, 0, 25, periods[12], 0xF06);
+	_cell(pattern, 63, 3, 25, periods[12], 0xD00);
+}
+
+
+/*
+ * Speed 2 at 215 BPM is 512 frames a tick at 44.1 kHz, exactly 65536 frames for the pattern.
+ * Each channel keeps one looped sample at one pitch, so every voice is back at the same resampler phase when it ends.
+ */
+static void _pattern_replay(int pattern) {
+	int row, ch;
+
+	for (row = 0; row < 64; row++)
+		for (ch = 0; ch < 4; ch++)
+			_cell(pattern, row, ch, ch * 2 + 1, periods[ch * 7 + 3], 0xC00 | ((row * 5 + ch * 16) & 0x3F));
+	_cell(pattern, 0, 0, 1, periods[3], 0xF02);
+	_cell(pattern, 0, 1, 3, periods[10], 0xFD7);
+}
+
+
+static void _pattern_dense(int pattern) {
+	int row, ch;
+
+	for (row = 0; row < 64; row++)
+		for (ch = 0; ch < 4; ch++)
+			_cell(pattern, row, ch, _random() % 31 + 1, periods[_random() % 36], (row & 1) ? 0x000 : 0x300 | (_random() & 0xFF));
+	_cell(pattern, 0, 0, 5, periods[0], 0xF02);
+	_cell(pattern, 0, 1, 6, periods[35], 0xF96);
+}
+
+
+static void _put16le(uint8_t *p, int v) {
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+
+static void _put32le(uint8_t *p, uint32_t v) {
+	_put16le(p, v);
+	_put16le(p + 2, v >> 16);
+}
+
+
+/* Everything in an S3M sits on a 16 byte paragraph */
+static uint32_t _s3m_para(void) {
+	s3m_len = (s3m_len + 15) & ~15;
+	return s3m_len / 16;
+}
+
+
+/* Packed cell, note 255 and vol 255 leave those out, cmd is the letter or 0 */
+static void _s3m_cell(int channel, int note, int ins, int vol, char cmd, int info) {
+	uint8_t *p = s3m + s3m_len++;
+
+	*p = channel;
+	if (note != 255 || ins)
+		*p |= 0x20, s3m[s3m_len++] = note, s3m[s3m_len++] = ins;
+	if (vol != 255)
+		*p |= 0x40, s3m[s3m_len++] = vol;
+	if (cmd)
+		*p |= 0x80, s3m[s3m_len++] = cmd - 'A' + 1, s3m[s3m_len++] = info;
+}
+
+
+/* Every command letter, including ones the engine has no equivalent for, and each S sub command */
+static void _s3m_pattern_effects(void) {
+	static const struct { char cmd; uint8_t info; } effects[] = {
+		{ 'A', 4 }, { 'D', 0x0F }, { 'D', 0xF0 }, { 'D', 0x4F }, { 'D', 0xF4 }, { 'D', 0x08 }, { 'E', 0xF3 }, { 'E', 0xE8 },
+		{ 'E', 0x10 }, { 'F', 0xF3 }, { 'F', 0xE8 }, { 'F', 0x10 }, { 'G', 0x20 }, { 'H', 0x48 }, { 'I', 0x22 }, { 'J', 0x37 },
+		{ 'K', 0x04 }, { 'L', 0x40 }, { 'O', 0x02 }, { 'Q', 0x03 }, { 'R', 0x44 }, { 'S', 0xC2 }, { 'S', 0xD1 }, { 'S', 0xE1 },
+		{ 'S', 0x80 }, { 'T', 0x90 }, { 'T', 0x10 }, { 'U', 0x11 }, { 'V', 0x40 }, { 'A', 0 }, { 'G', 0 }, { 'D', 0 },
+	};
+	uint32_t start = s3m_len;
+	int row, ch, i = 0;
+
+	s3m_len += 2;
+	for (row = 0; row < 64; row++) {
+		for (ch = 0; ch < 8; ch++, i++)
+			_s3m_cell(ch, (1 + (row + ch) % 6) << 4 | (row * 5 + ch) % 12, 1 + i % 5, (row & 3) ? 255 : (row + ch * 8) & 0x3F,
+				effects[i % (sizeof(effects) / sizeof(*effects))].cmd, effects[i % (sizeof(effects) / sizeof(*effects))].info);
+		s3m[s3m_len++] = 0;
+	}
+	_put16le(s3m + start, s3m_len - start);
+}
+
+
+/* Random notes over the octaves the engine folds, with note cuts, empty cells and the volume column */
+static void _s3m_pattern_dense(void) {
+	uint32_t start = s3m_len;
+	int row, ch, r;
+
+	s3m_len += 2;
+	for (row = 0; row < 64; row++) {
+		for (ch = 0; ch < 8; ch++) {
+			r = _random();
+			if (r % 7 == 0)
+				continue;
+			_s3m_cell(ch, r % 11 == 0 ? 254 : (r >> 4) % 8 << 4 | (r >> 8) % 12, 1 + (r >> 3) % 6, r % 3 ? 255 : (r >> 5) & 0x3F, 0, 0);
+		}
+		s3m[s3m_len++] = 0;
+	}
+	_put16le(s3m + start, s3m_len - start);
+}
+
+
+/* Nested pattern loops, SB0 marks the start on one channel, SB2 loops back twice, then a jump to the first order */
+static void _s3m_pattern_loop(void) {
+	uint32_t start = s3m_len;
+	int row, ch;
+
+	s3m_len += 2;
+	for (row = 0; row < 64; row++) {
+		for (ch = 0; ch < 8; ch += 2)
+			_s3m_cell(ch, (2 + ch / 2) << 4 | (row & 7), 1 + (row + ch) % 5, 255, 0, 0);
+		if (row == 8 || row == 40)
+			_s3m_cell(1, 255, 0, 255, 'S', 0xB0);
+		if (row == 15 || row == 47)
+			_s3m_cell(1, 255, 0, 255, 'S', 0xB2);
+		if (row == 63)
+			_s3m_cell(3, 255, 0, 255, 'B', 0);
+		s3m[s3m_len++] = 0;
+	}
+	_put16le(s3m + start, s3m_len - start);
+}
+
+
+static void _s3m(void) {
+	static const uint8_t orders[] = { 0, 254, 1, 2, 255, 255 };
+	static const uint8_t settings[] = { 0, 8, 1, 9, 16, 2, 10, 3, 11 };
+	static const struct { uint32_t length, loop_begin, loop_end, c2spd; uint8_t flags, type; } ins[] = {
+		{ 64, 0, 64, 8363, 1, 1 }, { 4096, 0, 0, 16726, 0, 1 }, { 2048, 1024, 2048, 22050, 5, 1 },
+		{ 1024, 256, 4000, 4000, 1, 1 }, { 8192, 0, 0, 8363, 4, 1 }, { 0, 0, 0, 8363, 0, 2 },
+	};
+	uint32_t ins_para[6], pat_para[3], i, j, width;
+	uint8_t *p;
+
+	memset(s3m, 0, sizeof(s3m));
+	strcpy((char *) s3m, "rickmod s3m stress");
+	s3m[28] = 0x1A;
+	s3m[29] = 16;
+	_put16le(s3m + 32, sizeof(orders));
+	_put16le(s3m + 34, 6);
+	_put16le(s3m + 36, 3);
+	_put16le(s3m + 40, 0x1320);
+	_put16le(s3m + 42, 2);
+	memcpy(s3m + 44, "SCRM", 4);
+	s3m[48] = 64;
+	s3m[49] = 3;
+	s3m[50] = 150;
+	s3m[51] = 0xB0;
+	memset(s3m + 64, 255, 32);
+	memcpy(s3m + 64, settings, sizeof(settings));
+	memcpy(s3m + 96, orders, sizeof(orders));
+	s3m_len = 96 + sizeof(orders) + 6 * 2 + 3 * 2;
+
+	for (i = 0; i < 6; i++) {
+		ins_para[i] = _s3m_para();
+		s3m_len += 80;
+	}
+	pat_para[0] = _s3m_para();
+	_s3m_pattern_effects();
+	pat_para[1] = _s3m_para();
+	_s3m_pattern_dense();
+	pat_para[2] = _s3m_para();
+	_s3m_pattern_loop();
+
+	/* Unsigned data, 16-bit samples are little endian and only their high byte is played */
+	for (i = 0; i < 6; i++) {
+		p = s3m + ins_para[i] * 16;
+		width = ins[i].flags & 4 ? 2 : 1;
+		p[0] = ins[i].type;
+		_put32le(p + 16, ins[i].length);
+		_put32le(p + 20, ins[i].loop_begin);
+		_put32le(p + 24, ins[i].loop_end);
+		p[28] = 48 + i * 3;
+		p[31] = ins[i].flags;
+		_put32le(p + 32, ins[i].c2spd);
+		snprintf((char *) p + 48, 28, "stress %u", i + 1);
+		memcpy(p + 76, "SCRS", 4);
+		if (!ins[i].length)
+			continue;
+		j = _s3m_para();
+		p[13] = j >> 16;
+		_put16le(p + 14, j);
+		for (j = 0; j < ins[i].length * width; j++)
+			s3m[s3m_len++] = i == 0 ? ((j & 16) ? 0xFF : 0) : i == 1 ? j * 3 : (j & 256) ? 0xFF - (j & 0xFF) : j & 0xFF;
+	}
+
+	for (i = 0; i < 6; i++)
+		_put16le(s3m + 96 + sizeof(orders) + i * 2, ins_para[i]);
+	for (i = 0; i < 3; i++)
+		_put16le(s3m + 96 + sizeof(orders) + 12 + i * 2, pat_para[i]);
+}
+
+
+int main(int argc, char **argv) {
+	FILE *fp;
+	int len, ch;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <out.mod> [seed [replay|s3m]]\n", argv[0]);
+		return 1;
+	}
+	if (argc > 2)
+		seed = strtoul(argv[2], NULL, 0);
+
+	if (argc > 3 && !strcmp(argv[3], "s3m")) {
+		_s3m();
+		if (!(fp = fopen(argv[1], "wb"))) {
+			fprintf(stderr, "Unable to open %s\n", argv[1]);
+			return 1;
+		}
+		fwrite(s3m, 1, s3m_len, fp);
+		fclose(fp);
+		return 0;
+	}
+
+	memset(mod, 0, sizeof(mod));
+	strcpy((char *) mod, "rickmod stress");
+	len = _samples(mod + 1084 + PATTERNS * 1024);
+	if (argc > 3 && !strcmp(argv[3], "replay"))
+		_pattern_replay(0);
+	else
+		_pattern_speed(0);
+	_pattern_effects(1);
+	_pattern_dense(2);
+	_pattern_speed(3);
+	/* Ends by jumping back to the start */
+	for (ch = 0; ch < 4; ch++)
+		_cell(3, 63, ch, 1, periods[35], ch ? 0 : 0xB00);
+
+	mod[951] = 127;
+	if (argc > 3 && !strcmp(argv[3], "replay")) {
+		mod[950] = 9;
+		memcpy(mod + 952, (uint8_t[]) { 0, 0, 0, 0, 1, 2, 1, 2, 3 }, 9);
+	} else {
+		mod[950] = 6;
+		memcpy(mod + 952, (uint8_t[]) { 0, 1, 2, 1, 2, 3 }, 6);
+	}
+	memcpy(mod + 1080, "M.K.", 4);
+
+	if (!(fp = fopen(argv[1], "wb"))) {
+		fprintf(stderr, "Unable to open %s\n", argv[1]);
+		return 1;
+	}
+	fwrite(mod, 1, 1084 + PATTERNS * 1024 + len, fp);
+	fclose(fp);
+
+	return 0;
+}
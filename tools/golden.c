@@ -0,0 +1,492 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+
+#include "rickmod.h"
+
+/*
+ * Golden render regression check, usage: golden [-u] [-p pcmdir] [-t min_snr_db] sumfile module...
+ * Every module is rendered through every output path and compared with the hashes in sumfile, -u rewrites them.
+ * With -p the reference PCM is kept too, so a mismatch can be pinned to its first frame and channel.
+ * Optional player features must not change a single sample, and the fast path must stay close to the HQ one.
+ * The memo has to replay something somewhere in the set, looped and not, and stay bit exact doing it.
+ * The budget governor and sound effects change the output on purpose, they are hashed as paths of their own.
+ */
+
+#define	RATE 44100
+#define	CHUNK 1024
+#define	MAX_FRAMES (RATE * 180)
+
+#define	VARIANT_PLAIN 0
+#define	VARIANT_MEMO 1
+#define	VARIANT_TAPS 2
+#define	VARIANT_EVENTS 3
+#define	VARIANT_COMPILED 4
+#define	VARIANT_POOL 5
+#define	VARIANTS_EXACT 6 // The ones above have to match plain bit for bit
+#define	VARIANT_BUDGET 6
+#define	VARIANT_SFX 7
+
+static const char *path_name[] = { "s16", "s16_fast", "u8", "s16_mono" };
+static const char *variant_name[] = { "plain", "memo", "taps", "events", "compiled", "pool", "budget", "sfx" };
+
+
+struct Golden {
+	char			module[256];
+	char			path[16];
+	uint32_t		frames;
+	uint64_t		hash;
+};
+
+
+struct Render {
+	uint8_t			*data;
+	uint32_t		frames;
+	int			frame_size;
+	int			channels;
+	uint64_t		replays;
+	uint32_t		degraded;
+	uint32_t		sfx_played;
+};
+
+
+static struct Golden *golden;
+static int goldens;
+static int update, failures;
+static uint64_t replays, looped_replays;
+static const char *pcm_dir;
+static double min_snr = 5, max_level = 1;
+static int8_t sfx_data[4096];
+
+
+static uint64_t _fnv(const void *data, uint32_t len) {
+	const uint8_t *p = data;
+	uint64_t h = 0xCBF29CE484222325ULL;
+
+	while (len--)
+		h = (h ^ *p++) * 0x100000001B3ULL;
+	return h;
+}
+
+
+static const char *_basename(const char *path) {
+	return strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+}
+
+
+/*
+ * A one-shot of raw data in the centre, a module sample on the left, and a looped voice that starts silent.
+ * The silent one is only moved along until it is turned up, so where it is heard from depends on the skip kernels.
+ */
+static void _sfx(struct RickmodState *rm, uint32_t chunk, uint32_t *id) {
+	struct RickmodSfxParams params;
+
+	memset(&params, 0, sizeof(params));
+	if (chunk == 8) {
+		params.data = sfx_data, params.length = sizeof(sfx_data);
+		params.rate = 22050, params.volume = 64, params.pan = 128;
+		id[0] = rm_sfx_play(rm, &params);
+	} else if (chunk == 16) {
+		params.sample = 1, params.volume = 48;
+		id[1] = rm_sfx_play(rm, &params);
+	} else if (chunk == 24) {
+		params.data = sfx_data, params.length = sizeof(sfx_data), params.repeat = 1024, params.repeat_length = 2048;
+		params.rate = 11025, params.pan = 255;
+		id[2] = rm_sfx_play(rm, &params);
+	} else if (chunk == 64)
+		rm_sfx_volume(rm, id[2], 40, 255);
+	else if (chunk == 96)
+		rm_sfx_stop(rm, id[1]);
+	else if (chunk == 128)
+		rm_sfx_stop(rm, id[2]);
+}
+
+
+static int _render(uint8_t *mod, int mod_len, int path, int variant, int repeat, struct Render *out) {
+	struct RickmodMemoStats memo;
+	struct RickmodSfxStats sfx;
+	struct RickmodState *rm, *other = NULL;
+	struct RickmodEvent event;
+	uint32_t alloc = 0, image_len, chunk = 0, id[3] = { 0 };
+	uint8_t *tmp, *image = NULL;
+
+	memset(out, 0, sizeof(*out));
+	out->channels = path == RM_RENDER_S16_MONO ? 1 : 2;
+	out->frame_size = path == RM_RENDER_U8 || path == RM_RENDER_S16_MONO ? 2 : 4;
+	if (variant == VARIANT_COMPILED) {
+		if (!rm_compile(mod, mod_len, &image, &image_len))
+			return 0;
+		mod = image, mod_len = image_len;
+	}
+	/* Shared players play from a copy that is wiped once they share, a protracker module doesn't need it any more */
+	if (variant == VARIANT_POOL) {
+		if (!(image = malloc(mod_len)))
+			return 0;
+		memcpy(image, mod, mod_len);
+		mod = image;
+		if ((other = rm_init(RATE, mod, mod_len)) && !rm_pool_share(other)) {
+			rm_free(other);
+			other = NULL;
+		}
+	}
+	if (!(rm = rm_init(RATE, mod, mod_len))) {
+		if (other)
+			rm_free(other);
+		free(image);
+		return 0;
+	}
+	if (variant == VARIANT_MEMO)
+		rm_memo_set(rm, 64 << 20);
+	else if (variant == VARIANT_TAPS)
+		rm_taps_set(rm, 1024, 1, 0);
+	else if (variant == VARIANT_EVENTS)
+		rm_events_set(rm, 256);
+	else if (variant == VARIANT_BUDGET)
+		rm_budget_set(rm, 1); // Nothing mixes in a nanosecond a frame, every voice ends up on the nearest tier
+	else if (variant == VARIANT_SFX)
+		rm_sfx_set(rm, 4);
+	else if (variant == VARIANT_POOL) {
+		if (!other || !rm_pool_share(rm)) {
+			if (other)
+				rm_free(other);
+			rm_free(rm);
+			free(image);
+			return 0;
+		}
+		if (rm->format == RM_FORMAT_MOD)
+			memset(image, 0x55, mod_len);
+	}
+	rm_repeat_set(rm, repeat);
+
+	while (!rm_end_reached(rm) && out->frames < MAX_FRAMES) {
+		if ((out->frames + CHUNK) * out->frame_size > alloc) {
+			alloc = alloc ? alloc * 2 : (uint32_t) CHUNK * out->frame_size * 256;
+			if (!(tmp = realloc(out->data, alloc))) {
+				if (other)
+					rm_free(other);
+				rm_free(rm);
+				free(image);
+				return 0;
+			}
+			out->data = tmp;
+		}
+		if (variant == VARIANT_SFX)
+			_sfx(rm, chunk++, id);
+		if (path == RM_RENDER_S16)
+			rm_mix_s16(rm, (int16_t *) (out->data + out->frames * out->frame_size), CHUNK);
+		else if (path == RM_RENDER_S16_FAST)
+			rm_mix_s16_fast(rm, (int16_t *) (out->data + out->frames * out->frame_size), CHUNK);
+		else if (path == RM_RENDER_U8)
+			rm_mix_u8(rm, out->data + out->frames * out->frame_size, CHUNK);
+		else
+			rm_mix_s16_mono(rm, (int16_t *) (out->data + out->frames * out->frame_size), CHUNK);
+		out->frames += CHUNK;
+		while (rm_event_read(rm, &event));
+	}
+
+	rm_memo_stats(rm, &memo);
+	out->replays = memo.replays;
+	out->degraded = rm_budget_degraded(rm);
+	rm_sfx_stats(rm, &sfx);
+	out->sfx_played = sfx.played;
+	if (other)
+		rm_free(other);
+	rm_free(rm);
+	free(image);
+	return 1;
+}
+
+
+/* Returns the first differing frame, or -1, channel is 0 for left or mono and 1 for right */
+static int64_t _diverge(struct Render *a, uint8_t *b, uint32_t b_frames, int *channel) {
+	uint32_t i, frames = a->frames < b_frames ? a->frames : b_frames;
+	int half = a->frame_size / 2;
+
+	for (i = 0; i < frames; i++)
+		if (memcmp(a->data + i * a->frame_size, b + i * a->frame_size, a->frame_size)) {
+			*channel = a->channels == 1 || memcmp(a->data + i * a->frame_size, b + i * a->frame_size, half) ? 0 : 1;
+			return i;
+		}
+	if (a->frames != b_frames)
+		return *channel = 0, frames;
+	return -1;
+}
+
+
+static void _fail(const char *module, const char *path, const char *what, int64_t frame, int channel) {
+	failures++;
+	if (frame < 0)
+		printf("FAIL %s %s: %s\n", module, path, what);
+	else
+		printf("FAIL %s %s: %s, first divergence at frame %lli (%.3f s), %s channel\n", module, path, what,
+			(long long) frame, (double) frame / RATE, !strcmp(path, "s16_mono") ? "mono" : channel ? "right" : "left");
+}
+
+
+static struct Golden *_find(const char *module, const char *path) {
+	int i;
+
+	for (i = 0; i < goldens; i++)
+		if (!strcmp(golden[i].module, module) && !strcmp(golden[i].path, path))
+			return &golden[i];
+	return NULL;
+}
+
+
+static void _pcm_name(char *name, int len, const char *module, const char *path) {
+	snprintf(name, len, "%s/%s.%s.raw", pcm_dir, module, path);
+}
+
+
+static void _check_reference(const char *module, const char *path, struct Render *r) {
+	struct Golden *g;
+	uint64_t hash = _fnv(r->data, r->frames * r->frame_size);
+	uint8_t *ref;
+	char name[4096];
+	int64_t frame;
+	long len;
+	int channel;
+	FILE *fp;
+
+	if (update) {
+		if (!(g = _find(module, path))) {
+			golden = realloc(golden, sizeof(*golden) * (goldens + 1));
+			g = &golden[goldens++];
+			snprintf(g->module, sizeof(g->module), "%s", module);
+			snprintf(g->path, sizeof(g->path), "%s", path);
+		}
+		g->frames = r->frames, g->hash = hash;
+		if (pcm_dir) {
+			_pcm_name(name, sizeof(name), module, path);
+			if ((fp = fopen(name, "wb"))) {
+				fwrite(r->data, r->frame_size, r->frames, fp);
+				fclose(fp);
+			}
+		}
+		return;
+	}
+
+	if (!(g = _find(module, path)))
+		return _fail(module, path, "no golden hash", -1, 0);
+	if (g->hash == hash && g->frames == r->frames)
+		return;
+
+	/* Pin it down against the stored PCM when there is some */
+	if (pcm_dir) {
+		_pcm_name(name, sizeof(name), module, path);
+		if ((fp = fopen(name, "rb"))) {
+			fseek(fp, 0, SEEK_END);
+			len = ftell(fp);
+			fseek(fp, 0, SEEK_SET);
+			ref = malloc(len);
+			if (fread(ref, 1, len, fp) == (size_t) len) {
+				frame = _diverge(r, ref, len / r->frame_size, &channel);
+				fclose(fp);
+				free(ref);
+				return _fail(module, path, "differs from the reference PCM", frame, channel);
+			}
+			fclose(fp);
+			free(ref);
+		}
+	}
+	_fail(module, path, "hash differs from golden", -1, 0);
+}
+
+
+/*
+ * Fast and HQ differ in interpolation and stereo crossfeed, so they are compared on their mid signal.
+ * Nearest neighbour is far from linear on noise at high pitches, the stress corpus measures 5.7 to 6.0 dB.
+ * The floor sits just under that, and modules with more high pitched content can need a lower one with -t.
+ * The level has to match closely.
+ */
+static void _check_tiers(const char *module, struct Render *hq, struct Render *fast) {
+	int16_t *h = (int16_t *) hq->data, *f = (int16_t *) fast->data;
+	double power_h = 0, power_f = 0, noise = 0, mid_h, mid_f, snr, level;
+	uint32_t i, frames = hq->frames < fast->frames ? hq->frames : fast->frames;
+	char what[64];
+
+	for (i = 0; i < frames; i++) {
+		/* ma_add_fast voices are half as loud and s16_fast doesn't halve the mix, so the levels match */
+		mid_h = h[i * 2] + h[i * 2 + 1];
+		mid_f = f[i * 2] + f[i * 2 + 1];
+		power_h += mid_h * mid_h;
+		power_f += mid_f * mid_f;
+		noise += (mid_h - mid_f) * (mid_h - mid_f);
+	}
+	if (!power_h && !power_f)
+		return;
+
+	snr = noise ? 10 * log10(power_h / noise) : 999;
+	level = power_h && power_f ? 10 * log10(power_f / power_h) : 999;
+	if (snr < min_snr) {
+		snprintf(what, sizeof(what), "fast tier SNR %.1f dB below %.1f dB", snr, min_snr);
+		_fail(module, "s16_fast", what, -1, 0);
+	}
+	if (fabs(level) > max_level) {
+		snprintf(what, sizeof(what), "fast tier level off by %.1f dB", level);
+		_fail(module, "s16_fast", what, -1, 0);
+	}
+}
+
+
+/* Replays only happen once the state at a pattern comes round again, which takes a song that loops */
+static void _check_looped(const char *module, uint8_t *mod, int mod_len) {
+	struct Render plain, memo;
+	int64_t frame;
+	int channel;
+
+	if (!_render(mod, mod_len, RM_RENDER_S16, VARIANT_PLAIN, 1, &plain))
+		return;
+	if (_render(mod, mod_len, RM_RENDER_S16, VARIANT_MEMO, 1, &memo)) {
+		if ((frame = _diverge(&plain, memo.data, memo.frames, &channel)) >= 0)
+			_fail(module, "s16", "looped memo is not bit exact", frame, channel);
+		looped_replays += memo.replays;
+		free(memo.data);
+	}
+	free(plain.data);
+}
+
+
+/* Hashed as a path of its own, budget only drives rm_mix_s16 and sfx are mixed with the kernel of the path */
+static void _check_variant(const char *module, int path, int variant, uint8_t *mod, int mod_len) {
+	struct Render r;
+	char name[16];
+
+	snprintf(name, sizeof(name), "%s_%s", path_name[path], variant_name[variant]);
+	if (!_render(mod, mod_len, path, variant, 0, &r))
+		return _fail(module, name, "render failed", -1, 0);
+	_check_reference(module, name, &r);
+	if (variant == VARIANT_BUDGET && !r.degraded)
+		_fail(module, name, "the governor never degraded a voice", -1, 0);
+	if (variant == VARIANT_SFX && r.sfx_played != 3)
+		_fail(module, name, "not every sound effect played", -1, 0);
+	free(r.data);
+}
+
+
+static void _check_module(const char *path, uint8_t *mod, int mod_len) {
+	struct Render plain[4], variant;
+	const char *module = _basename(path);
+	char what[64];
+	int64_t frame;
+	int p, v, channel;
+
+	for (p = RM_RENDER_S16; p <= RM_RENDER_S16_MONO; p++) {
+		if (!_render(mod, mod_len, p, VARIANT_PLAIN, 0, &plain[p])) {
+			_fail(module, path_name[p], "render failed", -1, 0);
+			return;
+		}
+		_check_reference(module, path_name[p], &plain[p]);
+		for (v = VARIANT_PLAIN + 1; v < VARIANTS_EXACT && !update; v++) {
+			if (!_render(mod, mod_len, p, v, 0, &variant))
+				continue;
+			if ((frame = _diverge(&plain[p], variant.data, variant.frames, &channel)) >= 0) {
+				snprintf(what, sizeof(what), "%s is not bit exact", variant_name[v]);
+				_fail(module, path_name[p], what, frame, channel);
+			}
+			replays += variant.replays;
+			free(variant.data);
+		}
+	}
+
+	_check_variant(module, RM_RENDER_S16, VARIANT_BUDGET, mod, mod_len);
+	_check_variant(module, RM_RENDER_S16, VARIANT_SFX, mod, mod_len);
+	_check_variant(module, RM_RENDER_S16_FAST, VARIANT_SFX, mod, mod_len);
+	if (!update)
+		_check_tiers(module, &plain[RM_RENDER_S16], &plain[RM_RENDER_S16_FAST]);
+	printf("%s %s\n", update ? "updated" : "checked", module);
+	for (p = RM_RENDER_S16; p <= RM_RENDER_S16_MONO; p++)
+		free(plain[p].data);
+	if (!update)
+		_check_looped(module, mod, mod_len);
+}
+
+
+static void _load_golden(const char *path) {
+	char line[512], module[256], name[16];
+	unsigned long long hash;
+	unsigned frames;
+	FILE *fp;
+
+	if (!(fp = fopen(path, "r")))
+		return;
+	while (fgets(line, sizeof(line), fp)) {
+		if (line[0] == '#' || sscanf(line, "%255s %15s %u %llx", module, name, &frames, &hash) != 4)
+			continue;
+		golden = realloc(golden, sizeof(*golden) * (goldens + 1));
+		memset(&golden[goldens], 0, sizeof(*golden));
+		strcpy(golden[goldens].module, module);
+		strcpy(golden[goldens].path, name);
+		golden[goldens].frames = frames;
+		golden[goldens].hash = hash;
+		goldens++;
+	}
+	fclose(fp);
+}
+
+
+static int _save_golden(const char *path) {
+	FILE *fp;
+	int i;
+
+	if (!(fp = fopen(path, "w")))
+		return 0;
+	fprintf(fp, "# module path frames fnv1a64, %i Hz in %i frame chunks, regenerate with make golden-update\n", RATE, CHUNK);
+	for (i = 0; i < goldens; i++)
+		fprintf(fp, "%s %s %u %.16llx\n", golden[i].module, golden[i].path, golden[i].frames, (unsigned long long) golden[i].hash);
+	return !fclose(fp);
+}
+
+
+int main(int argc, char **argv) {
+	const char *sumfile;
+	uint8_t *data;
+	long len;
+	FILE *fp;
+	int i;
+
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if (!strcmp(argv[i], "-u"))
+			update = 1;
+		else if (!strcmp(argv[i], "-p") && i + 1 < argc)
+			pcm_dir = argv[++i];
+		else if (!strcmp(argv[i], "-t") && i + 1 < argc)
+			min_snr = atof(argv[++i]);
+	}
+	if (i >= argc) {
+		fprintf(stderr, "Usage: %s [-u] [-p pcmdir] [-t min_snr_db] sumfile module...\n", argv[0]);
+		return 1;
+	}
+	sumfile = argv[i++];
+	_load_golden(sumfile);
+	for (len = 0; len < (long) sizeof(sfx_data); len++)
+		sfx_data[len] = (len & 63) < 32 ? len * 4 : -len * 4;
+
+	for (; i < argc; i++) {
+		if (!(fp = fopen(argv[i], "rb"))) {
+			_fail(_basename(argv[i]), "-", "unable to open", -1, 0);
+			continue;
+		}
+		fseek(fp, 0, SEEK_END);
+		len = ftell(fp);
+		fseek(fp, 0, SEEK_SET);
+		data = malloc(len);
+		if (fread(data, 1, len, fp) == (size_t) len)
+			_check_module(argv[i], data, len);
+		else
+			_fail(_basename(argv[i]), "-", "short read", -1, 0);
+		fclose(fp);
+		free(data);
+	}
+
+	if (update)
+		return !_save_golden(sumfile);
+	if (!replays)
+		_fail("-", "-", "the memo never replayed", -1, 0);
+	if (!looped_replays)
+		_fail("-", "s16", "the memo never replayed a looped module", -1, 0);
+	printf("%i failure%s\n", failures, failures == 1 ? "" : "s");
+	return failures != 0;
+}
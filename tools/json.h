@@ -0,0 +1,41 @@
+#ifndef RICKMOD_TOOLS_JSON_H__
+#define	RICKMOD_TOOLS_JSON_H__
+
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+
+static inline void json_append(char *out, size_t size, size_t *len, const char *piece, int n) {
+	if (*len + n < size)
+		memcpy(out + *len, piece, n);
+	*len += n;
+}
+
+
+/*
+ * Quotes s into out like snprintf(), returning the length it needs, zero terminated only if that fits in size.
+ * Module names are Latin-1 more often than not, paths are passed through as they are.
+ */
+static inline size_t json_quote(char *out, size_t size, const char *s, int latin1) {
+	const uint8_t *p = (const uint8_t *) s;
+	size_t len = 0;
+	char piece[8];
+
+	json_append(out, size, &len, "\"", 1);
+	for (; *p; p++) {
+		if (*p == '"' || *p == '\\')
+			json_append(out, size, &len, piece, snprintf(piece, sizeof(piece), "\\%c", *p));
+		else if (*p < 0x20 || *p == 0x7F || (latin1 && *p >= 0x80))
+			json_append(out, size, &len, piece, snprintf(piece, sizeof(piece), "\\u%.4x", *p));
+		else
+			json_append(out, size, &len, (const char *) p, 1);
+	}
+	json_append(out, size, &len, "\"", 1);
+	if (len < size)
+		out[len] = 0;
+	return len;
+}
+
+#endif
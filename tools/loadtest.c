@@ -0,0 +1,231 @@
+#define	_GNU_SOURCE
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "rickmod.h"
+
+/*
+ * N players spread over M threads, every player pulls one buffer per buffer period like an audio callback would.
+ * usage: loadtest [-n 1,8,32] [-t threads] [-b buffer] [-r rate] [-d seconds] module...
+ */
+
+struct Player {
+	struct RickmodState	*rm;
+	int16_t			*buff;
+};
+
+
+struct Worker {
+	pthread_t		thread;
+	struct Player		*player;
+	int			players;
+
+	uint64_t		*latency; // ns per callback
+	uint64_t		callbacks;
+	uint64_t		misses;
+	uint64_t		busy_ns;
+};
+
+
+static int buffer = 512, rate = 44100, threads = 1;
+static double duration = 10;
+static uint64_t period_ns, start_ns;
+static uint64_t periods;
+
+
+static uint64_t _now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static void _sleep_until(uint64_t ns) {
+	struct timespec ts;
+
+	ts.tv_sec = ns / 1000000000ULL;
+	ts.tv_nsec = ns % 1000000000ULL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL));
+}
+
+
+static long _resident(void) {
+	long size, resident = 0;
+	FILE *fp;
+
+	if (!(fp = fopen("/proc/self/statm", "r")))
+		return 0;
+	if (fscanf(fp, "%li %li", &size, &resident) != 2)
+		resident = 0;
+	fclose(fp);
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+
+/* A callback that finishes after the start of the next period would have caused a dropout */
+static void *_worker(void *data) {
+	struct Worker *w = data;
+	uint64_t p, deadline, t0, t1;
+	int i;
+
+	for (p = 0; p < periods; p++) {
+		deadline = start_ns + (p + 1) * period_ns;
+		_sleep_until(start_ns + p * period_ns);
+		for (i = 0; i < w->players; i++) {
+			t0 = _now();
+			rm_mix_s16(w->player[i].rm, w->player[i].buff, buffer);
+			t1 = _now();
+			w->latency[w->callbacks++] = t1 - t0;
+			w->busy_ns += t1 - t0;
+			if (t1 > deadline)
+				w->misses++;
+		}
+	}
+
+	return NULL;
+}
+
+
+static int _cmp(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+
+static double _percentile(uint64_t *sorted, uint64_t count, double p) {
+	uint64_t i = p * (count - 1);
+
+	return sorted[i] / 1000.0;
+}
+
+
+static void _run(int n, uint8_t **module, int *module_len, int modules) {
+	struct Player *player;
+	struct Worker *worker;
+	uint64_t *all, count = 0, misses = 0, busy = 0;
+	long before, after;
+	int i, t;
+
+	before = _resident();
+	player = calloc(n, sizeof(*player));
+	for (i = 0; i < n; i++) {
+		if (!(player[i].rm = rm_init(rate, module[i % modules], module_len[i % modules]))) {
+			fprintf(stderr, "Unable to load module %i\n", i % modules);
+			exit(1);
+		}
+		rm_repeat_set(player[i].rm, 1);
+		player[i].buff = calloc(buffer, 4);
+	}
+	after = _resident();
+
+	period_ns = (uint64_t) buffer * 1000000000ULL / rate;
+	periods = duration * 1000000000.0 / period_ns;
+	worker = calloc(threads, sizeof(*worker));
+	for (t = 0; t < threads; t++) {
+		/* Contiguous slices, the first n % threads workers take one extra */
+		worker[t].players = n / threads + (t < n % threads);
+		worker[t].player = player + t * (n / threads) + (t < n % threads ? t : n % threads);
+		worker[t].latency = malloc(sizeof(uint64_t) * (periods * worker[t].players + 1));
+	}
+
+	start_ns = _now() + 10000000;
+	for (t = 0; t < threads; t++)
+		pthread_create(&worker[t].thread, NULL, _worker, &worker[t]);
+	for (t = 0; t < threads; t++)
+		pthread_join(worker[t].thread, NULL);
+
+	all = malloc(sizeof(uint64_t) * (periods * n + 1));
+	for (t = 0; t < threads; t++) {
+		memcpy(all + count, worker[t].latency, worker[t].callbacks * sizeof(uint64_t));
+		count += worker[t].callbacks;
+		misses += worker[t].misses;
+		busy += worker[t].busy_ns;
+		free(worker[t].latency);
+	}
+	qsort(all, count, sizeof(*all), _cmp);
+
+	/* Realtime factor is audio rendered per second of CPU spent rendering */
+	printf("%6i %4i %9.1f %9.1f %9.1f %9.1f %10.1f %8llu %7.3f%% %10li\n", n, threads,
+		_percentile(all, count, 0.5), _percentile(all, count, 0.99), _percentile(all, count, 0.999), all[count - 1] / 1000.0,
+		(double) count * buffer / rate / (busy / 1e9), (unsigned long long) misses, 100.0 * misses / count, (after - before) / n);
+
+	for (i = 0; i < n; i++) {
+		rm_free(player[i].rm);
+		free(player[i].buff);
+	}
+	free(player);
+	free(worker);
+	free(all);
+}
+
+
+static uint8_t *_load(const char *path, int *len) {
+	uint8_t *data;
+	FILE *fp;
+
+	if (!(fp = fopen(path, "rb")))
+		return NULL;
+	fseek(fp, 0, SEEK_END);
+	*len = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	data = malloc(*len);
+	if (fread(data, 1, *len, fp) != (size_t) *len) {
+		free(data);
+		data = NULL;
+	}
+	fclose(fp);
+	return data;
+}
+
+
+int main(int argc, char **argv) {
+	const char *counts = "1,2,4,8,16,32,64";
+	uint8_t **module;
+	int *module_len, modules = 0, i, n;
+	char *p, *list;
+
+	for (i = 1; i < argc && argv[i][0] == '-' && i + 1 < argc; i += 2) {
+		if (!strcmp(argv[i], "-n"))
+			counts = argv[i + 1];
+		else if (!strcmp(argv[i], "-t"))
+			threads = atoi(argv[i + 1]);
+		else if (!strcmp(argv[i], "-b"))
+			buffer = atoi(argv[i + 1]);
+		else if (!strcmp(argv[i], "-r"))
+			rate = atoi(argv[i + 1]);
+		else if (!strcmp(argv[i], "-d"))
+			duration = atof(argv[i + 1]);
+	}
+	if (i == argc || threads < 1 || buffer < 1 || rate < 1) {
+		fprintf(stderr, "Usage: %s [-n 1,8,32] [-t threads] [-b buffer] [-r rate] [-d seconds] module...\n", argv[0]);
+		return 1;
+	}
+
+	module = calloc(argc - i, sizeof(*module));
+	module_len = calloc(argc - i, sizeof(*module_len));
+	for (; i < argc; i++) {
+		if (!(module[modules] = _load(argv[i], &module_len[modules]))) {
+			fprintf(stderr, "Unable to load %s\n", argv[i]);
+			return 1;
+		}
+		modules++;
+	}
+
+	printf("%i Hz, %i frame buffers (%.2f ms), %.1f s per run\n", rate, buffer, buffer * 1000.0 / rate, duration);
+	printf("%6s %4s %9s %9s %9s %9s %10s %8s %8s %10s\n", "n", "thr", "p50 us", "p99 us", "p99.9 us", "max us", "realtime", "misses", "miss", "bytes/inst");
+	list = strdup(counts);
+	for (p = strtok(list, ","); p; p = strtok(NULL, ","))
+		if ((n = atoi(p)) > 0)
+			_run(n, module, module_len, modules);
+	free(list);
+
+	return 0;
+}
@@ -0,0 +1,804 @@
+#define	_GNU_SOURCE
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "rickmod.h"
+#include "json.h"
+
+/*
+ * Render daemon on a UNIX socket, usage: rickmodd [-j threads] [-q depth] [-c per client] [-m cache MB] socket
+ * A connection carries one request line, "job [key=value]... path", and gets one status line back:
+ *	render [rate=44100] [format=s16|s16_fast|u8|mono] [frames=0] [repeat=0] path
+ *		"ok rate=... format=... frame_size=..." and then PCM as it is rendered until the connection closes
+ *	probe path		"ok" and the module as one JSON object
+ *	analyze path		"ok" and the duration, peak, rms and a 10 Hz overview as one JSON object
+ *	snapshot path		"ok size=..." and the compiled image, rm_init() and rm_open_file() play it without parsing
+ *	stats			"ok" and the daemon's counters, answered without queueing
+ * "busy queue" and "busy quota" ask the client to come back later, "error ..." means the job can't be done.
+ * Modules are compiled once and kept in an LRU cache, a changed file is recompiled on its next job.
+ */
+
+#define	REQUEST_MAX 4096
+#define	RENDER_CHUNK 1024
+#define	MAX_FILE (64 << 20)
+#define	MAX_CLIENTS 256
+#define	MAX_PENDING 256 // Connections still sending their request
+#define	RECV_TIMEOUT 5 // Seconds a client gets to send its request
+#define	SEND_TIMEOUT 30 // Seconds a stalled reader can hold a worker
+#define	ANALYZE_RATE 8000
+#define	ANALYZE_MAX_FRAMES (ANALYZE_RATE * 3600)
+
+#define	JOB_RENDER 0
+#define	JOB_PROBE 1
+#define	JOB_ANALYZE 2
+#define	JOB_SNAPSHOT 3
+
+
+struct Job {
+	int			fd;
+	uid_t			uid;
+	int			type;
+	struct RickmodRenderParams params;
+	char			path[REQUEST_MAX];
+};
+
+
+/* A connection the acceptor is still reading the request line of */
+struct Pending {
+	int			fd;
+	int			len;
+	int64_t			deadline; // Monotonic ms
+	char			line[REQUEST_MAX];
+};
+
+
+/* A compiled module, shared by every job that plays it and only freed once none does */
+struct Module {
+	char			*path;
+	off_t			size;
+	struct timespec		mtime;
+	uint8_t			*image;
+	uint32_t		image_len;
+	int			refs;
+	int			stale; // Replaced by a newer compile, freed when the last job lets go
+	struct Module		*prev;
+	struct Module		*next;
+};
+
+
+static struct {
+	struct Job		**job;
+	uint32_t		depth;
+	uint32_t		head; // Slot the next job goes in
+	uint32_t		tail; // Slot the next job is taken from
+	uint32_t		queued;
+	pthread_mutex_t		lock;
+	pthread_cond_t		not_empty;
+} queue = { .lock = PTHREAD_MUTEX_INITIALIZER, .not_empty = PTHREAD_COND_INITIALIZER };
+
+/* Jobs queued or running per uid, protected by the queue lock */
+static struct {
+	uid_t			uid;
+	uint32_t		jobs;
+} client[MAX_CLIENTS];
+static uint32_t quota;
+
+/* Most recently used first */
+static struct {
+	struct Module		*head;
+	struct Module		*tail;
+	uint64_t		bytes;
+	uint64_t		max_bytes;
+	pthread_mutex_t		lock;
+} cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static struct {
+	uint64_t		accepted;
+	uint64_t		done;
+	uint64_t		failed;
+	uint64_t		busy;
+	uint64_t		hits;
+	uint64_t		misses;
+} stats;
+
+static struct Pending *pending[MAX_PENDING];
+static int pendings;
+
+static volatile sig_atomic_t stop;
+
+
+static void _count(uint64_t *counter) {
+	__atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+}
+
+
+static uint64_t _load(uint64_t *counter) {
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+
+static int _send_all(int fd, const void *data, size_t len) {
+	const uint8_t *p = data;
+	ssize_t n;
+
+	while (len) {
+		if ((n = send(fd, p, len, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return 0;
+		p += n;
+		len -= n;
+	}
+	return 1;
+}
+
+
+static int _reply(int fd, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static int _reply(int fd, const char *fmt, ...) {
+	char line[REQUEST_MAX];
+	va_list va;
+	int n;
+
+	va_start(va, fmt);
+	n = vsnprintf(line, sizeof(line), fmt, va);
+	va_end(va);
+	if (n < 0 || n >= (int) sizeof(line))
+		return 0;
+	return _send_all(fd, line, n);
+}
+
+
+/* Growing output for JSON replies */
+struct Out {
+	char			*buff;
+	size_t			len;
+	size_t			alloc;
+};
+
+
+static void _put(struct Out *o, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void _put(struct Out *o, const char *fmt, ...) {
+	va_list va;
+	char *tmp;
+	int n;
+
+	va_start(va, fmt);
+	n = vsnprintf(o->buff + o->len, o->alloc - o->len, fmt, va);
+	va_end(va);
+	if (n < 0)
+		return;
+	if (o->len + n >= o->alloc) {
+		if (!(tmp = realloc(o->buff, (o->alloc = (o->len + n) * 2 + 256))))
+			return;
+		o->buff = tmp;
+		va_start(va, fmt);
+		vsnprintf(o->buff + o->len, o->alloc - o->len, fmt, va);
+		va_end(va);
+	}
+	o->len += n;
+}
+
+
+static void _put_string(struct Out *o, const char *s, int latin1) {
+	size_t n = json_quote(o->buff + o->len, o->alloc - o->len, s, latin1);
+	char *tmp;
+
+	if (o->len + n >= o->alloc) {
+		if (!(tmp = realloc(o->buff, (o->alloc = (o->len + n) * 2 + 256))))
+			return;
+		o->buff = tmp;
+		json_quote(o->buff + o->len, o->alloc - o->len, s, latin1);
+	}
+	o->len += n;
+}
+
+
+static uint8_t *_read_file(const char *path, off_t size, uint32_t *len) {
+	uint8_t *data;
+	uint32_t done;
+	ssize_t n;
+	int fd;
+
+	if (size <= 0 || size > MAX_FILE || (fd = open(path, O_RDONLY)) < 0)
+		return NULL;
+	if (!(data = malloc(size))) {
+		close(fd);
+		return NULL;
+	}
+	for (done = 0; done < size; done += n)
+		if ((n = read(fd, data + done, size - done)) <= 0)
+			break;
+	close(fd);
+	if (done != size) {
+		free(data);
+		return NULL;
+	}
+	*len = done;
+	return data;
+}
+
+
+/* Called with the cache lock held */
+static void _unlink(struct Module *m) {
+	if (m->prev)
+		m->prev->next = m->next;
+	else
+		cache.head = m->next;
+	if (m->next)
+		m->next->prev = m->prev;
+	else
+		cache.tail = m->prev;
+	m->prev = m->next = NULL;
+	cache.bytes -= m->image_len;
+}
+
+
+static void _push_front(struct Module *m) {
+	m->prev = NULL;
+	m->next = cache.head;
+	if (cache.head)
+		cache.head->prev = m;
+	else
+		cache.tail = m;
+	cache.head = m;
+	cache.bytes += m->image_len;
+}
+
+
+static void _module_free(struct Module *m) {
+	free(m->path);
+	free(m->image);
+	free(m);
+}
+
+
+static void _evict(void) {
+	struct Module *m, *prev;
+
+	for (m = cache.tail; m && cache.bytes > cache.max_bytes; m = prev) {
+		prev = m->prev;
+		if (m->refs)
+			continue;
+		_unlink(m);
+		_module_free(m);
+	}
+}
+
+
+static void _release(struct Module *m) {
+	pthread_mutex_lock(&cache.lock);
+	if (!--m->refs && m->stale)
+		_module_free(m);
+	else
+		_evict();
+	pthread_mutex_unlock(&cache.lock);
+}
+
+
+/* Compiled outside the lock, two jobs racing for the same new module both compile and the second one is kept */
+static struct Module *_acquire(const char *path) {
+	struct Module *m, *old;
+	uint8_t *data;
+	uint32_t len;
+	struct stat st;
+
+	if (stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+		return NULL;
+
+	pthread_mutex_lock(&cache.lock);
+	for (m = cache.head; m; m = m->next)
+		if (!strcmp(m->path, path))
+			break;
+	if (m && m->size == st.st_size && m->mtime.tv_sec == st.st_mtim.tv_sec && m->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+		_unlink(m);
+		_push_front(m);
+		m->refs++;
+		pthread_mutex_unlock(&cache.lock);
+		_count(&stats.hits);
+		return m;
+	}
+	pthread_mutex_unlock(&cache.lock);
+	_count(&stats.misses);
+
+	if (!(m = calloc(1, sizeof(*m))))
+		return NULL;
+	if (!(data = _read_file(path, st.st_size, &len)) || !rm_compile(data, len, &m->image, &m->image_len) || !(m->path = strdup(path))) {
+		free(data);
+		_module_free(m);
+		return NULL;
+	}
+	free(data);
+	m->size = st.st_size;
+	m->mtime = st.st_mtim;
+	m->refs = 1;
+
+	pthread_mutex_lock(&cache.lock);
+	for (old = cache.head; old; old = old->next)
+		if (!strcmp(old->path, path))
+			break;
+	if (old) {
+		_unlink(old);
+		if (old->refs)
+			old->stale = 1;
+		else
+			_module_free(old);
+	}
+	_push_front(m);
+	_evict();
+	pthread_mutex_unlock(&cache.lock);
+	return m;
+}
+
+
+static void _render(struct Job *job, struct Module *m) {
+	static const char *format[] = { "s16", "s16_fast", "u8", "mono" };
+	struct RickmodRenderParams *params = &job->params;
+	struct RickmodState *rm;
+	uint8_t buff[RENDER_CHUNK * 4];
+	uint32_t frames = 0, chunk, frame_size;
+
+	if (params->repeat && !params->max_frames) {
+		_reply(job->fd, "error repeat needs frames\n");
+		return;
+	}
+	if (!(rm = rm_init(params->sample_rate, m->image, m->image_len))) {
+		_reply(job->fd, "error not playable\n");
+		return;
+	}
+	rm_repeat_set(rm, params->repeat);
+	frame_size = params->format == RM_RENDER_U8 || params->format == RM_RENDER_S16_MONO ? 2 : 4;
+	if (!_reply(job->fd, "ok rate=%i format=%s frame_size=%u\n", params->sample_rate, format[params->format], frame_size)) {
+		rm_free(rm);
+		return;
+	}
+
+	/* Same chunking as rm_render(), so the stream is byte for byte what it would have returned */
+	while (!rm_end_reached(rm) && (!params->max_frames || frames < params->max_frames)) {
+		chunk = RENDER_CHUNK;
+		if (params->max_frames && frames + chunk > params->max_frames)
+			chunk = params->max_frames - frames;
+		if (params->format == RM_RENDER_S16)
+			rm_mix_s16(rm, (int16_t *) buff, chunk);
+		else if (params->format == RM_RENDER_S16_FAST)
+			rm_mix_s16_fast(rm, (int16_t *) buff, chunk);
+		else if (params->format == RM_RENDER_U8)
+			rm_mix_u8(rm, buff, chunk);
+		else
+			rm_mix_s16_mono(rm, (int16_t *) buff, chunk);
+		if (!_send_all(job->fd, buff, chunk * frame_size))
+			break;
+		frames += chunk;
+	}
+	rm_free(rm);
+}
+
+
+static void _probe(struct Job *job, struct Module *m) {
+	struct RickmodInfo info;
+	struct Out o = { 0 };
+	int i, last;
+
+	if (!rm_probe(m->image, m->image_len, &info)) {
+		_reply(job->fd, "error not playable\n");
+		return;
+	}
+	_put(&o, "ok\n{\"path\":");
+	_put_string(&o, job->path, 0);
+	_put(&o, ",\"size\":%lli,\"format\":", (long long) m->size);
+	_put_string(&o, info.tag, 1);
+	_put(&o, ",\"name\":");
+	_put_string(&o, info.name, 1);
+	_put(&o, ",\"channels\":%i,\"orders\":%i,\"patterns\":%i,\"speed\":%i,\"bpm\":%i,\"duration_ms\":%u,\"samples\":[",
+		info.channels, info.orders, info.patterns, info.initial_speed, info.initial_bpm, info.duration_ms);
+	/* Empty slots at the end are left out */
+	for (last = info.samples; last > 0 && !info.sample_name[last - 1][0]; last--);
+	for (i = 0; i < last; i++) {
+		_put(&o, i ? "," : "");
+		_put_string(&o, info.sample_name[i], 1);
+	}
+	_put(&o, "]}\n");
+	_send_all(job->fd, o.buff, o.len);
+	free(o.buff);
+}
+
+
+static void _analyze(struct Job *job, struct Module *m) {
+	struct RickmodOverviewParams params = { ANALYZE_RATE, ANALYZE_RATE / 10, ANALYZE_MAX_FRAMES };
+	struct RickmodOverview ov;
+	struct RickmodOverviewBucket *b;
+	struct RickmodInfo info;
+	struct Out o = { 0 };
+	double square = 0;
+	int peak = 0;
+	uint32_t i;
+
+	if (!rm_probe(m->image, m->image_len, &info) || !rm_overview(m->image, m->image_len, &params, &ov)) {
+		_reply(job->fd, "error not playable\n");
+		return;
+	}
+	for (i = 0; i < ov.buckets; i++) {
+		b = &ov.bucket[i];
+		if (-b->min > peak)
+			peak = -b->min;
+		if (b->max > peak)
+			peak = b->max;
+		square += (double) b->rms * b->rms;
+	}
+
+	_put(&o, "ok\n{\"duration_ms\":%u,\"peak\":%i,\"rms\":%.0f,\"overview\":[", info.duration_ms, peak, ov.buckets ? sqrt(square / ov.buckets) : 0.0);
+	for (i = 0; i < ov.buckets; i++)
+		_put(&o, "%s[%i,%i,%u]", i ? "," : "", ov.bucket[i].min, ov.bucket[i].max, ov.bucket[i].rms);
+	_put(&o, "]}\n");
+	_send_all(job->fd, o.buff, o.len);
+	free(o.buff);
+	rm_overview_free(&ov);
+}
+
+
+static void _snapshot(struct Job *job, struct Module *m) {
+	if (_reply(job->fd, "ok size=%u\n", m->image_len))
+		_send_all(job->fd, m->image, m->image_len);
+}
+
+
+static void _done(struct Job *job) {
+	int i;
+
+	pthread_mutex_lock(&queue.lock);
+	for (i = 0; i < MAX_CLIENTS; i++)
+		if (client[i].jobs && client[i].uid == job->uid) {
+			client[i].jobs--;
+			break;
+		}
+	pthread_mutex_unlock(&queue.lock);
+	close(job->fd);
+	free(job);
+}
+
+
+static void *_worker(void *data) {
+	struct Module *m;
+	struct Job *job;
+
+	(void) data;
+	for (;;) {
+		pthread_mutex_lock(&queue.lock);
+		while (!queue.queued)
+			pthread_cond_wait(&queue.not_empty, &queue.lock);
+		job = queue.job[queue.tail];
+		queue.tail = (queue.tail + 1) % queue.depth;
+		queue.queued--;
+		pthread_mutex_unlock(&queue.lock);
+
+		if (!(m = _acquire(job->path))) {
+			_reply(job->fd, "error unable to load %s\n", job->path);
+			_count(&stats.failed);
+			_done(job);
+			continue;
+		}
+		if (job->type == JOB_RENDER)
+			_render(job, m);
+		else if (job->type == JOB_PROBE)
+			_probe(job, m);
+		else if (job->type == JOB_ANALYZE)
+			_analyze(job, m);
+		else
+			_snapshot(job, m);
+		_release(m);
+		_count(&stats.done);
+		_done(job);
+	}
+
+	return NULL;
+}
+
+
+/* Queue depth first, so one client can't fill the queue with jobs the quota would turn away anyway */
+static const char *_enqueue(struct Job *job) {
+	int i, slot = -1;
+
+	pthread_mutex_lock(&queue.lock);
+	if (queue.queued >= queue.depth) {
+		pthread_mutex_unlock(&queue.lock);
+		return "queue";
+	}
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		if (client[i].jobs && client[i].uid == job->uid) {
+			slot = i;
+			break;
+		}
+		if (!client[i].jobs && slot < 0)
+			slot = i;
+	}
+	if (slot < 0 || client[slot].jobs >= quota) {
+		pthread_mutex_unlock(&queue.lock);
+		return "quota";
+	}
+	client[slot].uid = job->uid;
+	client[slot].jobs++;
+	queue.job[queue.head] = job;
+	queue.head = (queue.head + 1) % queue.depth;
+	queue.queued++;
+	pthread_cond_signal(&queue.not_empty);
+	pthread_mutex_unlock(&queue.lock);
+	return NULL;
+}
+
+
+/* Options come first, everything after them is the path so it may contain spaces */
+static int _parse(struct Job *job, char *line) {
+	static const char *format[] = { "s16", "s16_fast", "u8", "mono" };
+	char *p = line, *word, *value, *space;
+	int i;
+
+	job->params.sample_rate = 44100;
+	job->params.format = RM_RENDER_S16;
+	if (!(word = strsep(&p, " ")) || !p)
+		return 0;
+	if (!strcmp(word, "render"))
+		job->type = JOB_RENDER;
+	else if (!strcmp(word, "probe"))
+		job->type = JOB_PROBE;
+	else if (!strcmp(word, "analyze"))
+		job->type = JOB_ANALYZE;
+	else if (!strcmp(word, "snapshot"))
+		job->type = JOB_SNAPSHOT;
+	else
+		return 0;
+
+	while ((space = strchr(p, ' ')) && (value = memchr(p, '=', space - p))) {
+		word = strsep(&p, " ");
+		*value++ = 0;
+		if (!strcmp(word, "rate"))
+			job->params.sample_rate = atoi(value);
+		else if (!strcmp(word, "frames"))
+			job->params.max_frames = strtoul(value, NULL, 10);
+		else if (!strcmp(word, "repeat"))
+			job->params.repeat = atoi(value) != 0;
+		else if (!strcmp(word, "format")) {
+			for (i = 0; i < 4 && strcmp(value, format[i]); i++);
+			if (i == 4)
+				return 0;
+			job->params.format = i;
+		} else
+			return 0;
+	}
+	if (!*p || job->params.sample_rate < 1000 || job->params.sample_rate > 192000)
+		return 0;
+	strcpy(job->path, p);
+	return 1;
+}
+
+
+static void _stats(int fd) {
+	uint32_t queued, modules = 0;
+	uint64_t bytes;
+	struct Module *m;
+
+	pthread_mutex_lock(&queue.lock);
+	queued = queue.queued;
+	pthread_mutex_unlock(&queue.lock);
+	pthread_mutex_lock(&cache.lock);
+	for (m = cache.head; m; m = m->next)
+		modules++;
+	bytes = cache.bytes;
+	pthread_mutex_unlock(&cache.lock);
+
+	_reply(fd, "ok\n{\"accepted\":%llu,\"done\":%llu,\"failed\":%llu,\"busy\":%llu,\"queued\":%u,\"cache_hits\":%llu,\"cache_misses\":%llu,\"modules\":%u,\"cache_bytes\":%llu}\n",
+		(unsigned long long) _load(&stats.accepted), (unsigned long long) _load(&stats.done), (unsigned long long) _load(&stats.failed),
+		(unsigned long long) _load(&stats.busy), queued, (unsigned long long) _load(&stats.hits), (unsigned long long) _load(&stats.misses),
+		modules, (unsigned long long) bytes);
+}
+
+
+static int64_t _now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/*
+ * The socket is still non-blocking here, so nothing a client does can hold up the acceptor.
+ * Jobs get it back blocking, with a timeout for clients that stop reading their stream.
+ */
+static void _request(int fd, char *line) {
+	struct timeval send_timeout = { SEND_TIMEOUT, 0 };
+	const char *busy;
+	struct Job *job;
+	#ifdef SO_PEERCRED
+	struct ucred cred;
+	socklen_t cred_len = sizeof(cred);
+	#endif
+
+	if (!strcmp(line, "stats")) {
+		_stats(fd);
+		close(fd);
+		return;
+	}
+	if (!(job = calloc(1, sizeof(*job)))) {
+		close(fd);
+		return;
+	}
+	job->fd = fd;
+	/* Without peer credentials every client shares one quota */
+	#ifdef SO_PEERCRED
+	if (!getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len))
+		job->uid = cred.uid;
+	#endif
+
+	if (!_parse(job, line)) {
+		_reply(fd, "error bad request\n");
+		close(fd);
+		free(job);
+		return;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+	if ((busy = _enqueue(job))) {
+		_reply(fd, "busy %s\n", busy);
+		_count(&stats.busy);
+		close(fd);
+		free(job);
+		return;
+	}
+	_count(&stats.accepted);
+}
+
+
+static void _drop(int i) {
+	close(pending[i]->fd);
+	free(pending[i]);
+	pending[i] = pending[--pendings];
+}
+
+
+/* Takes what the client has sent so far, the request goes to _request() once its line is complete */
+static void _receive(int i) {
+	struct Pending *p = pending[i];
+	ssize_t n;
+	char *end;
+
+	if ((n = recv(p->fd, p->line + p->len, REQUEST_MAX - 1 - p->len, 0)) < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (n <= 0) {
+		_drop(i);
+		return;
+	}
+	p->len += n;
+	p->line[p->len] = 0;
+	if (!(end = strchr(p->line, '\n'))) {
+		if (p->len >= REQUEST_MAX - 1)
+			_drop(i);
+		return;
+	}
+	*end = 0;
+	pending[i] = pending[--pendings];
+	_request(p->fd, p->line);
+	free(p);
+}
+
+
+/* Waits for new connections and for request lines at once, everything that touches a module runs on the workers */
+static void _serve(int fd) {
+	struct pollfd pfd[MAX_PENDING + 1];
+	int64_t now;
+	int i, conn, timeout;
+
+	while (!stop) {
+		now = _now();
+		timeout = -1;
+		for (i = 0; i < pendings;) {
+			if (pending[i]->deadline <= now) {
+				_drop(i);
+				continue;
+			}
+			if (timeout < 0 || pending[i]->deadline - now < timeout)
+				timeout = pending[i]->deadline - now;
+			pfd[i + 1].fd = pending[i]->fd;
+			pfd[i + 1].events = POLLIN;
+			i++;
+		}
+		/* Connections wait in the backlog while the table is full */
+		pfd[0].fd = fd;
+		pfd[0].events = pendings < MAX_PENDING ? POLLIN : 0;
+		if (poll(pfd, pendings + 1, timeout) <= 0)
+			continue;
+
+		/* Backwards, a finished entry is replaced by the last one and that was already looked at */
+		for (i = pendings; i-- > 0;)
+			if (pfd[i + 1].revents)
+				_receive(i);
+		if (!(pfd[0].revents & POLLIN) || (conn = accept4(fd, NULL, NULL, SOCK_NONBLOCK)) < 0)
+			continue;
+		if (!(pending[pendings] = malloc(sizeof(**pending)))) {
+			close(conn);
+			continue;
+		}
+		pending[pendings]->fd = conn;
+		pending[pendings]->len = 0;
+		pending[pendings]->deadline = _now() + RECV_TIMEOUT * 1000;
+		pendings++;
+	}
+}
+
+
+static void _stop(int sig) {
+	(void) sig;
+	stop = 1;
+}
+
+
+int main(int argc, char **argv) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct sigaction sa = { .sa_handler = _stop };
+	pthread_t thread;
+	int i, fd, threads = sysconf(_SC_NPROCESSORS_ONLN), depth = 64, per_client = 8, cache_mb = 256;
+
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if (!strcmp(argv[i], "-j") && i + 1 < argc)
+			threads = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-q") && i + 1 < argc)
+			depth = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-c") && i + 1 < argc)
+			per_client = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-m") && i + 1 < argc)
+			cache_mb = atoi(argv[++i]);
+	}
+	if (i != argc - 1 || threads < 1 || depth < 1 || per_client < 1 || cache_mb < 0 || strlen(argv[i]) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Usage: %s [-j threads] [-q depth] [-c per client] [-m cache MB] socket\n", argv[0]);
+		return 1;
+	}
+	queue.depth = depth;
+	quota = per_client;
+	cache.max_bytes = (uint64_t) cache_mb << 20;
+	if (!(queue.job = calloc(queue.depth, sizeof(*queue.job)))) {
+		perror("calloc");
+		return 1;
+	}
+
+	strcpy(addr.sun_path, argv[i]);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		perror("socket");
+		return 1;
+	}
+	unlink(addr.sun_path);
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 128) < 0) {
+		perror(addr.sun_path);
+		return 1;
+	}
+
+	/* Without SA_RESTART, so a signal gets poll() out of its wait */
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+	for (; threads; threads--)
+		if (pthread_create(&thread, NULL, _worker, NULL)) {
+			perror("pthread_create");
+			return 1;
+		}
+
+	_serve(fd);
+
+	/* Jobs still running are cut off, clients see their stream end early */
+	close(fd);
+	unlink(addr.sun_path);
+	return 0;
+}
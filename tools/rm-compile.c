@@ -0,0 +1,69 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "rickmod.h"
+
+/*
+ * Compiles a module into an image that rm_init() and rm_open_file() play without parsing, usage: rm-compile module out
+ * The image is tied to the build that wrote it, keep the modules around and recompile after upgrading.
+ */
+
+
+static int _write(const char *path, const uint8_t *data, uint32_t len) {
+	char tmp[4096];
+	FILE *fp;
+	int ok;
+
+	/* Players may have the old image mapped, so it's replaced rather than written over */
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if (!(fp = fopen(tmp, "wb")))
+		return 0;
+	ok = fwrite(data, 1, len, fp) == len;
+	ok = !fclose(fp) && ok;
+	if (ok && !rename(tmp, path))
+		return 1;
+	remove(tmp);
+	return 0;
+}
+
+
+int main(int argc, char **argv) {
+	uint8_t *data, *image;
+	uint32_t image_len;
+	FILE *fp;
+	long len;
+
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s module out\n", argv[0]);
+		return 1;
+	}
+	if (!(fp = fopen(argv[1], "rb"))) {
+		fprintf(stderr, "Unable to open %s\n", argv[1]);
+		return 1;
+	}
+	fseek(fp, 0, SEEK_END);
+	len = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	data = malloc(len);
+	if (!data || fread(data, 1, len, fp) != (size_t) len) {
+		fprintf(stderr, "Unable to read %s\n", argv[1]);
+		return 1;
+	}
+	fclose(fp);
+
+	if (!rm_compile(data, len, &image, &image_len)) {
+		fprintf(stderr, "%s is not a module rickmod can play\n", argv[1]);
+		return 1;
+	}
+	if (!_write(argv[2], image, image_len)) {
+		fprintf(stderr, "Unable to write %s\n", argv[2]);
+		return 1;
+	}
+	fprintf(stderr, "%s: %li bytes, compiled %u bytes\n", argv[2], len, image_len);
+
+	free(image);
+	free(data);
+	return 0;
+}
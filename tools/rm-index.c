@@ -0,0 +1,271 @@
+#define	_GNU_SOURCE
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "rickmod.h"
+#include "json.h"
+
+/*
+ * Indexes every module below the given directories as JSON lines, usage: rm-index [-j threads] [-d] dir...
+ * The walk feeds a queue that a pool of workers reads, probes and hashes from, -d also measures the duration.
+ */
+
+#define	QUEUE_LEN 1024 // Must be a power of two
+#define	OUT_BATCH 65536 // Twice the longest line
+#define	MAX_FILE (64 << 20)
+#define	DURATION_RATE 44100
+#define	DURATION_MAX (DURATION_RATE * 3600ULL * 4)
+
+
+struct Worker {
+	pthread_t		thread;
+	uint8_t			*buff;
+	uint32_t		buff_len;
+	char			*out;
+	uint32_t		out_len;
+	uint64_t		indexed;
+	uint64_t		skipped;
+};
+
+
+static struct {
+	char			*path[QUEUE_LEN];
+	uint32_t		head;
+	uint32_t		tail;
+	int			done;
+	pthread_mutex_t		lock;
+	pthread_cond_t		not_empty;
+	pthread_cond_t		not_full;
+} queue = { .lock = PTHREAD_MUTEX_INITIALIZER, .not_empty = PTHREAD_COND_INITIALIZER, .not_full = PTHREAD_COND_INITIALIZER };
+
+static pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+static int duration;
+
+
+static void _push(char *path) {
+	pthread_mutex_lock(&queue.lock);
+	while (queue.head - queue.tail == QUEUE_LEN)
+		pthread_cond_wait(&queue.not_full, &queue.lock);
+	queue.path[queue.head++ & (QUEUE_LEN - 1)] = path;
+	pthread_cond_signal(&queue.not_empty);
+	pthread_mutex_unlock(&queue.lock);
+}
+
+
+static char *_pop(void) {
+	char *path = NULL;
+
+	pthread_mutex_lock(&queue.lock);
+	while (queue.head == queue.tail && !queue.done)
+		pthread_cond_wait(&queue.not_empty, &queue.lock);
+	if (queue.head != queue.tail) {
+		path = queue.path[queue.tail++ & (QUEUE_LEN - 1)];
+		pthread_cond_signal(&queue.not_full);
+	}
+	pthread_mutex_unlock(&queue.lock);
+	return path;
+}
+
+
+static void _walk(const char *dir) {
+	struct dirent *de;
+	struct stat st;
+	char *path;
+	DIR *d;
+	int type;
+
+	if (!(d = opendir(dir)))
+		return;
+	while ((de = readdir(d))) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		if (asprintf(&path, "%s/%s", dir, de->d_name) < 0)
+			continue;
+		type = de->d_type;
+		if (type == DT_UNKNOWN && !lstat(path, &st))
+			type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+		if (type == DT_DIR) {
+			_walk(path);
+			free(path);
+		} else if (type == DT_REG) {
+			_push(path);
+		} else
+			free(path);
+	}
+	closedir(d);
+}
+
+
+static void _flush(struct Worker *w) {
+	pthread_mutex_lock(&out_lock);
+	fwrite(w->out, 1, w->out_len, stdout);
+	pthread_mutex_unlock(&out_lock);
+	w->out_len = 0;
+}
+
+
+static void _put(struct Worker *w, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void _put(struct Worker *w, const char *fmt, ...) {
+	va_list va;
+	int n;
+
+	va_start(va, fmt);
+	n = vsnprintf(w->out + w->out_len, OUT_BATCH - w->out_len, fmt, va);
+	va_end(va);
+	if (n > 0 && w->out_len + n < OUT_BATCH)
+		w->out_len += n;
+}
+
+
+static void _put_string(struct Worker *w, const char *s, int latin1) {
+	size_t n = json_quote(w->out + w->out_len, OUT_BATCH - w->out_len, s, latin1);
+
+	if (w->out_len + n < OUT_BATCH)
+		w->out_len += n;
+}
+
+
+static uint64_t _fnv(const uint8_t *data, uint32_t len) {
+	uint64_t h = 0xCBF29CE484222325ULL;
+
+	while (len--)
+		h = (h ^ *data++) * 0x100000001B3ULL;
+	return h;
+}
+
+
+static int _read(struct Worker *w, const char *path, uint32_t *len) {
+	struct stat st;
+	uint32_t done;
+	ssize_t n;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return 0;
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size < 48 || st.st_size > MAX_FILE) {
+		close(fd);
+		return 0;
+	}
+	if (st.st_size > w->buff_len) {
+		free(w->buff);
+		w->buff_len = st.st_size;
+		if (!(w->buff = malloc(w->buff_len))) {
+			w->buff_len = 0;
+			close(fd);
+			return 0;
+		}
+	}
+	posix_fadvise(fd, 0, st.st_size, POSIX_FADV_SEQUENTIAL);
+	for (done = 0; done < st.st_size; done += n)
+		if ((n = read(fd, w->buff + done, st.st_size - done)) <= 0)
+			break;
+	close(fd);
+	*len = done;
+	return done == st.st_size;
+}
+
+
+static void _index(struct Worker *w, const char *path) {
+	struct RickmodInfo info;
+	struct RickmodState *rm;
+	uint32_t len;
+	int i, last;
+
+	if (!_read(w, path, &len) || !rm_probe(w->buff, len, &info)) {
+		w->skipped++;
+		return;
+	}
+
+	if (OUT_BATCH - w->out_len < OUT_BATCH / 2)
+		_flush(w);
+	_put(w, "{\"path\":");
+	_put_string(w, path, 0);
+	_put(w, ",\"size\":%u,\"fnv1a64\":\"%.16llx\",\"format\":", len, (unsigned long long) _fnv(w->buff, len));
+	_put_string(w, info.tag, 1);
+	_put(w, ",\"name\":");
+	_put_string(w, info.name, 1);
+	_put(w, ",\"channels\":%i,\"orders\":%i,\"patterns\":%i,\"speed\":%i,\"bpm\":%i,\"truncated\":%s,\"samples\":[",
+		info.channels, info.orders, info.patterns, info.initial_speed, info.initial_bpm, info.data_len > len ? "true" : "false");
+	/* Empty slots at the end are left out */
+	for (last = info.samples; last > 0 && !info.sample_name[last - 1][0]; last--);
+	for (i = 0; i < last; i++) {
+		_put(w, i ? "," : "");
+		_put_string(w, info.sample_name[i], 1);
+	}
+	_put(w, "]");
+
+	/* Compiled modules were measured when they were compiled */
+	if (duration && info.duration_ms) {
+		_put(w, ",\"duration_ms\":%u", info.duration_ms);
+	} else if (duration && (rm = rm_init(DURATION_RATE, w->buff, len))) {
+		_put(w, ",\"duration_ms\":%llu", (unsigned long long) (rm_measure(rm, DURATION_MAX) * 1000 / DURATION_RATE));
+		rm_free(rm);
+	}
+	_put(w, "}\n");
+	w->indexed++;
+}
+
+
+static void *_worker(void *data) {
+	struct Worker *w = data;
+	char *path;
+
+	while ((path = _pop())) {
+		_index(w, path);
+		free(path);
+	}
+	_flush(w);
+	return NULL;
+}
+
+
+int main(int argc, char **argv) {
+	struct Worker *worker;
+	uint64_t indexed = 0, skipped = 0;
+	int i, t, threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if (!strcmp(argv[i], "-j") && i + 1 < argc)
+			threads = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-d"))
+			duration = 1;
+	}
+	if (i == argc || threads < 1) {
+		fprintf(stderr, "Usage: %s [-j threads] [-d] dir...\n", argv[0]);
+		return 1;
+	}
+
+	worker = calloc(threads, sizeof(*worker));
+	for (t = 0; t < threads; t++) {
+		worker[t].out = malloc(OUT_BATCH);
+		pthread_create(&worker[t].thread, NULL, _worker, &worker[t]);
+	}
+
+	for (; i < argc; i++)
+		_walk(argv[i]);
+	pthread_mutex_lock(&queue.lock);
+	queue.done = 1;
+	pthread_cond_broadcast(&queue.not_empty);
+	pthread_mutex_unlock(&queue.lock);
+
+	for (t = 0; t < threads; t++) {
+		pthread_join(worker[t].thread, NULL);
+		indexed += worker[t].indexed;
+		skipped += worker[t].skipped;
+		free(worker[t].buff);
+		free(worker[t].out);
+	}
+	fprintf(stderr, "%llu modules indexed, %llu files skipped\n", (unsigned long long) indexed, (unsigned long long) skipped);
+	free(worker);
+
+	return 0;
+}
@@ -0,0 +1,80 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "rickmod.h"
+
+/*
+ * Writes a smaller module that plays the same, usage: rm-optimize module out
+ * Duplicate patterns and samples are merged and what the song never plays is left out.
+ */
+
+
+static int _write(const char *path, const uint8_t *data, uint32_t len) {
+	char tmp[4096];
+	FILE *fp;
+	int ok;
+
+	/* Optimizing a module onto itself must not lose it if the write fails */
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if (!(fp = fopen(tmp, "wb")))
+		return 0;
+	ok = fwrite(data, 1, len, fp) == len;
+	ok = !fclose(fp) && ok;
+	if (ok && !rename(tmp, path))
+		return 1;
+	remove(tmp);
+	return 0;
+}
+
+
+int main(int argc, char **argv) {
+	struct RickmodOptimizeStats stats;
+	struct RickmodState *rm;
+	uint8_t *data, *out;
+	uint32_t out_len;
+	FILE *fp;
+	long len;
+
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s module out\n", argv[0]);
+		return 1;
+	}
+	if (!(fp = fopen(argv[1], "rb"))) {
+		fprintf(stderr, "Unable to open %s\n", argv[1]);
+		return 1;
+	}
+	fseek(fp, 0, SEEK_END);
+	len = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	data = malloc(len);
+	if (!data || fread(data, 1, len, fp) != (size_t) len) {
+		fprintf(stderr, "Unable to read %s\n", argv[1]);
+		return 1;
+	}
+	fclose(fp);
+
+	if (!(rm = rm_init(44100, data, len))) {
+		fprintf(stderr, "%s is not a module rickmod can play\n", argv[1]);
+		return 1;
+	}
+	if (!rm_optimize(rm, &stats)) {
+		fprintf(stderr, "Unable to optimize %s, only protracker modules can be\n", argv[1]);
+		return 1;
+	}
+	if (!rm_save_mem(rm, &out, &out_len) || !_write(argv[2], out, out_len)) {
+		fprintf(stderr, "Unable to write %s\n", argv[2]);
+		return 1;
+	}
+
+	fprintf(stderr, "%s: %u -> %u bytes, patterns %u -> %u, %u samples merged, %u dropped, %u bytes of silence trimmed\n",
+		argv[2], stats.bytes_before, stats.bytes_after, stats.patterns_before, stats.patterns_after,
+		stats.samples_merged, stats.samples_dropped, stats.bytes_trimmed);
+	fprintf(stderr, "render hash %016llx\n", (unsigned long long) stats.render_hash);
+
+	free(out);
+	rm_free(rm);
+	free(data);
+	return 0;
+}